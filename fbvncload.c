@@ -0,0 +1,483 @@
+/*
+ * fbvncload.c
+ * This file is part of the vircon virtual console driver and service.
+ * Copyright (C) 2015 Dirk Herrendoerfer
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * Load generator for fbvncserver: runs a number of headless viewers
+ * against one server and reports what each of them received.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <linux/tcp.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+
+/* libvncclient */
+#include "rfb/rfbclient.h"
+#include "rfb/keysym.h"
+
+/*****************************************************************************/
+
+static char *host = "127.0.0.1";
+static int port = 5900;
+static int nclients = 1;
+static int duration = 10;
+static int bpp = 32;
+static char *encodings = "raw";
+static int drain = 0;
+static int key_rate = 0;
+static int move_rate = 0;
+static int verbose = 0;
+static int server_pid = 0;
+
+static char pidfile[]="/var/run/fbvncserver.pid";
+
+static volatile int stop = 0;
+
+struct load_client {
+	int id;
+	pthread_t thread;
+	int connected;
+	double start;
+	double end;
+	double input;		/* oldest input not answered by an update, or 0 */
+	unsigned long frames;
+	unsigned long long bytes;
+	unsigned long keys;
+	unsigned long moves;
+	double *lat;		/* input to update latencies in seconds */
+	unsigned long nlat;
+	unsigned long lat_size;
+};
+
+static struct load_client *clients;
+
+/* Tag for rfbClientSetClientData */
+static int load_tag;
+
+/*****************************************************************************/
+
+static double now_seconds(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void load_log(const char *format, ...)
+{
+	va_list args;
+
+	if (!verbose)
+		return;
+	va_start(args, format);
+	vfprintf(stderr, format, args);
+	va_end(args);
+}
+
+/* Bytes the kernel has handed to us on this connection so far, taken from
+ * TCP_INFO so that the count covers protocol overhead as well. */
+static unsigned long long load_bytes(rfbClient *cl)
+{
+	struct tcp_info ti;
+	socklen_t len = sizeof(ti);
+
+	memset(&ti, 0, sizeof(ti));
+	if (getsockopt(cl->sock, IPPROTO_TCP, TCP_INFO, &ti, &len) < 0)
+		return 0;
+	return ti.tcpi_bytes_received;
+}
+
+/* Incremental requests are held by the server until something changes,
+ * so the time between updates says nothing about latency. The latency is
+ * taken from the oldest input sent with -k or -m to the first update
+ * completed after it. */
+static void load_update_done(rfbClient *cl)
+{
+	struct load_client *lc = rfbClientGetClientData(cl, &load_tag);
+	double t = now_seconds();
+
+	lc->frames++;
+	if (lc->input == 0)
+		return;
+	if (lc->nlat == lc->lat_size) {
+		lc->lat_size = lc->lat_size ? lc->lat_size * 2 : 1024;
+		lc->lat = realloc(lc->lat, lc->lat_size * sizeof(double));
+		assert(lc->lat != NULL);
+	}
+	lc->lat[lc->nlat++] = t - lc->input;
+	lc->input = 0;
+}
+
+/* With -D the pixel data is still decompressed, but never stored */
+static void drain_fill(rfbClient *cl, int x, int y, int w, int h, uint32_t colour)
+{
+}
+
+static void drain_bitmap(rfbClient *cl, const uint8_t *buffer, int x, int y, int w, int h)
+{
+}
+
+static void drain_copy(rfbClient *cl, int sx, int sy, int w, int h, int dx, int dy)
+{
+}
+
+static void load_format(rfbClient *cl)
+{
+	switch (bpp) {
+	case 8:
+		/* BGR233, as most viewers ask for it */
+		cl->format.bitsPerPixel = 8;
+		cl->format.depth = 8;
+		cl->format.redMax = 7;
+		cl->format.greenMax = 7;
+		cl->format.blueMax = 3;
+		cl->format.redShift = 0;
+		cl->format.greenShift = 3;
+		cl->format.blueShift = 6;
+		break;
+	case 16:
+		cl->format.bitsPerPixel = 16;
+		cl->format.depth = 16;
+		cl->format.redMax = 31;
+		cl->format.greenMax = 63;
+		cl->format.blueMax = 31;
+		cl->format.redShift = 11;
+		cl->format.greenShift = 5;
+		cl->format.blueShift = 0;
+		break;
+	}
+}
+
+/* Types and erases a character and moves the pointer around the screen
+ * at the rates given with -k and -m. */
+static void load_input(rfbClient *cl, struct load_client *lc, double t,
+		       double *next_key, double *next_move)
+{
+	if (key_rate > 0 && t >= *next_key) {
+		rfbKeySym key = (lc->keys & 1) ? XK_BackSpace : XK_x;
+
+		if (lc->input == 0)
+			lc->input = t;
+		SendKeyEvent(cl, key, TRUE);
+		SendKeyEvent(cl, key, FALSE);
+		lc->keys++;
+		*next_key += 1.0 / key_rate;
+	}
+	if (move_rate > 0 && t >= *next_move && cl->width > 0 && cl->height > 0) {
+		int x = (lc->moves * 7) % cl->width;
+		int y = (lc->moves * 5) % cl->height;
+
+		if (lc->input == 0)
+			lc->input = t;
+		SendPointerEvent(cl, x, y, 0);
+		lc->moves++;
+		*next_move += 1.0 / move_rate;
+	}
+}
+
+static void *load_thread(void *arg)
+{
+	struct load_client *lc = arg;
+	rfbClient *cl;
+	double next_key, next_move;
+	int n;
+
+	cl = rfbGetClient(8, 3, 4);
+	if (cl == NULL)
+		return NULL;
+	load_format(cl);
+	cl->appData.encodingsString = encodings;
+	cl->serverHost = strdup(host);
+	cl->serverPort = port;
+	cl->canHandleNewFBSize = TRUE;
+	cl->FinishedFrameBufferUpdate = load_update_done;
+	if (drain) {
+		cl->GotFillRect = drain_fill;
+		cl->GotBitmap = drain_bitmap;
+		cl->GotCopyRect = drain_copy;
+	}
+	rfbClientSetClientData(cl, &load_tag, lc);
+
+	lc->start = now_seconds();
+	/* Frees the client on failure */
+	if (!rfbInitClient(cl, NULL, NULL)) {
+		fprintf(stderr, "client %d: can't connect to %s:%d\n", lc->id, host, port);
+		return NULL;
+	}
+	lc->connected = 1;
+	next_key = next_move = lc->start;
+
+	while (!stop) {
+		n = WaitForMessage(cl, 10000);
+		if (n < 0)
+			break;
+		if (n > 0 && !HandleRFBServerMessage(cl))
+			break;
+		load_input(cl, lc, now_seconds(), &next_key, &next_move);
+	}
+	if (!stop)
+		fprintf(stderr, "client %d: connection lost\n", lc->id);
+
+	lc->end = now_seconds();
+	lc->bytes = load_bytes(cl);
+	rfbClientCleanup(cl);
+	return NULL;
+}
+
+/*****************************************************************************/
+
+static int read_pid(void)
+{
+	FILE *f;
+	int pid = 0;
+
+	f = fopen(pidfile, "r");
+	if (f == NULL)
+		return 0;
+	if (fscanf(f, "%d", &pid) != 1)
+		pid = 0;
+	fclose(f);
+	return pid;
+}
+
+/* User and system time of a process in seconds, from /proc/pid/stat */
+static int proc_cpu(int pid, double *user, double *sys)
+{
+	char path[64], buf[1024], *p;
+	unsigned long ut, st;
+	FILE *f;
+	int n;
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+	f = fopen(path, "r");
+	if (f == NULL)
+		return -1;
+	n = fread(buf, 1, sizeof(buf) - 1, f);
+	fclose(f);
+	buf[n > 0 ? n : 0] = 0;
+
+	/* The command name may contain spaces, the fields start after it */
+	p = strrchr(buf, ')');
+	if (p == NULL || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+				&ut, &st) != 2)
+		return -1;
+	*user = (double)ut / sysconf(_SC_CLK_TCK);
+	*sys = (double)st / sysconf(_SC_CLK_TCK);
+	return 0;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double percentile(struct load_client *lc, int pct)
+{
+	unsigned long i;
+
+	if (lc->nlat == 0)
+		return 0;
+	i = (lc->nlat - 1) * pct / 100;
+	return lc->lat[i] * 1000;
+}
+
+static void report(double server_user, double server_sys, double cpu_time,
+		   double elapsed)
+{
+	unsigned long frames = 0;
+	unsigned long long bytes = 0;
+	double fps = 0, max = 0;
+	struct rusage ru;
+	int i, up = 0;
+
+	/* Latency columns need input, -k or -m */
+	printf("client   frames      fps      KiB/s  input lat avg    p50    p99    max (ms)\n");
+	for (i = 0; i < nclients; i++) {
+		struct load_client *lc = &clients[i];
+		double t = lc->end - lc->start, sum = 0;
+		unsigned long j;
+
+		if (!lc->connected) {
+			printf("%6d   not connected\n", i);
+			continue;
+		}
+		qsort(lc->lat, lc->nlat, sizeof(double), cmp_double);
+		for (j = 0; j < lc->nlat; j++)
+			sum += lc->lat[j];
+		printf("%6d %8lu %8.1f %10.1f %14.2f %6.2f %6.2f %6.2f\n", i,
+		       lc->frames, lc->frames / t, lc->bytes / 1024.0 / t,
+		       lc->nlat ? sum * 1000 / lc->nlat : 0,
+		       percentile(lc, 50), percentile(lc, 99), percentile(lc, 100));
+		frames += lc->frames;
+		bytes += lc->bytes;
+		fps += lc->frames / t;
+		if (percentile(lc, 100) > max)
+			max = percentile(lc, 100);
+		up++;
+	}
+	printf(" total %8lu %8.1f %10.1f %35.2f\n", frames, fps,
+	       bytes / 1024.0 / elapsed, max);
+	printf("%d of %d clients connected, %.1f s\n", up, nclients, elapsed);
+
+	if (server_pid > 0 && server_user >= 0)
+		printf("server cpu: %.1f%% (user %.2f s, sys %.2f s)\n",
+		       (server_user + server_sys) * 100 / cpu_time, server_user, server_sys);
+	getrusage(RUSAGE_SELF, &ru);
+	printf("load cpu:   %.1f%% (user %.2f s, sys %.2f s)\n",
+	       (ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+		ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6) * 100 / cpu_time,
+	       ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6,
+	       ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6);
+}
+
+/*****************************************************************************/
+
+void print_usage(char **argv)
+{
+	fprintf(stdout, "%s [-n clients] [-s host] [-p port] [-t seconds] [-H]\n"
+		"-n clients: number of viewers, default is %d\n"
+		"-s host: server address, default is %s\n"
+		"-p port: server port, default is %d\n"
+		"-t seconds: run time, default is %d\n"
+		"-e encodings: encodings to ask for, default is '%s'\n"
+		"-b bpp: pixel format, 8 (BGR233), 16 (RGB565) or 32, default is %d\n"
+		"-D : drain updates without storing the pixels\n"
+		"-k rate: key presses per second and client, default is off\n"
+		"-m rate: pointer moves per second and client, default is off\n"
+		"-P pid: server process for the CPU figures, default is from %s\n"
+		"-v : show libvncclient messages\n"
+		"-H : print this help\n", argv[0], nclients, host, port, duration,
+		encodings, bpp, pidfile);
+}
+
+int main(int argc, char **argv)
+{
+	double start, cpu_time, elapsed, su0 = 0, ss0 = 0, su1 = -1, ss1 = 0;
+	int i;
+
+	if(argc > 1) {
+		i=1;
+		while(i < argc) {
+			if(*argv[i] == '-') {
+				switch(*(argv[i] + 1))
+				{
+					case 'H':
+						print_usage(argv);
+						exit(0);
+						break;
+					case 'D':
+						drain=1;
+						break;
+					case 'v':
+						verbose=1;
+						break;
+					case 'n':
+						i++;
+						nclients = atoi(argv[i]);
+						break;
+					case 's':
+						i++;
+						host = argv[i];
+						break;
+					case 'p':
+						i++;
+						port = atoi(argv[i]);
+						break;
+					case 't':
+						i++;
+						duration = atoi(argv[i]);
+						break;
+					case 'e':
+						i++;
+						encodings = argv[i];
+						break;
+					case 'b':
+						i++;
+						bpp = atoi(argv[i]);
+						break;
+					case 'k':
+						i++;
+						key_rate = atoi(argv[i]);
+						break;
+					case 'm':
+						i++;
+						move_rate = atoi(argv[i]);
+						break;
+					case 'P':
+						i++;
+						server_pid = atoi(argv[i]);
+						break;
+				}
+			}
+			i++;
+		}
+	}
+
+	if (nclients <= 0 || duration <= 0 || (bpp != 8 && bpp != 16 && bpp != 32)) {
+		print_usage(argv);
+		exit(1);
+	}
+
+	rfbClientLog = load_log;
+	rfbClientErr = load_log;
+
+	if (server_pid == 0)
+		server_pid = read_pid();
+	if (server_pid > 0 && proc_cpu(server_pid, &su0, &ss0) < 0) {
+		fprintf(stderr, "Can't read the cpu time of process %d.\n", server_pid);
+		server_pid = 0;
+	}
+
+	clients = calloc(nclients, sizeof(struct load_client));
+	assert(clients != NULL);
+
+	start = now_seconds();
+	for (i = 0; i < nclients; i++) {
+		clients[i].id = i;
+		if (pthread_create(&clients[i].thread, NULL, load_thread, &clients[i]) != 0) {
+			fprintf(stderr, "Can't start client %d.\n", i);
+			nclients = i;
+			break;
+		}
+	}
+
+	sleep(duration);
+	cpu_time = now_seconds() - start;
+	if (server_pid > 0 && proc_cpu(server_pid, &su1, &ss1) == 0) {
+		su1 -= su0;
+		ss1 -= ss0;
+	}
+	stop = 1;
+	for (i = 0; i < nclients; i++)
+		pthread_join(clients[i].thread, NULL);
+	elapsed = now_seconds() - start;
+
+	report(su1, ss1, cpu_time, elapsed);
+	return 0;
+}
@@ -0,0 +1,531 @@
+/*
+ * fbvncplay.c
+ * This file is part of the vircon virtual console driver and service.
+ * Copyright (C) 2015 Dirk Herrendoerfer
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * Player for the session recordings of fbvncserver -R. Prints a summary
+ * or a log of the records, exports the screen at a given time as PPM, or
+ * plays the recording back to VNC viewers.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <sys/time.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <zlib.h>
+
+/* libvncserver */
+#include "rfb/rfb.h"
+
+#include "fbvncrec.h"
+
+/*****************************************************************************/
+
+static FILE *rec;
+static struct fbvnc_rec_file rec_file;
+static struct fbvnc_rec_index *index_entries;
+static int nindex;
+static int indexed;
+
+/* The screen as played back so far */
+static struct fbvnc_rec_size size;
+static char *screen;
+static size_t screen_len;
+static uint16_t colourmap[256 * 3];	/* if size is not true colour */
+
+static unsigned char *payload;
+static size_t payload_size;
+static unsigned char *pixels;
+static size_t pixels_size;
+
+/*****************************************************************************/
+
+/* The fixed part a record of this type starts with */
+static size_t record_min_len(int type)
+{
+	switch (type) {
+	case FBVNC_REC_SIZE:
+		return sizeof(struct fbvnc_rec_size);
+	case FBVNC_REC_RECT:
+		return sizeof(struct fbvnc_rec_rect);
+	case FBVNC_REC_KEY:
+		return sizeof(struct fbvnc_rec_key);
+	case FBVNC_REC_POINTER:
+		return sizeof(struct fbvnc_rec_pointer);
+	case FBVNC_REC_COLOURMAP:
+		return sizeof(struct fbvnc_rec_colourmap);
+	}
+	return 0;
+}
+
+/* Reads the next record into payload, 0 at the end of the recording */
+static int read_record(struct fbvnc_rec_record *r)
+{
+	if (fread(r, sizeof(*r), 1, rec) != 1 || r->type == FBVNC_REC_INDEX)
+		return 0;
+	/* Too short for what it claims to be, the rest cannot be trusted */
+	if (r->len < record_min_len(r->type)) {
+		fprintf(stderr, "truncated record of type %d, %u bytes\n", r->type, r->len);
+		return 0;
+	}
+	if (r->len > payload_size) {
+		free(payload);
+		payload_size = r->len;
+		payload = malloc(payload_size);
+		assert(payload != NULL);
+	}
+	if (r->len > 0 && fread(payload, r->len, 1, rec) != 1)
+		return 0;
+	return 1;
+}
+
+/* Uses the index at the end of the file, or builds one by scanning */
+static int load_index(void)
+{
+	struct fbvnc_rec_trailer trailer;
+	struct fbvnc_rec_record r;
+	long off;
+	int index_size = 0;
+
+	if (fseek(rec, -(long)sizeof(trailer), SEEK_END) == 0 &&
+	    fread(&trailer, sizeof(trailer), 1, rec) == 1 &&
+	    trailer.magic == FBVNC_REC_MAGIC &&
+	    fseek(rec, trailer.index, SEEK_SET) == 0 &&
+	    fread(&r, sizeof(r), 1, rec) == 1 && r.type == FBVNC_REC_INDEX) {
+		nindex = r.len / sizeof(struct fbvnc_rec_index);
+		index_entries = malloc(r.len + 1);
+		assert(index_entries != NULL);
+		if (nindex > 0 && fread(index_entries, r.len, 1, rec) == 1) {
+			indexed = 1;
+			return 0;
+		}
+		free(index_entries);
+		index_entries = NULL;
+		nindex = 0;
+	}
+
+	/* Not closed properly, the last record may be cut short */
+	fseek(rec, sizeof(struct fbvnc_rec_file), SEEK_SET);
+	for (;;) {
+		off = ftell(rec);
+		if (!read_record(&r))
+			break;
+		if (r.type != FBVNC_REC_SIZE)
+			continue;
+		if (nindex == index_size) {
+			index_size = index_size ? index_size * 2 : 64;
+			index_entries = realloc(index_entries, index_size * sizeof(struct fbvnc_rec_index));
+			assert(index_entries != NULL);
+		}
+		index_entries[nindex].usec = r.usec;
+		index_entries[nindex].offset = off;
+		nindex++;
+	}
+	return nindex > 0 ? 0 : -1;
+}
+
+static int open_recording(const char *path)
+{
+	if ((rec = fopen(path, "r")) == NULL) {
+		fprintf(stderr, "cannot open %s, %s\n", path, strerror(errno));
+		return -1;
+	}
+	if (fread(&rec_file, sizeof(rec_file), 1, rec) != 1 ||
+	    rec_file.magic != FBVNC_REC_MAGIC || rec_file.version != FBVNC_REC_VERSION) {
+		fprintf(stderr, "%s is not a fbvncserver recording\n", path);
+		return -1;
+	}
+	if (load_index() < 0) {
+		fprintf(stderr, "%s has no keyframe\n", path);
+		return -1;
+	}
+	return 0;
+}
+
+/* Positions the file at the last keyframe at or before usec */
+static void seek_keyframe(uint64_t usec)
+{
+	int i, k = 0;
+
+	for (i = 0; i < nindex; i++)
+		if (index_entries[i].usec <= usec)
+			k = i;
+	fseek(rec, index_entries[k].offset, SEEK_SET);
+}
+
+/* Applies a SIZE, COLOURMAP or RECT record to the screen, returns the
+ * rect changed */
+static int apply_record(struct fbvnc_rec_record *r, struct fbvnc_rec_rect *out)
+{
+	struct fbvnc_rec_colourmap *cm;
+	struct fbvnc_rec_rect *rr;
+	int y, bpp;
+	uLongf len;
+
+	switch (r->type) {
+	case FBVNC_REC_SIZE:
+		memcpy(&size, payload, sizeof(size));
+		screen_len = (size_t)size.width * size.height * (size.bits_per_pixel / 8);
+		screen = realloc(screen, screen_len);
+		assert(screen != NULL);
+		return 0;
+	case FBVNC_REC_COLOURMAP:
+		cm = (struct fbvnc_rec_colourmap *)payload;
+		if (cm->first + cm->count <= 256 &&
+		    r->len >= sizeof(*cm) + cm->count * 3 * sizeof(uint16_t))
+			memcpy(colourmap + cm->first * 3, cm + 1, cm->count * 3 * sizeof(uint16_t));
+		return 0;
+	case FBVNC_REC_RECT:
+		if (screen == NULL)
+			return 0;
+		rr = (struct fbvnc_rec_rect *)payload;
+		bpp = size.bits_per_pixel / 8;
+		if (rr->x + rr->w > size.width || rr->y + rr->h > size.height)
+			return 0;
+		len = (uLongf)rr->w * rr->h * bpp;
+		if (len > pixels_size) {
+			free(pixels);
+			pixels_size = len;
+			pixels = malloc(pixels_size);
+			assert(pixels != NULL);
+		}
+		if (uncompress(pixels, &len, (unsigned char *)(rr + 1), r->len - sizeof(*rr)) != Z_OK)
+			return 0;
+		for (y = 0; y < rr->h; y++)
+			memcpy(screen + ((size_t)(rr->y + y) * size.width + rr->x) * bpp,
+			  pixels + (size_t)y * rr->w * bpp, (size_t)rr->w * bpp);
+		*out = *rr;
+		return 1;
+	}
+	return 0;
+}
+
+/*****************************************************************************/
+
+static void info(const char *path)
+{
+	struct fbvnc_rec_record r;
+	unsigned long counts[FBVNC_REC_INDEX] = { 0 };
+	unsigned long keyframes = 0;
+	unsigned long long pixel_bytes = 0;
+	uint64_t last = 0;
+	time_t start = rec_file.start;
+	char stamp[64];
+
+	fseek(rec, sizeof(struct fbvnc_rec_file), SEEK_SET);
+	while (read_record(&r)) {
+		if (r.type < FBVNC_REC_INDEX)
+			counts[r.type]++;
+		if (r.type == FBVNC_REC_RECT) {
+			pixel_bytes += r.len;
+			if (r.flags & FBVNC_REC_KEYFRAME)
+				keyframes++;
+		}
+		if (r.type == FBVNC_REC_SIZE && counts[FBVNC_REC_SIZE] == 1)
+			memcpy(&size, payload, sizeof(size));
+		last = r.usec;
+	}
+
+	strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", localtime(&start));
+	printf("%s: port %d, started %s\n", path, rec_file.port, stamp);
+	printf("	length:    %.1f s\n", last / 1e6);
+	printf("	screen:    %dx%d %d bpp\n", size.width, size.height, size.bits_per_pixel);
+	printf("	keyframes: %lu%s\n", keyframes, indexed ? "" : " (no index, not closed properly)");
+	printf("	rects:     %lu, %llu bytes compressed\n",
+	  counts[FBVNC_REC_RECT] - keyframes, pixel_bytes);
+	printf("	keys:      %lu\n", counts[FBVNC_REC_KEY]);
+	printf("	pointer:   %lu\n", counts[FBVNC_REC_POINTER]);
+}
+
+/* One line per record, for audit */
+static void list(uint64_t from)
+{
+	struct fbvnc_rec_record r;
+	struct fbvnc_rec_key *k;
+	struct fbvnc_rec_pointer *p;
+	struct fbvnc_rec_colourmap *cm;
+	struct fbvnc_rec_rect *rr;
+
+	seek_keyframe(from);
+	while (read_record(&r)) {
+		if (r.usec < from)
+			continue;
+		printf("%12.6f ", r.usec / 1e6);
+		switch (r.type) {
+		case FBVNC_REC_SIZE:
+			memcpy(&size, payload, sizeof(size));
+			printf("size %dx%d %d bpp\n", size.width, size.height, size.bits_per_pixel);
+			break;
+		case FBVNC_REC_RECT:
+			rr = (struct fbvnc_rec_rect *)payload;
+			printf("%s %d %d %d %d %u\n", r.flags & FBVNC_REC_KEYFRAME ? "keyframe" : "rect",
+			  rr->x, rr->y, rr->w, rr->h, r.len);
+			break;
+		case FBVNC_REC_KEY:
+			k = (struct fbvnc_rec_key *)payload;
+			printf("key 0x%04x %s\n", k->keysym, k->down ? "down" : "up");
+			break;
+		case FBVNC_REC_POINTER:
+			p = (struct fbvnc_rec_pointer *)payload;
+			printf("pointer %d %d 0x%x\n", p->x, p->y, p->buttons);
+			break;
+		case FBVNC_REC_COLOURMAP:
+			cm = (struct fbvnc_rec_colourmap *)payload;
+			printf("colourmap %d %d\n", cm->first, cm->count);
+			break;
+		default:
+			printf("type %d, %u bytes\n", r.type, r.len);
+			break;
+		}
+	}
+}
+
+static unsigned int component(uint32_t pixel, int shift, int max)
+{
+	return max ? ((pixel >> shift) & max) * 255 / max : 0;
+}
+
+static int export_ppm(uint64_t at, const char *path)
+{
+	struct fbvnc_rec_record r;
+	struct fbvnc_rec_rect rr;
+	uint32_t pixel;
+	size_t i, n;
+	int bpp;
+	FILE *f;
+
+	seek_keyframe(at);
+	while (read_record(&r) && r.usec <= at)
+		apply_record(&r, &rr);
+	if (screen == NULL)
+		return -1;
+
+	if ((f = fopen(path, "w")) == NULL) {
+		fprintf(stderr, "cannot create %s, %s\n", path, strerror(errno));
+		return -1;
+	}
+	fprintf(f, "P6\n%d %d\n255\n", size.width, size.height);
+	bpp = size.bits_per_pixel / 8;
+	n = (size_t)size.width * size.height;
+	for (i = 0; i < n; i++) {
+		pixel = 0;
+		memcpy(&pixel, screen + i * bpp, bpp);
+		if (!size.true_colour) {
+			pixel &= 0xff;
+			fputc(colourmap[pixel * 3] >> 8, f);
+			fputc(colourmap[pixel * 3 + 1] >> 8, f);
+			fputc(colourmap[pixel * 3 + 2] >> 8, f);
+			continue;
+		}
+		fputc(component(pixel, size.red_shift, size.red_max), f);
+		fputc(component(pixel, size.green_shift, size.green_max), f);
+		fputc(component(pixel, size.blue_shift, size.blue_max), f);
+	}
+	fclose(f);
+	printf("Wrote screen at %.1f s to %s\n", at / 1e6, path);
+	return 0;
+}
+
+/*****************************************************************************/
+
+static double now_seconds(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void set_format(rfbScreenInfoPtr scr)
+{
+	rfbClientIteratorPtr it;
+	rfbClientPtr cl;
+
+	scr->serverFormat.bitsPerPixel = size.bits_per_pixel;
+	scr->serverFormat.depth = size.depth;
+	scr->serverFormat.trueColour = size.true_colour;
+	scr->serverFormat.redMax = size.red_max;
+	scr->serverFormat.greenMax = size.green_max;
+	scr->serverFormat.blueMax = size.blue_max;
+	scr->serverFormat.redShift = size.red_shift;
+	scr->serverFormat.greenShift = size.green_shift;
+	scr->serverFormat.blueShift = size.blue_shift;
+
+	if (!size.true_colour) {
+		if (scr->colourMap.data.shorts == NULL) {
+			scr->colourMap.data.shorts = malloc(sizeof(colourmap));
+			assert(scr->colourMap.data.shorts != NULL);
+		}
+		memcpy(scr->colourMap.data.shorts, colourmap, sizeof(colourmap));
+		scr->colourMap.count = 256;
+		scr->colourMap.is16 = TRUE;
+	}
+
+	/* rfbNewFramebuffer() set viewers up for its own format */
+	it = rfbGetClientIterator(scr);
+	while ((cl = rfbClientIteratorNext(it)) != NULL)
+		rfbSetTranslateFunction(cl);
+	rfbReleaseClientIterator(it);
+}
+
+/* Serves the recording to VNC viewers, starting when the first connects */
+static int play(uint64_t from, int port, double speed, int argc, char **argv)
+{
+	struct fbvnc_rec_record r;
+	struct fbvnc_rec_rect rr;
+	rfbScreenInfoPtr scr;
+	double t0 = 0, due;
+	int width, height;
+
+	/* The first SIZE gives the screen to start with */
+	seek_keyframe(from);
+	if (!read_record(&r) || r.type != FBVNC_REC_SIZE)
+		return -1;
+	apply_record(&r, &rr);
+	width = size.width;
+	height = size.height;
+
+	scr = rfbGetScreen(&argc, argv, width, height, 8, 3, size.bits_per_pixel / 8);
+	if (scr == NULL)
+		return -1;
+	set_format(scr);
+	scr->desktopName = "Vircon Recording";
+	scr->frameBuffer = screen;
+	scr->port = port;
+	scr->alwaysShared = TRUE;
+	rfbInitServer(scr);
+	if (scr->listenSock == -1) {
+		fprintf(stderr, "cannot start server.\n");
+		return -1;
+	}
+	printf("Serving the recording on port %d\n", port);
+
+	while (rfbIsActive(scr) && scr->clientHead == NULL)
+		rfbProcessEvents(scr, 100000);
+
+	t0 = now_seconds();
+	while (read_record(&r)) {
+		if (r.usec >= from) {
+			/* Keep serving viewers until the record is due */
+			due = t0 + (r.usec - from) / 1e6 / speed;
+			while (now_seconds() < due)
+				rfbProcessEvents(scr, (due - now_seconds()) * 1000000);
+		}
+
+		if (!apply_record(&r, &rr)) {
+			if (r.type == FBVNC_REC_SIZE && (size.width != width || size.height != height)) {
+				width = size.width;
+				height = size.height;
+				rfbNewFramebuffer(scr, screen, width, height, 8, 3, size.bits_per_pixel / 8);
+				set_format(scr);
+			}
+			else if (r.type == FBVNC_REC_SIZE)
+				scr->frameBuffer = screen;
+			else if (r.type == FBVNC_REC_COLOURMAP && !size.true_colour) {
+				set_format(scr);
+				rfbSetClientColourMaps(scr, 0, 256);
+			}
+			continue;
+		}
+		rfbMarkRectAsModified(scr, rr.x, rr.y, rr.x + rr.w, rr.y + rr.h);
+	}
+
+	printf("End of the recording\n");
+	while (rfbIsActive(scr))
+		rfbProcessEvents(scr, 100000);
+	return 0;
+}
+
+/*****************************************************************************/
+
+void print_usage(char **argv)
+{
+	fprintf(stdout, "%s [-l] [-t seconds] [-o file] [-p port] [-H] recording\n"
+		"    without options, print a summary of the recording\n"
+		"-l : list the records, input and damage with their time\n"
+		"-t seconds: start at, or export the screen at, this time\n"
+		"-o file: export the screen as PPM image\n"
+		"-p port: play the recording back to VNC viewers on this port\n"
+		"-S speed: playback speed, default is 1\n"
+		"-H : print this help\n", argv[0]);
+}
+
+int main(int argc, char **argv)
+{
+	char *path = NULL, *ppm = NULL;
+	double at = 0, speed = 1;
+	int listing = 0, port = 0;
+	int i;
+
+	if(argc > 1) {
+		i=1;
+		while(i < argc) {
+			if(*argv[i] == '-') {
+				switch(*(argv[i] + 1))
+				{
+					case 'H':
+						print_usage(argv);
+						exit(0);
+						break;
+					case 'l':
+						listing=1;
+						break;
+					case 't':
+						i++;
+						at = atof(argv[i]);
+						break;
+					case 'o':
+						i++;
+						ppm = argv[i];
+						break;
+					case 'p':
+						i++;
+						port = atoi(argv[i]);
+						break;
+					case 'S':
+						i++;
+						speed = atof(argv[i]);
+						break;
+				}
+			}
+			else
+				path = argv[i];
+			i++;
+		}
+	}
+
+	if (path == NULL || at < 0 || speed <= 0) {
+		print_usage(argv);
+		exit(1);
+	}
+	if (open_recording(path) < 0)
+		exit(1);
+
+	if (listing)
+		list(at * 1000000);
+	else if (ppm != NULL)
+		exit(export_ppm(at * 1000000, ppm) < 0 ? 1 : 0);
+	else if (port != 0)
+		exit(play(at * 1000000, port, speed, argc, argv) < 0 ? 1 : 0);
+	else
+		info(path);
+	return 0;
+}
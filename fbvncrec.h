@@ -0,0 +1,123 @@
+/*
+ * fbvncrec.h
+ * This file is part of the vircon virtual console driver and service.
+ * Copyright (C) 2015 Dirk Herrendoerfer
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * Session recording file of fbvncserver (-R dir), read by fbvncplay.
+ *
+ * The file starts with a fbvnc_rec_file header, followed by records. Each
+ * record is a fbvnc_rec_record header and len bytes of payload. RECT
+ * records carry the pixels of a damaged rect, rows packed, zlib compressed.
+ * A RECT with FBVNC_REC_KEYFRAME set covers the whole screen. Every
+ * keyframe comes right after a SIZE record with the geometry and pixel
+ * format of the RECTs that follow, so playback can start at any SIZE
+ * record. The recording starts with one and the resolution only changes
+ * at one. A SIZE without true_colour is followed by a COLOURMAP record
+ * with the palette the pixel values index, before its keyframe. KEY and
+ * POINTER records hold the input viewers sent.
+ *
+ * A recording that was closed properly ends with an INDEX record listing
+ * every keyframe, and a fbvnc_rec_trailer pointing at it. Without the
+ * trailer a reader has to scan the file for keyframes itself.
+ */
+
+#ifndef FBVNCREC_H
+#define FBVNCREC_H
+
+#include <stdint.h>
+
+#define FBVNC_REC_MAGIC		0x72636d76	/* "vmcr" */
+#define FBVNC_REC_VERSION	1
+
+enum {
+	FBVNC_REC_SIZE = 1,
+	FBVNC_REC_RECT = 2,
+	FBVNC_REC_KEY = 3,
+	FBVNC_REC_POINTER = 4,
+	FBVNC_REC_INDEX = 5,
+	FBVNC_REC_COLOURMAP = 6,
+};
+
+#define FBVNC_REC_KEYFRAME	(1 << 0)
+
+struct fbvnc_rec_file {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t port;
+	uint64_t start;		/* wall clock, seconds since the epoch */
+};
+
+struct fbvnc_rec_record {
+	uint16_t type;
+	uint16_t flags;
+	uint32_t len;		/* payload bytes following */
+	uint64_t usec;		/* since the start of the recording */
+};
+
+/* Pixel layout of the RECT records that follow, as in an RFB PixelFormat */
+struct fbvnc_rec_size {
+	uint32_t width;
+	uint32_t height;
+	uint8_t bits_per_pixel;
+	uint8_t depth;
+	uint8_t true_colour;
+	uint8_t pad;
+	uint16_t red_max;
+	uint16_t green_max;
+	uint16_t blue_max;
+	uint8_t red_shift;
+	uint8_t green_shift;
+	uint8_t blue_shift;
+	uint8_t pad2;
+};
+
+/* Followed by the compressed pixels */
+struct fbvnc_rec_rect {
+	uint16_t x;
+	uint16_t y;
+	uint16_t w;
+	uint16_t h;
+};
+
+struct fbvnc_rec_key {
+	uint32_t keysym;
+	uint32_t down;
+};
+
+struct fbvnc_rec_pointer {
+	uint16_t x;
+	uint16_t y;
+	uint32_t buttons;
+};
+
+/* Followed by count red, green, blue triples, 16 bit each as in an RFB
+ * SetColourMapEntries */
+struct fbvnc_rec_colourmap {
+	uint16_t first;
+	uint16_t count;
+	uint32_t pad;
+};
+
+/* The INDEX payload is an array of these */
+struct fbvnc_rec_index {
+	uint64_t usec;
+	uint64_t offset;	/* of the SIZE record in front of the keyframe */
+};
+
+struct fbvnc_rec_trailer {
+	uint64_t index;		/* offset of the INDEX record */
+	uint32_t magic;
+	uint32_t pad;
+};
+
+#endif /* FBVNCREC_H */
@@ -16,64 +16,89 @@
  * This project is an adaptation of the original fbvncserver.
  */
 
+#define _GNU_SOURCE
+
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
+#include <time.h>
 
 #include <unistd.h>
 #include <sys/mman.h>
 #include <sys/ioctl.h>
+#include <sys/wait.h>
 
 #include <sys/stat.h>
 #include <sys/sysmacros.h>
 
 #include <fcntl.h>
+#include <dirent.h>
 #include <linux/fb.h>
 #include <linux/kd.h>
 #include <linux/keyboard.h>
 #include <linux/input.h>
 
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <limits.h>
+#include <linux/sockios.h>
+#include <linux/errqueue.h>
+#include <linux/netlink.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <netdb.h>
 
 #include <assert.h>
 #include <errno.h>
+#include <pthread.h>
+#include <zlib.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 /* libvncserver */
 #include "rfb/rfb.h"
 #include "rfb/keysym.h"
 
+#include "fbvncshm.h"
+#include "fbvncrec.h"
+#include "vircon.h"
+
+/* USDT probes for bpftrace, see the .bt files in scripts. Each is a
+ * single nop when nobody is attached, and they compile away entirely
+ * where sys/sdt.h (systemtap-sdt-dev) is not installed. */
+#ifdef __has_include
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#endif
+#endif
+#ifndef DTRACE_PROBE
+#define DTRACE_PROBE(provider, name)
+#define DTRACE_PROBE1(provider, name, a1)
+#define DTRACE_PROBE2(provider, name, a1, a2)
+#define DTRACE_PROBE3(provider, name, a1, a2, a3)
+#define DTRACE_PROBE4(provider, name, a1, a2, a3, a4)
+#define DTRACE_PROBE5(provider, name, a1, a2, a3, a4, a5)
+#endif
+
 /*****************************************************************************/
 
-static char FB_DEVICE[256] = "/dev/fb0";
-static char KBD_DEVICE[256] = "auto";
-static char TOUCH_DEVICE[256] = "auto";
-static struct fb_var_screeninfo scrinfo;
-static struct fb_var_screeninfo scrinfo_m;
-static int fbfd = -1;
-static int kbdfd = -1;
-static int touchfd = -1;
-static unsigned short int *fbmmap = MAP_FAILED;
-static size_t fbmmap_size;
-static unsigned short int *vncbuf;
-static unsigned short int *fbbuf;
 static int mpid = 0;
 
 static int shutdown_set = 0;
 
 #define VNC_PORT 5901
+#define HTTP_PORT 5800
 #define AUTHFILE "/.rfbpasswd"
 
 static char pidfile[]="/var/run/fbvncserver.pid";
 
-static rfbScreenInfoPtr vncscr;
 in_addr_t vncaddr;
 
-static int xmin, xmax;
-static int ymin, ymax;
-
 /* Defines if the mouse should move softly with many updates or if the
  * mouse acts like a touch device only moving upon each button update */
 static int mousemode = 0;
@@ -81,100 +106,502 @@ static int mousemode = 0;
 /* Defines if the web server should be started */
 static int webmode = 0;
 
+/* Certificate and key for WebSocket clients connecting with TLS (wss://) */
+static char *ws_certfile = NULL;
+static char *ws_keyfile = NULL;
+
 /* Defines preset auth */
 static int authmode = 0;
 
-/*****************************************************************************/
+/* Target capture scans per second */
+static int frame_rate = 10;
 
-static void keyevent(rfbBool down, rfbKeySym key, rfbClientPtr cl);
-static void ptrevent(int buttonMask, int x, int y, rfbClientPtr cl);
+/* Number of capture scan threads (0 = one per online CPU) and the frame
+ * size in pixels below which the scan runs inline on the main thread */
+static int scan_threads = 0;
+static int scan_threshold = 1280 * 1024;
+
+/* Bands per scan thread a pooled scan splits the frame into */
+static int scan_bands = 4;
+
+/* ZRLE updates smaller than this many pixels are encoded inline, larger
+ * ones on the scan threads */
+static int zrle_threshold = 256 * 1024;
+
+/* Scan layout calibration, see scan_calibrate(). -S sets a fixed layout,
+ * or turns calibration off. */
+static int scan_calibration = 1;
+static int scan_fixed_threads = 0;
+static int scan_fixed_bands = 0;
+
+/* Highest compression and JPEG quality levels viewers may ask for,
+ * -1 leaves them to the viewer. Set on the control socket. */
+static int client_compress_max = -1;
+static int client_quality_max = -1;
+
+/*****************************************************************************/
 
 /* No idea, just copied from fbvncserver as part of the frame differerencing
  * algorithm.  I will probably be later rewriting all of this. */
-static struct varblock_t
+struct varblock_t
 {
-	int min_i;
-	int min_j;
-	int max_i;
-	int max_j;
 	int r_offset;
 	int g_offset;
 	int b_offset;
 	int rfb_xres;
 	int rfb_maxy;
-} varblock;
+};
+
+struct scan_band;
+
+/* Log2 histogram, bucket i counts observations up to base * 2^i */
+#define HIST_BUCKETS 24
+struct histogram
+{
+	double base;
+	uint64_t count;
+	double sum;
+	uint64_t buckets[HIST_BUCKETS];
+};
+
+enum { INPUT_KEY, INPUT_POINTER, INPUT_WHEEL, INPUT_TOUCH, INPUT_TYPES };
+
+#define METRICS_MAX_ENCODINGS 32
+struct head_metrics
+{
+	struct histogram scan_seconds;
+	struct histogram damage_rects;
+	struct histogram update_seconds;
+	struct histogram latency_seconds;
+	struct histogram lat_inject_draw;
+	struct histogram lat_draw_capture;
+	struct histogram lat_capture_encode;
+	struct histogram lat_encode_send;
+	struct histogram lat_total;
+	uint64_t frames;
+	uint64_t pixels_compared;
+	uint64_t pixels_changed;
+	uint64_t damage_area;
+	uint64_t resolution_changes;
+	uint64_t input_events[INPUT_TYPES];
+	uint64_t rec_dropped;
+
+	/* Bytes sent to clients that are gone, by encoding */
+	int nencodings;
+	uint32_t encoding[METRICS_MAX_ENCODINGS];
+	uint64_t encoding_bytes[METRICS_MAX_ENCODINGS];
+};
+
+/* The input being followed to the screen, see latency_input() */
+#define LAT_STAGES 5
+struct latency
+{
+	int state;
+	struct _rfbClientRec *cl;
+	double inject, draw, capture, encode;
+	double last_scan;
+};
+
+#define SHM_MAX_CLIENTS 16
+struct shm_client
+{
+	int fd;
+	int resync;
+};
+
+enum { FB_SRC_DEVICE, FB_SRC_MEMFD, FB_SRC_FILE, FB_SRC_SYNTH };
+
+/* The console at 1:factor on its own port, see scaled_setup() */
+#define SCALED_MAX 3
+struct scaled_screen
+{
+	int factor;
+	rfbScreenInfoPtr scr;
+	char *buf;
+	double retry;
+};
+
+/* One served console: a framebuffer with its keyboard and touch device,
+ * its VNC screen and its capture state. All heads share the capture
+ * worker pool and the event loop in main(). */
+struct head
+{
+	struct head *next;
+
+	char fb_device[256];
+	char kbd_device[256];
+	char touch_device[256];
+	int kbd_auto;		/* found by name, and found again after a reload */
+	int touch_auto;
+	int port;
+	char *shm_path;
+
+	struct fb_var_screeninfo scrinfo;
+	struct fb_var_screeninfo scrinfo_m;
+	int fb_source;
+	int synth_pattern;
+	unsigned int synth_frame;
+	int fbfd;
+	int kbdfd;
+	int touchfd;
+	unsigned short int *fbmmap;
+	size_t fbmmap_size;
+	unsigned short int *vncbuf;
+	size_t vncbuf_size;
+	unsigned short int *fbbuf;
+
+	rfbScreenInfoPtr vncscr;
+	struct varblock_t varblock;
+	struct scaled_screen scaled[SCALED_MAX];
+	int nscaled;
+
+	/* Pages of a vircon fb written since the last frame, see dirty_rows() */
+	struct {
+		int enabled;
+		int full;		/* compare every row next frame */
+		uint8_t *bitmap;
+		uint32_t size;
+		uint8_t *rows;
+		const uint8_t *scan;	/* rows the current scan compares, or all */
+	} dirty;
+
+	/* Damage ring of a vircon fb, see damage_rows() */
+	struct {
+		int fd;
+		int complete;		/* the records cover mmap writes too */
+		int copies;		/* applied since the last frame */
+		uint64_t copy_area;
+	} damage;
+
+	/* Palette of an 8 bpp fb, see cmap_poll() */
+	struct {
+		int loaded;
+		uint16_t map[256 * 3];	/* red, green, blue as in an RFB colour map */
+		uint8_t rgb[256][3];
+	} cmap;
+
+	int xmin, xmax;
+	int ymin, ymax;
+
+	int prev_x;
+	int prev_y;
+	int prev_buttonMask;
+
+	struct scan_band *bands;
+	int nbands;
+	int nthreads;		/* scanning the bands */
+	int scan_threads;	/* layout from scan_calibrate(), 0 if none */
+	int scan_bands;
+
+	/* Still listed in the heads file */
+	int listed;
+
+	/* Damage heatmap, per tile of HEAT_TILE pixels */
+	struct {
+		int tw, th;
+		uint32_t *count;
+		uint64_t *bytes;
+		uint32_t frames;
+		time_t since;
+	} heat;
+
+	/* Session recording, see rec_start() */
+	struct {
+		int fd;
+		char *ring;
+		size_t size;
+		size_t head, tail;	/* bytes queued and written, ever */
+		size_t pending;
+		pthread_t writer;
+		pthread_mutex_t lock;
+		pthread_cond_t cond;
+		int stop;
+		int failed;
+		int need_keyframe;
+		double start;
+		double last_keyframe;
+		/* Writer thread only */
+		uint64_t offset;
+		struct fbvnc_rec_index *index;
+		int nindex, index_size;
+		unsigned char *zbuf;
+		size_t zsize;
+	} rec;
+
+	/* Thumbnail and snapshot cache, see thumb_request() */
+	struct {
+		int scale;
+		int tw, th;
+		int tiles_x, tiles_y;
+		uint8_t *dirty;		/* per THUMB_TILE thumbnail pixels */
+		int any_dirty;
+		uint8_t *rgb;
+		uint64_t seq;		/* thumbnail refreshes */
+		uint64_t frame_seq;	/* frames with damage */
+		double requested;
+		/* The last PNGs and the seq they show, under thumb_lock */
+		char *thumb_png;
+		size_t thumb_len;
+		uint64_t thumb_seq;
+		char *snap_png;
+		size_t snap_len;
+		uint64_t snap_seq;
+	} thumb;
+
+	/* Local shared-memory transport */
+	int shm_listenfd;
+	int shm_memfd;
+	size_t shm_size;
+	uint64_t shm_seq;
+	struct shm_client shm_clients[SHM_MAX_CLIENTS];
+	int shm_nclients;
+	struct fbvnc_shm_damage shm_damage;
+
+	struct head_metrics metrics;
+	struct latency lat;
+};
+
+static struct head *heads;
+
+/* Heads besides the one given with -f/-k/-t, re-read on SIGHUP */
+static char *heads_file = NULL;
+static volatile sig_atomic_t heads_reload_set = 0;
 
 /*****************************************************************************/
 
 static void keyevent(rfbBool down, rfbKeySym key, rfbClientPtr cl);
 static void ptrevent(int buttonMask, int x, int y, rfbClientPtr cl);
+static void init_scan_workers(void);
+static void setup_scan_bands(struct head *h);
+static void scan_calibrate(struct head *h);
+static void dirty_setup(struct head *h);
+static void damage_open(struct head *h);
+static void zrle_send_update(rfbClientPtr cl);
+static void fb_detach(struct head *h);
+static int fb_attach(struct head *h);
+static void damage_notify(struct head *h, int x1, int y1, int x2, int y2, int keyframe);
+static void metrics_update_start(rfbClientPtr cl);
+static void metrics_update_sent(rfbClientPtr cl);
+static void metrics_client_gone(rfbClientPtr cl);
+static void latency_update_start(rfbClientPtr cl, double t);
+static void latency_update_sent(rfbClientPtr cl, double t);
+static void latency_client_gone(rfbClientPtr cl);
+static void budget_update_start(rfbClientPtr cl);
+static void budget_update_done(rfbClientPtr cl);
+static void budget_input(rfbClientPtr cl);
+static int budget_over(rfbClientPtr cl);
+static void budget_schedule(void);
+static void injectKeyEvent(struct head *h, uint16_t code, uint16_t value);
+static void heat_setup(struct head *h);
+static void heat_add(struct head *h, int x1, int y1, int x2, int y2);
+static int synth_find(const char *name);
+static void rec_start(struct head *h);
+static void rec_stop(struct head *h);
+static int rec_keyframe_due(struct head *h, double t);
+static void rec_keyframe(struct head *h);
+static void rec_rect(struct head *h, int x1, int y1, int x2, int y2);
+static void rec_key(struct head *h, rfbKeySym key, rfbBool down);
+static void rec_pointer(struct head *h, int x, int y, int buttonMask);
+static void thumb_setup(struct head *h);
+static void thumb_add(struct head *h, int x1, int y1, int x2, int y2);
+static int thumb_request(int fd, const char *query, int snapshot);
+static int png_rgb(unsigned char *rgb, int width, int height, char **png, size_t *len);
+static int head_has_clients(struct head *h);
+static void thumb_cleanup(struct head *h);
+static void scaled_setup(struct head *h);
+static void scaled_update(struct head *h, int x1, int y1, int x2, int y2);
 
 /*****************************************************************************/
 
-static void init_fb(void)
+static int fb_is_memory(const char *dev)
+{
+	return !strncmp(dev, "memfd:", 6) || !strncmp(dev, "file:", 5) ||
+	    !strncmp(dev, "synth:", 6);
+}
+
+/* Besides a device node the framebuffer may come from
+ *   memfd:WxHxD           anonymous memory, e.g. for a renderer we fork
+ *   file:path:WxHxD       a file another process draws into
+ *   synth:WxHxD[:pattern] memory animated by the server itself
+ * D is 8 (palette), 16 (RGB565) or 32 (XRGB8888). Such sources never
+ * change mode. */
+static int parse_geometry(const char *s, struct fb_var_screeninfo *si)
+{
+	unsigned int w, ht, d;
+
+	if (sscanf(s, "%ux%ux%u", &w, &ht, &d) != 3 || w == 0 || ht == 0 ||
+	    (d != 8 && d != 16 && d != 32))
+		return -1;
+
+	memset(si, 0, sizeof(*si));
+	si->xres = si->xres_virtual = w;
+	si->yres = si->yres_virtual = ht;
+	si->bits_per_pixel = d;
+	if (d == 8) {
+		si->red.length = 8;
+		si->green.length = 8;
+		si->blue.length = 8;
+	}
+	else if (d == 16) {
+		si->red.offset = 11;	si->red.length = 5;
+		si->green.offset = 5;	si->green.length = 6;
+		si->blue.offset = 0;	si->blue.length = 5;
+	}
+	else {
+		si->red.offset = 16;	si->red.length = 8;
+		si->green.offset = 8;	si->green.length = 8;
+		si->blue.offset = 0;	si->blue.length = 8;
+	}
+	return 0;
+}
+
+static int init_fb_memory(struct head *h)
+{
+	char path[256], *geometry, *p;
+	struct stat st;
+
+	strncpy(path, h->fb_device, sizeof(path) - 1);
+	path[sizeof(path) - 1] = '\0';
+
+	if (!strncmp(path, "file:", 5)) {
+		h->fb_source = FB_SRC_FILE;
+		if ((p = strrchr(path, ':')) == path + 4) {
+			fprintf(stderr, "no geometry in %s\n", h->fb_device);
+			return -1;
+		}
+		*p = '\0';
+		geometry = p + 1;
+	}
+	else {
+		h->fb_source = !strncmp(path, "synth:", 6) ? FB_SRC_SYNTH : FB_SRC_MEMFD;
+		geometry = path + 6;
+		if ((p = strchr(geometry, ':')) != NULL) {
+			*p = '\0';
+			if ((h->synth_pattern = synth_find(p + 1)) < 0) {
+				fprintf(stderr, "unknown pattern %s\n", p + 1);
+				return -1;
+			}
+		}
+	}
+
+	if (parse_geometry(geometry, &h->scrinfo) < 0) {
+		fprintf(stderr, "bad geometry %s, want WxHx8, WxHx16 or WxHx32\n", geometry);
+		return -1;
+	}
+	h->fbmmap_size = h->scrinfo.xres * h->scrinfo.yres * (h->scrinfo.bits_per_pixel / 8);
+
+	if (h->fb_source == FB_SRC_FILE)
+		h->fbfd = open(path + 5, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	else
+		h->fbfd = memfd_create("fbvncserver-fb", MFD_CLOEXEC);
+	if (h->fbfd == -1 || fstat(h->fbfd, &st) < 0 ||
+	    ((size_t)st.st_size < h->fbmmap_size && ftruncate(h->fbfd, h->fbmmap_size) < 0)) {
+		fprintf(stderr, "cannot set up fb %s, %s\n", h->fb_device, strerror(errno));
+		return -1;
+	}
+
+	h->fbmmap = mmap(NULL, h->fbmmap_size, PROT_READ | PROT_WRITE, MAP_SHARED, h->fbfd, 0);
+	if (h->fbmmap == MAP_FAILED) {
+		fprintf(stderr, "mmap failed\n");
+		return -1;
+	}
+	return 0;
+}
+
+static int init_fb(struct head *h)
 {
 	size_t pixels;
 	size_t bytespp;
 
-	if ((fbfd = open(FB_DEVICE, O_RDONLY)) == -1) {
-		fprintf(stderr, "cannot open fb device %s\n", FB_DEVICE);
-		exit(EXIT_FAILURE);
+	h->fb_source = FB_SRC_DEVICE;
+	if (fb_is_memory(h->fb_device))
+		return init_fb_memory(h);
+
+	if ((h->fbfd = open(h->fb_device, O_RDONLY)) == -1) {
+		fprintf(stderr, "cannot open fb device %s\n", h->fb_device);
+		return -1;
 	}
 
-	if (ioctl(fbfd, FBIOGET_VSCREENINFO, &scrinfo) != 0) {
+	if (ioctl(h->fbfd, FBIOGET_VSCREENINFO, &h->scrinfo) != 0) {
 		fprintf(stderr, "ioctl error\n");
-		exit(EXIT_FAILURE);
+		return -1;
 	}
 
-	pixels = scrinfo.xres * scrinfo.yres;
-	bytespp = scrinfo.bits_per_pixel / 8;
+	pixels = h->scrinfo.xres * h->scrinfo.yres;
+	bytespp = h->scrinfo.bits_per_pixel / 8;
 
 	fprintf(stderr, "xres=%d, yres=%d, xresv=%d, yresv=%d, xoffs=%d, yoffs=%d, bpp=%d\n", 
-	  (int)scrinfo.xres, (int)scrinfo.yres,
-	  (int)scrinfo.xres_virtual, (int)scrinfo.yres_virtual,
-	  (int)scrinfo.xoffset, (int)scrinfo.yoffset,
-	  (int)scrinfo.bits_per_pixel);
+	  (int)h->scrinfo.xres, (int)h->scrinfo.yres,
+	  (int)h->scrinfo.xres_virtual, (int)h->scrinfo.yres_virtual,
+	  (int)h->scrinfo.xoffset, (int)h->scrinfo.yoffset,
+	  (int)h->scrinfo.bits_per_pixel);
 
-	fbmmap_size = pixels * bytespp;
-	fbmmap = mmap(NULL, fbmmap_size, PROT_READ, MAP_SHARED, fbfd, 0);
+	h->fbmmap_size = pixels * bytespp;
+	h->fbmmap = mmap(NULL, h->fbmmap_size, PROT_READ, MAP_SHARED, h->fbfd, 0);
 
-	if (fbmmap == MAP_FAILED) {
+	if (h->fbmmap == MAP_FAILED) {
 		fprintf(stderr, "mmap failed\n");
-		exit(EXIT_FAILURE);
+		return -1;
 	}
+	dirty_setup(h);
+	return 0;
 }
 
-static void cleanup_fb(void)
+static void cleanup_fb(struct head *h)
 {
-	if(fbfd != -1) {
-	        munmap(fbmmap, fbmmap_size);
-		close(fbfd);
+	if(h->fbfd != -1) {
+		if (h->fbmmap != MAP_FAILED)
+		        munmap(h->fbmmap, h->fbmmap_size);
+		close(h->fbfd);
+	}
+	if (h->damage.fd != -1) {
+		close(h->damage.fd);
+		h->damage.fd = -1;
 	}
 }
 
 
-static int find_evdev(char *usename)
+/* Reads a one line sysfs attribute such as an input device name */
+static int sysfs_read(const char *path, char *buf, size_t len)
 {
-	int rfd, i;
-        char device[32] = "";
-	char name[256] = "Unknown";
-	
-	for (i=0 ; i<16 ; i++) {
-		sprintf(device,"/dev/input/event%i",i);
-		
-        	if ((rfd = open (device, O_RDONLY)) != -1) {
-			ioctl (rfd, EVIOCGNAME (sizeof (name)), name);
-			close(rfd);
-
-			if (!strcmp (name,usename)) {
-				return i;
-			}
+	FILE *f;
+	int ret = -1;
+
+	if ((f = fopen(path, "r")) == NULL)
+		return -1;
+	if (fgets(buf, len, f) != NULL) {
+		buf[strcspn(buf, "\n")] = '\0';
+		ret = 0;
+	}
+	fclose(f);
+	return ret;
+}
+
+/* Looks the input device up by name in sysfs, without opening every
+ * event device node. Leaves its node in device. */
+static int find_evdev(const char *usename, char *device, size_t len)
+{
+	char path[PATH_MAX], name[256];
+	struct dirent *de;
+	DIR *dir;
+	int ret = -1;
+
+	if ((dir = opendir("/sys/class/input")) == NULL)
+		return -1;
+	while (ret < 0 && (de = readdir(dir)) != NULL) {
+		if (strncmp(de->d_name, "event", 5))
+			continue;
+		snprintf(path, sizeof(path), "/sys/class/input/%s/device/name", de->d_name);
+		if (sysfs_read(path, name, sizeof(name)) == 0 && !strcmp(name, usename)) {
+			snprintf(device, len, "/dev/input/%s", de->d_name);
+			ret = 0;
 		}
 	}
-	return 0;
+	closedir(dir);
+	return ret;
 }
 
-static int kfd;
+static int kfd = -1;
 static int nr_keys = 0;
 
 static int keymap_index[MAX_NR_KEYMAPS];	/* inverse of good_keymap */
@@ -239,19 +666,27 @@ static void find_nr_keys(void) {
 	nr_keys = (has_key(255,0) ? 256 : has_key(127,0) ? 128 : 112);
 }
 
-static void init_kbd()
+static int init_kbd(struct head *h)
 {
 	char name[256] = "unknown";
-        int i;
 
-	if((kbdfd = open(KBD_DEVICE, O_RDWR)) == -1) {
-		fprintf(stderr, "cannot open kbd device %s\n", KBD_DEVICE);
-		exit(EXIT_FAILURE);
+	if (!strcmp(h->kbd_device, "none"))
+		return 0;
+
+	if((h->kbdfd = open(h->kbd_device, O_RDWR)) == -1) {
+		fprintf(stderr, "cannot open kbd device %s\n", h->kbd_device);
+		return -1;
 	}
 
-	ioctl (kbdfd, EVIOCGNAME (sizeof (name)), name);
+	ioctl (h->kbdfd, EVIOCGNAME (sizeof (name)), name);
 #ifdef DEBUG
         fprintf (stdout, "  using device \"%s\"\n",name );
+#endif
+	/* The console keymap is shared by all heads */
+	if (kfd != -1)
+		return 0;
+
+#ifdef DEBUG
         fprintf (stdout, "Learning keys\n");
 #endif
 	kfd = open_a_console("/dev/tty0");
@@ -265,56 +700,58 @@ static void init_kbd()
 #ifdef DEBUG
         fprintf (stdout, " got %d keys\n",nr_keys);
 #endif
+	return 0;
 }
 
-static void cleanup_kbd()
+static void cleanup_kbd(struct head *h)
 {
-	if(kbdfd != -1) {
-		close(kbdfd);
-	}
-	if(kfd != -1) {
-		close(kfd);
+	if(h->kbdfd != -1) {
+		close(h->kbdfd);
 	}
 }
 
-static void init_touch()
+static int init_touch(struct head *h)
 {
 	char name[256] = "unknown";
     	struct input_absinfo info;
 
-        if((touchfd = open(TOUCH_DEVICE, O_RDWR)) == -1) {
-                fprintf(stderr, "cannot open touch device %s\n", TOUCH_DEVICE);
-                exit(EXIT_FAILURE);
+	if (!strcmp(h->touch_device, "none"))
+		return 0;
+
+        if((h->touchfd = open(h->touch_device, O_RDWR)) == -1) {
+                fprintf(stderr, "cannot open touch device %s\n", h->touch_device);
+                return -1;
         }
 
-	ioctl (touchfd, EVIOCGNAME (sizeof (name)), name);
+	ioctl (h->touchfd, EVIOCGNAME (sizeof (name)), name);
 
     	// Get the Range of X and Y
-    	if(ioctl(touchfd, EVIOCGABS(ABS_X), &info)) {
+    	if(ioctl(h->touchfd, EVIOCGABS(ABS_X), &info)) {
         	fprintf(stderr, "cannot get ABS_X info, %s\n", strerror(errno));
-        	exit(EXIT_FAILURE);
+        	return -1;
     	}
-    	xmin = info.minimum;
-    	xmax = info.maximum;
+    	h->xmin = info.minimum;
+    	h->xmax = info.maximum;
 
-    	if(ioctl(touchfd, EVIOCGABS(ABS_Y), &info)) {
+    	if(ioctl(h->touchfd, EVIOCGABS(ABS_Y), &info)) {
         	fprintf(stderr, "cannot get ABS_Y, %s\n", strerror(errno));
-        	exit(EXIT_FAILURE);
+        	return -1;
     	}
-    	ymin = info.minimum;
-    	ymax = info.maximum;
+    	h->ymin = info.minimum;
+    	h->ymax = info.maximum;
 
 #ifdef DEBUG
         fprintf (stdout, "  using device \"%s\"\n",name );
-    	fprintf (stdout, "  X info min:%i max:%i\n",xmin,xmax );
-    	fprintf (stdout, "  Y info min:%i max:%i\n",ymin,ymax );
+    	fprintf (stdout, "  X info min:%i max:%i\n",h->xmin,h->xmax );
+    	fprintf (stdout, "  Y info min:%i max:%i\n",h->ymin,h->ymax );
 #endif
+	return 0;
 }
 
-static void cleanup_touch()
+static void cleanup_touch(struct head *h)
 {
-	if(touchfd != -1) {
-		close(touchfd);
+	if(h->touchfd != -1) {
+		close(h->touchfd);
 	}
 }
 
@@ -355,570 +792,6804 @@ int remove_pid ()
 }
 /*****************************************************************************/
 
-static void init_fb_server(int argc, char **argv)
-{
-	int bitsPerSample;
-#ifdef DEBUG
-	fprintf(stdout, "Initializing VNC server...\n");
+/* ContinuousUpdates and Fence extensions. A client announcing the
+ * ContinuousUpdates pseudo-encoding may ask for damage to be pushed to it
+ * without sending a FramebufferUpdateRequest for every frame. Pushes are
+ * paced by the scan rate, by the kernel send queue of the client socket
+ * and, for clients that also speak Fence, by the number of updates the
+ * client has not acknowledged yet. */
+
+#ifndef rfbEncodingContinuousUpdates
+#define rfbEncodingContinuousUpdates	-313
 #endif
-	/* Allocate the VNC server buffer to be managed (not manipulated) by 
-	 * libvncserver. */
-	vncbuf = calloc(scrinfo.xres * scrinfo.yres, scrinfo.bits_per_pixel / 8);
-	assert(vncbuf != NULL);
+#ifndef rfbEncodingFence
+#define rfbEncodingFence		-312
+#endif
+#define rfbEnableContinuousUpdates	150
+#define rfbEndOfContinuousUpdates	150
+#define rfbFence			248
 
-	/* Allocate the comparison buffer for detecting drawing updates from frame
-	 * to frame. */
-	fbbuf = calloc(scrinfo.xres * scrinfo.yres, scrinfo.bits_per_pixel / 8);
-	assert(fbbuf != NULL);
-
-	if (scrinfo.bits_per_pixel == 16) {
-		bitsPerSample = 5;
-        	vncscr = rfbGetScreen(&argc, argv, scrinfo.xres, scrinfo.yres, 5, 2, (scrinfo.bits_per_pixel / 8));
-	}
-	else if (scrinfo.bits_per_pixel == 24) { 
-		bitsPerSample = 8;
-		vncscr = rfbGetScreen(&argc, argv, scrinfo.xres, scrinfo.yres, 8, 3, 4);
-	    	vncscr->serverFormat.bitsPerPixel = 32;
-   		vncscr->serverFormat.depth = 24;
-	}
-	else if (scrinfo.bits_per_pixel == 32) { 
-		bitsPerSample = 8;
-		vncscr = rfbGetScreen(&argc, argv, scrinfo.xres, scrinfo.yres, 8, 3, 4);
-	    	vncscr->serverFormat.bitsPerPixel = 32;
-   		vncscr->serverFormat.depth = 32;
-	}
-	assert(vncscr != NULL);
-
-	vncscr->desktopName = "Vircon Screen";
-	vncscr->frameBuffer = (char *)vncbuf;
-	vncscr->alwaysShared = FALSE;
-	if (webmode == 1) 
-		vncscr->httpDir = "/.vnc-webclient";
-	if (vncscr->httpPort == 0) 
-		vncscr->httpPort = 5800;
-	if (vncscr->port == 0)
-		vncscr->port = VNC_PORT;
-        if (authmode == 1)
-		vncscr->authPasswdData=AUTHFILE;
+#define rfbFenceFlagBlockBefore		(1U << 0)
+#define rfbFenceFlagBlockAfter		(1U << 1)
+#define rfbFenceFlagSyncNext		(1U << 2)
+#define rfbFenceFlagRequest		(1U << 31)
 
-	vncscr->listenInterface = vncaddr;
+/* Updates a Fence capable client may have unacknowledged, and bytes a
+ * client socket may have queued before pushing to it is paused */
+static int cu_max_inflight = 2;
+#define CU_MAX_QUEUED (256 * 1024)
 
-#ifdef DEBUG
-	fprintf(stdout, "	red.offset: %d\n", (int)scrinfo.red.offset);
-	fprintf(stdout, "	red.length: %d\n", (int)scrinfo.red.length);
-	fprintf(stdout, "	green.offset: %d\n", (int)scrinfo.green.offset);
-	fprintf(stdout, "	green.length: %d\n", (int)scrinfo.green.length);
-	fprintf(stdout, "	blue.offset: %d\n", (int)scrinfo.blue.offset);
-	fprintf(stdout, "	blue.length: %d\n", (int)scrinfo.blue.length);
-
-	fprintf(stdout, "	vncscr->serverFormat.redMax: %d\n", (int)vncscr->serverFormat.redMax);
-	fprintf(stdout, "	vncscr->serverFormat.greenMax: %d\n", (int)vncscr->serverFormat.greenMax);
-	fprintf(stdout, "	vncscr->serverFormat.blueMax: %d\n", (int)vncscr->serverFormat.blueMax);
-	fprintf(stdout, "	vncscr->serverFormat.redShift: %d\n", (int)vncscr->serverFormat.redShift);
-	fprintf(stdout, "	vncscr->serverFormat.greenShift: %d\n", (int)vncscr->serverFormat.greenShift);
-	fprintf(stdout, "	vncscr->serverFormat.blueShift: %d\n", (int)vncscr->serverFormat.blueShift);
-#endif
-	vncscr->kbdAddEvent = keyevent;
-	vncscr->ptrAddEvent = ptrevent;
+struct cu_client
+{
+	int supported;
+	int fence;
+	int enabled;
+	int inflight;
+	uint32_t fence_seq;
+	sraRegionPtr region;
+};
+
+static int cu_pseudo_encodings[] = {
+	rfbEncodingContinuousUpdates, rfbEncodingFence, 0
+};
+
+static void cu_send_end(rfbClientPtr cl)
+{
+	char msg = rfbEndOfContinuousUpdates;
 
-	rfbInitServer(vncscr);
+	if (rfbWriteExact(cl, &msg, 1) < 0)
+		rfbCloseClient(cl);
+}
 
-	if (vncscr->listenSock==-1) {
-        	fprintf(stderr, "cannot start server.\n");
-        	exit(EXIT_FAILURE);
-	}
+static void cu_send_fence(rfbClientPtr cl, uint32_t flags, const char *payload, int len)
+{
+	char buf[9 + 64];
 
-	/* Write the pid file */
-	write_pid();
+	flags = htonl(flags);
 
-	/* Mark as dirty since we haven't sent any updates at all yet. */
-	rfbMarkRectAsModified(vncscr, 0, 0, scrinfo.xres, scrinfo.yres);
+	buf[0] = rfbFence;
+	buf[1] = buf[2] = buf[3] = 0;
+	memcpy(buf + 4, &flags, 4);
+	buf[8] = len;
+	memcpy(buf + 9, payload, len);
 
-	/* FB to RFB copying */
-	varblock.r_offset = scrinfo.red.offset + scrinfo.red.length - bitsPerSample;
-	varblock.g_offset = scrinfo.green.offset + scrinfo.green.length - bitsPerSample;
-	varblock.b_offset = scrinfo.blue.offset + scrinfo.blue.length - bitsPerSample;
-	varblock.rfb_xres = scrinfo.yres;
-	varblock.rfb_maxy = scrinfo.xres - 1;
+	if (rfbWriteExact(cl, buf, 9 + len) < 0)
+		rfbCloseClient(cl);
 }
 
-static void changeResolution()
+static rfbBool cu_enable_encoding(rfbClientPtr cl, void **data, int encoding)
 {
-	size_t pixels;
-	size_t bytespp;
+	struct cu_client *cu = *data;
 
-#ifdef DEBUG
-	fprintf(stdout, "Changing resolution.\n");
-#endif
-	/* Clean up the old mapping and buffers*/
-	free(vncbuf);
-	free(fbbuf);
+	if (cu == NULL) {
+		if ((cu = calloc(1, sizeof(struct cu_client))) == NULL)
+			return FALSE;
+		*data = cu;
+	}
 
-	munmap(fbmmap, fbmmap_size);
-	
-	/* Get the new screen layout information */
-	if (ioctl(fbfd, FBIOGET_VSCREENINFO, &scrinfo) != 0) {
-		printf("ioctl error\n");
-		exit(EXIT_FAILURE);
+	if (encoding == rfbEncodingFence) {
+		cu->fence = 1;
+	}
+	else if (!cu->supported) {
+		/* Announce that EnableContinuousUpdates is understood */
+		cu->supported = 1;
+		cu_send_end(cl);
 	}
+	return TRUE;
+}
+
+static rfbBool cu_read(rfbClientPtr cl, char *buf, int len)
+{
+	int n;
 
-	pixels = scrinfo.xres * scrinfo.yres;
-	bytespp = scrinfo.bits_per_pixel / 8;
+	if ((n = rfbReadExact(cl, buf, len)) <= 0) {
+		if (n != 0)
+			fprintf(stderr, "read from client failed, %s\n", strerror(errno));
+		rfbCloseClient(cl);
+		return FALSE;
+	}
+	return TRUE;
+}
 
+static rfbBool cu_handle_message(rfbClientPtr cl, void *data,
+				 const rfbClientToServerMsg *msg)
+{
+	struct cu_client *cu = data;
+	unsigned char buf[64];
+	uint16_t x, y, w, h;
+	uint32_t flags;
+	int len;
+
+	switch (msg->type) {
+	case rfbEnableContinuousUpdates:
+		/* u8 enable, u16 x, y, w, h */
+		if (!cu_read(cl, (char *)buf, 9))
+			return TRUE;
+
+		if (buf[0]) {
+			x = (buf[1] << 8) | buf[2];
+			y = (buf[3] << 8) | buf[4];
+			w = (buf[5] << 8) | buf[6];
+			h = (buf[7] << 8) | buf[8];
+
+			if (cu->region)
+				sraRgnDestroy(cu->region);
+			cu->region = sraRgnCreateRect(x, y, x + w, y + h);
+			cu->enabled = 1;
+		}
+		else {
+			cu->enabled = 0;
+			cu_send_end(cl);
+		}
 #ifdef DEBUG
-	printf("Mapping new fb.\n");
-	fprintf(stdout, "xres=%d, yres=%d, xresv=%d, yresv=%d, xoffs=%d, yoffs=%d, bpp=%d\n", 
-	  (int)scrinfo.xres, (int)scrinfo.yres,
-	  (int)scrinfo.xres_virtual, (int)scrinfo.yres_virtual,
-	  (int)scrinfo.xoffset, (int)scrinfo.yoffset,
-	  (int)scrinfo.bits_per_pixel);
+		fprintf(stdout, "ContinuousUpdates %s for %s\n",
+		  cu->enabled ? "enabled" : "disabled", cl->host);
 #endif
-	/* Map the new framebuffer into memory */
-	
-	fbmmap_size = pixels * bytespp;
-	fbmmap = mmap(NULL, fbmmap_size, PROT_READ, MAP_SHARED, fbfd, 0);
+		return TRUE;
 
-	if (fbmmap == MAP_FAILED) {
-		fprintf(stderr, "mmap failed\n");
-		exit(EXIT_FAILURE);
+	case rfbFence:
+		/* 3 bytes padding, u32 flags, u8 length, payload */
+		if (!cu_read(cl, (char *)buf, 8))
+			return TRUE;
+
+		memcpy(&flags, buf + 3, 4);
+		flags = ntohl(flags);
+		len = buf[7];
+
+		if (len > 64) {
+			fprintf(stderr, "fence payload too long\n");
+			rfbCloseClient(cl);
+			return TRUE;
+		}
+		if (len && !cu_read(cl, (char *)buf, len))
+			return TRUE;
+
+		if (flags & rfbFenceFlagRequest) {
+			/* Messages are handled in order and every update is
+			 * written out before the next message is read, so the
+			 * block flags hold trivially. SyncNext is not offered. */
+			cu_send_fence(cl, flags & (rfbFenceFlagBlockBefore | rfbFenceFlagBlockAfter),
+				      (char *)buf, len);
+		}
+		else if (cu->inflight > 0) {
+			cu->inflight--;
+		}
+		return TRUE;
 	}
 
-	/* Allocate the VNC server buffer to be managed (not manipulated) by 
-	 * libvncserver. */
-	vncbuf = calloc(scrinfo.xres * scrinfo.yres, scrinfo.bits_per_pixel / 8);
-	assert(vncbuf != NULL);
+	return FALSE;
+}
 
-	/* Allocate the comparison buffer for detecting drawing updates from frame
-	 * to frame. */
-	fbbuf = calloc(scrinfo.xres * scrinfo.yres, scrinfo.bits_per_pixel / 8);
-	assert(fbbuf != NULL);
+static void cu_close(rfbClientPtr cl, void *data)
+{
+	struct cu_client *cu = data;
 
-	/* Tell libvncserver that the resolution has changed. */
+	if (cu->region)
+		sraRgnDestroy(cu->region);
+	free(cu);
+}
 
-	//rfbNewFramebuffer (rfbScreenInfoPtr rfbScreen, char *framebuffer, int width, int height, int bitsPerSample, int samplesPerPixel, int bytesPerPixel)
-	rfbNewFramebuffer(vncscr, (char *)vncbuf, scrinfo.xres, scrinfo.yres, 5, 2, (scrinfo.bits_per_pixel / 8));
+static rfbProtocolExtension cu_extension = {
+	.pseudoEncodings = cu_pseudo_encodings,
+	.enablePseudoEncoding = cu_enable_encoding,
+	.handleMessage = cu_handle_message,
+	.close = cu_close,
+};
 
-#ifdef DEBUG
-	printf("Change resolution complete.\n");
-#endif
+/* Re-arm the update request of every continuous client that is not
+ * being throttled, so the next damage goes out without a round trip. */
+static void cu_push(rfbScreenInfoPtr scr)
+{
+	rfbClientIteratorPtr it;
+	rfbClientPtr cl;
+	struct cu_client *cu;
+	int queued;
+
+	it = rfbGetClientIterator(scr);
+	while ((cl = rfbClientIteratorNext(it)) != NULL) {
+		cu = rfbGetExtensionClientData(cl, &cu_extension);
+		if (cu == NULL || !cu->enabled)
+			continue;
+		if (cu->fence && cu->inflight >= cu_max_inflight)
+			continue;
+		if (ioctl(cl->sock, SIOCOUTQ, &queued) == 0 && queued > CU_MAX_QUEUED)
+			continue;
+
+		sraRgnOr(cl->requestedRegion, cu->region);
+	}
+	rfbReleaseClientIterator(it);
+}
+
+/* Follow each pushed update with a fence, its echo acknowledges it */
+static void cu_update_sent(rfbClientPtr cl)
+{
+	struct cu_client *cu = rfbGetExtensionClientData(cl, &cu_extension);
+	uint32_t seq;
+
+	if (cu == NULL || !cu->enabled || !cu->fence)
+		return;
+
+	seq = htonl(++cu->fence_seq);
+	cu->inflight++;
+	cu_send_fence(cl, rfbFenceFlagRequest | rfbFenceFlagBlockBefore,
+		      (char *)&seq, sizeof(seq));
 }
 
 /*****************************************************************************/
-static void injectKeyEvent(uint16_t code, uint16_t value)
+
+/* Pixel translation. libvncserver converts the updates of a viewer that
+ * asked for another pixel format one pixel at a time through lookup
+ * tables. For true colour pairs with a 16 or 32 bpp server, an 8, 16 or
+ * 32 bpp viewer and channels of up to 8 bits, eight pixels are converted
+ * at once with SSE2 instead. Channels are scaled as libvncserver does,
+ * (v * outmax + inmax / 2) / inmax, so the pixels sent are the same. The
+ * division is a multiply by a reciprocal that is checked to be exact over
+ * the whole range. The shifts and reciprocals of a pair of formats are
+ * worked out once and shared by all viewers using them. Every other pair,
+ * and colour map viewers, keep the generic path. */
+
+static int xlate_enabled = 1;
+
+#ifdef __SSE2__
+
+#define XLATE_FORMATS 16
+
+struct xlate {
+	rfbPixelFormat in, out;
+	int usable;
+	int in_shift[3], out_shift[3], div_shift[3];
+	uint16_t in_max[3], out_max[3], half[3], mul[3];
+};
+
+static struct xlate *xlate_formats[XLATE_FORMATS];
+static int xlate_nformats;
+
+static int xlate_same(const rfbPixelFormat *a, const rfbPixelFormat *b)
 {
-    	struct input_event ev;
+	return a->bitsPerPixel == b->bitsPerPixel && a->bigEndian == b->bigEndian &&
+	    a->trueColour == b->trueColour &&
+	    a->redMax == b->redMax && a->greenMax == b->greenMax && a->blueMax == b->blueMax &&
+	    a->redShift == b->redShift && a->greenShift == b->greenShift &&
+	    a->blueShift == b->blueShift;
+}
 
-    	memset(&ev, 0, sizeof(ev));
-    	gettimeofday(&ev.time,0);
-    	ev.type = EV_KEY;
-    	ev.code = code;
-    	ev.value = value;
-    	if(write(kbdfd, &ev, sizeof(ev)) < 0) {
-        	fprintf(stderr,"write event failed, %s\n", strerror(errno));
-    	}
+/* Finds mul and shift with (x * mul) >> (16 + shift) == x / div for every
+ * x up to limit */
+static int xlate_reciprocal(unsigned int div, unsigned int limit, uint16_t *mul, int *shift)
+{
+	unsigned int m, x;
+	int s;
+
+	for (s = 0; s < 16; s++) {
+		m = ((1u << (16 + s)) + div - 1) / div;
+		if (m > 0xffff)
+			break;
+		for (x = 0; x <= limit; x++)
+			if ((x * m) >> (16 + s) != x / div)
+				break;
+		if (x > limit) {
+			*mul = m;
+			*shift = s;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+static void xlate_setup(struct xlate *x)
+{
+	const rfbPixelFormat *in = &x->in, *out = &x->out;
+	int c;
+
+	x->in_max[0] = in->redMax;
+	x->in_max[1] = in->greenMax;
+	x->in_max[2] = in->blueMax;
+	x->in_shift[0] = in->redShift;
+	x->in_shift[1] = in->greenShift;
+	x->in_shift[2] = in->blueShift;
+	x->out_max[0] = out->redMax;
+	x->out_max[1] = out->greenMax;
+	x->out_max[2] = out->blueMax;
+	x->out_shift[0] = out->redShift;
+	x->out_shift[1] = out->greenShift;
+	x->out_shift[2] = out->blueShift;
+
+	/* The server side is in host order, x86 is little endian */
+	if (!in->trueColour || !out->trueColour || in->bigEndian ||
+	    (in->bitsPerPixel != 16 && in->bitsPerPixel != 32) ||
+	    (out->bitsPerPixel != 8 && out->bitsPerPixel != 16 && out->bitsPerPixel != 32) ||
+	    (out->bitsPerPixel > 8 && out->bigEndian))
+		return;
+
+	for (c = 0; c < 3; c++) {
+		if (x->in_max[c] == 0 || x->in_max[c] > 255 || x->out_max[c] > 255 ||
+		    x->in_shift[c] >= in->bitsPerPixel ||
+		    ((uint64_t)x->out_max[c] << x->out_shift[c]) >> out->bitsPerPixel)
+			return;
+		x->half[c] = x->in_max[c] / 2;
+		if (xlate_reciprocal(x->in_max[c], x->in_max[c] * x->out_max[c] + x->half[c],
+				     &x->mul[c], &x->div_shift[c]) < 0)
+			return;
+	}
+	x->usable = 1;
+}
 
+/* The translation of a pair of formats, set up on first use */
+static struct xlate *xlate_get(const rfbPixelFormat *in, const rfbPixelFormat *out)
+{
+	struct xlate *x;
+	int i;
+
+	for (i = 0; i < xlate_nformats; i++)
+		if (xlate_same(&xlate_formats[i]->in, in) && xlate_same(&xlate_formats[i]->out, out))
+			return xlate_formats[i];
+	if (xlate_nformats == XLATE_FORMATS)
+		return NULL;
+
+	x = calloc(1, sizeof(*x));
+	assert(x != NULL);
+	x->in = *in;
+	x->out = *out;
+	xlate_setup(x);
 #ifdef DEBUG
-    	printf("injectKey (%d, %d)\n", code , value);    
+	fprintf(stderr, "translate %d bpp %d/%d/%d to %d bpp %d/%d/%d %s\n",
+	  in->bitsPerPixel, in->redShift, in->greenShift, in->blueShift,
+	  out->bitsPerPixel, out->redShift, out->greenShift, out->blueShift,
+	  x->usable ? "with SSE2" : "generic");
 #endif
-    	gettimeofday(&ev.time,0);
-    	ev.type = EV_SYN;
-    	ev.code = 0;
-    	ev.value = 0;
-    	if(write(kbdfd, &ev, sizeof(ev)) < 0) {
-       	 	fprintf(stderr,"write event failed, %s\n", strerror(errno));
-    	}
+	xlate_formats[xlate_nformats++] = x;
+	return x;
 }
 
-static int keysym2scancode(rfbBool down, rfbKeySym key, rfbClientPtr cl)
+static inline uint32_t xlate_pixel(const struct xlate *x, uint32_t p)
 {
-    	int scancode = 0;
-    	int code = (int)key;
+	uint32_t o = 0, v;
+	int c;
 
-    	if (code>='0' && code<='9') {
-        	scancode = (code & 0xF) - 1;
-        	if (scancode<0) scancode += 10;
-        	scancode += KEY_1;
-    	} else if (code>=0xFF50 && code<=0xFF58) {
-        	static const uint16_t map[] =
-             		{  KEY_HOME, KEY_LEFT, KEY_UP, KEY_RIGHT, KEY_DOWN,
-                	   KEY_PAGEUP , KEY_PAGEDOWN , KEY_END, 0 };
-        	scancode = map[code & 0xF];
-    	} else if (code>=0xFFBE && code<=0xFFC9) {
-        	static const uint16_t map[] =
-             		{  KEY_F1, KEY_F2, KEY_F3, KEY_F4,  KEY_F5,  KEY_F6,
-                	   KEY_F7, KEY_F8, KEY_F9, KEY_F10, KEY_F11, KEY_F12 };
-        	scancode = map[code - 0xFFBE];
-    	} else if (code>=0xFFE1 && code<=0xFFEE) {
-        	static const uint16_t map[] =
-             		{ 0,  KEY_LEFTSHIFT, KEY_LEFTSHIFT,
-                	  KEY_LEFTCTRL, KEY_RIGHTCTRL,
-                	  KEY_LEFTSHIFT, KEY_LEFTSHIFT,
-                	  0,0,
-                	  KEY_LEFTALT, KEY_RIGHTALT,
-                	  0, 0, 0, 0 };
-        	scancode = map[code & 0xF];
-    	} else if ((code>='A' && code<='Z') || (code>='a' && code<='z')) {
-        	static const uint16_t map[] = {
-                	KEY_A, KEY_B, KEY_C, KEY_D, KEY_E,
-                	KEY_F, KEY_G, KEY_H, KEY_I, KEY_J,
-                	KEY_K, KEY_L, KEY_M, KEY_N, KEY_O,
-                	KEY_P, KEY_Q, KEY_R, KEY_S, KEY_T,
-                	KEY_U, KEY_V, KEY_W, KEY_X, KEY_Y, KEY_Z };
-        	scancode = map[(code & 0x5F) - 'A'];
-    	} else {
-        	switch (code) 
-		{
-            		case 0xFE03:    scancode = 92;   			break;
-            		case 0xFF08:    scancode = KEY_BACKSPACE;   		break;
-//            case 0xFF63:    scancode = KEY_INSERT;   break;
-            		case 0xFF1B:    scancode = KEY_ESC;        		break;
-            		case 0xFF09:    scancode = KEY_TAB;         		break;
-            		case 0xFF0D:    scancode = KEY_ENTER;       		break;
-            		case 0xFFFF:    scancode = KEY_DELETE;      		break;
-            		case 0xFFC8:    rfbShutdownServer(cl->screen,TRUE);	break; // F11            
-        	}
-        	if (!scancode) {
-	    		int i;
-	    		unsigned short kcode;
-	    		/* Hunt them down */
-	    		for (i=0;i<nr_keys;i++) {
-	        		/* Looking in keytable for normal keys */
+	for (c = 0; c < 3; c++) {
+		v = (p >> x->in_shift[c]) & x->in_max[c];
+		v = ((v * x->out_max[c] + x->half[c]) * x->mul[c]) >> (16 + x->div_shift[c]);
+		o |= v << x->out_shift[c];
+	}
+	return o;
+}
+
+/* The constants of one channel, the shift counts are in the low quad */
+struct xlate_vec {
+	__m128i shift, mask, max, half, mul, div, out;
+};
+
+static inline __m128i xlate_channel16(__m128i p, const struct xlate_vec *k)
+{
+	return _mm_and_si128(_mm_srl_epi16(p, k->shift), k->mask);
+}
+
+static inline __m128i xlate_channel32(__m128i lo, __m128i hi, const struct xlate_vec *k)
+{
+	return _mm_packs_epi32(_mm_and_si128(_mm_srl_epi32(lo, k->shift), k->mask),
+	    _mm_and_si128(_mm_srl_epi32(hi, k->shift), k->mask));
+}
+
+static inline __m128i xlate_scale(__m128i v, const struct xlate_vec *k)
+{
+	return _mm_srl_epi16(_mm_mulhi_epu16(_mm_add_epi16(_mm_mullo_epi16(v, k->max),
+	    k->half), k->mul), k->div);
+}
+
+/* Inlined for each pair of pixel sizes, so the branches on them go away */
+static inline void xlate_rows(const struct xlate *x, const struct xlate_vec *k,
+			      const int ibpp, const int obpp, const char *src, char *dst,
+			      int stride, int width, int height)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i r, g, b, p, lo, hi, o;
+	uint32_t in, out;
+	int i;
+
+	for (; height > 0; height--, src += stride, dst += width * obpp) {
+		for (i = 0; i + 8 <= width; i += 8) {
+			if (ibpp == 2) {
+				p = _mm_loadu_si128((const __m128i *)(src + i * 2));
+				r = xlate_channel16(p, &k[0]);
+				g = xlate_channel16(p, &k[1]);
+				b = xlate_channel16(p, &k[2]);
+			}
+			else {
+				lo = _mm_loadu_si128((const __m128i *)(src + i * 4));
+				hi = _mm_loadu_si128((const __m128i *)(src + i * 4 + 16));
+				r = xlate_channel32(lo, hi, &k[0]);
+				g = xlate_channel32(lo, hi, &k[1]);
+				b = xlate_channel32(lo, hi, &k[2]);
+			}
+			r = xlate_scale(r, &k[0]);
+			g = xlate_scale(g, &k[1]);
+			b = xlate_scale(b, &k[2]);
+
+			if (obpp == 4) {
+				lo = _mm_or_si128(_mm_or_si128(
+				    _mm_sll_epi32(_mm_unpacklo_epi16(r, zero), k[0].out),
+				    _mm_sll_epi32(_mm_unpacklo_epi16(g, zero), k[1].out)),
+				    _mm_sll_epi32(_mm_unpacklo_epi16(b, zero), k[2].out));
+				hi = _mm_or_si128(_mm_or_si128(
+				    _mm_sll_epi32(_mm_unpackhi_epi16(r, zero), k[0].out),
+				    _mm_sll_epi32(_mm_unpackhi_epi16(g, zero), k[1].out)),
+				    _mm_sll_epi32(_mm_unpackhi_epi16(b, zero), k[2].out));
+				_mm_storeu_si128((__m128i *)(dst + i * 4), lo);
+				_mm_storeu_si128((__m128i *)(dst + i * 4 + 16), hi);
+				continue;
+			}
+
+			o = _mm_or_si128(_mm_or_si128(_mm_sll_epi16(r, k[0].out),
+			    _mm_sll_epi16(g, k[1].out)), _mm_sll_epi16(b, k[2].out));
+			if (obpp == 2)
+				_mm_storeu_si128((__m128i *)(dst + i * 2), o);
+			else
+				_mm_storel_epi64((__m128i *)(dst + i), _mm_packus_epi16(o, o));
+		}
+
+		for (; i < width; i++) {
+			in = 0;
+			memcpy(&in, src + i * ibpp, ibpp);
+			out = xlate_pixel(x, in);
+			memcpy(dst + i * obpp, &out, obpp);
+		}
+	}
+}
+
+/* A rfbTranslateFnType, table is libvncserver's and not used */
+static void xlate_translate(char *table, rfbPixelFormat *in, rfbPixelFormat *out,
+			    char *iptr, char *optr, int bytesBetweenInputLines,
+			    int width, int height)
+{
+	struct xlate *x = xlate_get(in, out);
+	struct xlate_vec k[3];
+	int c;
+
+	/* Only ever installed for a pair that was usable */
+	assert(x != NULL && x->usable);
+
+	for (c = 0; c < 3; c++) {
+		k[c].shift = _mm_cvtsi32_si128(x->in_shift[c]);
+		k[c].mask = in->bitsPerPixel == 16 ?
+		    _mm_set1_epi16(x->in_max[c]) : _mm_set1_epi32(x->in_max[c]);
+		k[c].max = _mm_set1_epi16(x->out_max[c]);
+		k[c].half = _mm_set1_epi16(x->half[c]);
+		k[c].mul = _mm_set1_epi16(x->mul[c]);
+		k[c].div = _mm_cvtsi32_si128(x->div_shift[c]);
+		k[c].out = _mm_cvtsi32_si128(x->out_shift[c]);
+	}
+
+	switch (in->bitsPerPixel * 100 + out->bitsPerPixel) {
+	case 1608:
+		xlate_rows(x, k, 2, 1, iptr, optr, bytesBetweenInputLines, width, height);
+		break;
+	case 1616:
+		xlate_rows(x, k, 2, 2, iptr, optr, bytesBetweenInputLines, width, height);
+		break;
+	case 1632:
+		xlate_rows(x, k, 2, 4, iptr, optr, bytesBetweenInputLines, width, height);
+		break;
+	case 3208:
+		xlate_rows(x, k, 4, 1, iptr, optr, bytesBetweenInputLines, width, height);
+		break;
+	case 3216:
+		xlate_rows(x, k, 4, 2, iptr, optr, bytesBetweenInputLines, width, height);
+		break;
+	default:
+		xlate_rows(x, k, 4, 4, iptr, optr, bytesBetweenInputLines, width, height);
+		break;
+	}
+}
+
+/* libvncserver picks the generic function again on every SetPixelFormat
+ * and resize, so this is checked before each update */
+static void xlate_client(rfbClientPtr cl)
+{
+	struct xlate *x;
+
+	if (cl->translateFn == xlate_translate) {
+		if (!xlate_enabled)
+			rfbSetTranslateFunction(cl);
+		return;
+	}
+	if (!xlate_enabled || cl->translateFn == rfbTranslateNone)
+		return;
+
+	x = xlate_get(&cl->screen->serverFormat, &cl->format);
+	if (x != NULL && x->usable)
+		cl->translateFn = xlate_translate;
+}
+
+static const char *xlate_name(rfbClientPtr cl)
+{
+	return cl->translateFn == rfbTranslateNone ? "none" :
+	    cl->translateFn == xlate_translate ? "sse2" : "generic";
+}
+
+static void xlate_cleanup(void)
+{
+	while (xlate_nformats > 0)
+		free(xlate_formats[--xlate_nformats]);
+}
+
+#else
+
+static void xlate_client(rfbClientPtr cl)
+{
+}
+
+static const char *xlate_name(rfbClientPtr cl)
+{
+	return cl->translateFn == rfbTranslateNone ? "none" : "generic";
+}
+
+static void xlate_cleanup(void)
+{
+}
+
+#endif /* __SSE2__ */
+
+/*****************************************************************************/
+
+/* Viewers pick their levels with every SetEncodings, so the limits are
+ * applied to each update */
+static void client_limits(rfbClientPtr cl)
+{
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+	if (client_compress_max >= 0 && cl->zlibCompressLevel > client_compress_max)
+		cl->zlibCompressLevel = client_compress_max;
+	if (client_quality_max >= 0 &&
+	    (cl->tightQualityLevel < 0 || cl->tightQualityLevel > client_quality_max))
+		cl->tightQualityLevel = client_quality_max;
+#ifdef LIBVNCSERVER_HAVE_LIBJPEG
+	if (client_compress_max >= 0 && cl->tightCompressLevel > client_compress_max)
+		cl->tightCompressLevel = client_compress_max;
+#endif
+	/* The fastest levels for a viewer over its encode budget */
+	if (budget_over(cl)) {
+		if (cl->zlibCompressLevel > 1)
+			cl->zlibCompressLevel = 1;
+#ifdef LIBVNCSERVER_HAVE_LIBJPEG
+		if (cl->tightCompressLevel > 1)
+			cl->tightCompressLevel = 1;
+#endif
+	}
+#endif
+}
+
+static void display_start(rfbClientPtr cl)
+{
+	client_limits(cl);
+	xlate_client(cl);
+	budget_update_start(cl);
+	metrics_update_start(cl);
+	zrle_send_update(cl);
+}
+
+static void display_finished(rfbClientPtr cl, int result)
+{
+	budget_update_done(cl);
+	if (result) {
+		cu_update_sent(cl);
+		metrics_update_sent(cl);
+	}
+}
+
+/*****************************************************************************/
+
+/* Direct Raw path. Raw clients that use the server pixel format are sent
+ * their update straight from vncbuf with scatter-gather I/O instead of
+ * going through libvncserver's update buffer. Where the kernel supports it
+ * the send uses MSG_ZEROCOPY and pins the pages until the kernel reports
+ * the send as completed on the socket error queue. Nothing waits for that:
+ * the completions are reaped as they come, and a client with a send still
+ * pinned gets its next update copied. Pixels the capture rewrites under a
+ * pinned send reach the viewer newer than the rest of that update; they
+ * were marked modified, so the next update brings them in line. vncbuf and
+ * the rect headers are mmap()ed on their own pages, unmapping them leaves
+ * pinned pages to the kernel and never hands them to another allocation. */
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY 5
+#endif
+#ifndef SO_EE_CODE_ZEROCOPY_COPIED
+#define SO_EE_CODE_ZEROCOPY_COPIED 1
+#endif
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+/* Updates smaller than this many bytes are left to libvncserver, 0 turns
+ * the direct path off */
+static int zc_threshold = 64 * 1024;
+
+struct client_data
+{
+	int zc_enabled;		/* SO_ZEROCOPY is set on the socket */
+	uint32_t zc_issued;	/* MSG_ZEROCOPY sends issued */
+	uint32_t zc_done;	/* of those, completions reaped */
+	int zrle_owned;		/* its ZRLE stream is sent by zrle_send_update() */
+	double update_start;	/* the update being sent was started */
+	double damage_time;	/* oldest damage not sent yet was found */
+	double cpu_start;	/* thread CPU time when the update started */
+	double cpu_total;	/* CPU seconds spent on this viewer's updates */
+	double credit;		/* CPU seconds left of its encode budget */
+	double budget_time;	/* the credit was last refilled */
+	double sent_time;	/* the last update was finished */
+	double input_time;	/* the last key or pointer event came in */
+	sraRegionPtr held;	/* requested while over budget */
+	uint32_t deferred;	/* requests held back */
+};
+
+static void zc_reap(rfbClientPtr cl, struct client_data *cd)
+{
+	char control[128];
+	struct msghdr msg;
+	struct cmsghdr *cm;
+	struct sock_extended_err *serr;
+
+	for (;;) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+
+		if (recvmsg(cl->sock, &msg, MSG_ERRQUEUE) < 0)
+			return;
+
+		for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+			if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) &&
+			    !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))
+				continue;
+
+			serr = (struct sock_extended_err *)CMSG_DATA(cm);
+			if (serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+				continue;
+
+			cd->zc_done += serr->ee_data - serr->ee_info + 1;
+
+			/* The kernel copied anyway (e.g. loopback), so stop
+			 * paying for the notifications */
+			if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+				cd->zc_enabled = 0;
+		}
+	}
+}
+
+static rfbBool zc_sendmsg(rfbClientPtr cl, struct client_data *cd,
+			  struct iovec *iov, int iovcnt, int zerocopy)
+{
+	struct msghdr msg;
+	struct pollfd pfd;
+	ssize_t n;
+	int flags;
+
+	while (iovcnt > 0) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = iovcnt > IOV_MAX ? IOV_MAX : iovcnt;
+		flags = MSG_NOSIGNAL | (zerocopy ? MSG_ZEROCOPY : 0);
+
+		if ((n = sendmsg(cl->sock, &msg, flags)) < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == ENOBUFS && zerocopy) {
+				/* Out of optmem for pinned pages, copy instead */
+				zerocopy = 0;
+				continue;
+			}
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				pfd.fd = cl->sock;
+				pfd.events = POLLOUT;
+				if (poll(&pfd, 1, cl->screen->maxClientWait) <= 0)
+					return FALSE;
+				continue;
+			}
+			return FALSE;
+		}
+
+		if (zerocopy)
+			cd->zc_issued++;
+
+		while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++, iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	return TRUE;
+}
+
+/* Viewers that came in through a WebSocket upgrade. wsctx is set for
+ * them by every libvncserver with WebSockets, the older webSockets flag
+ * is gone since 0.9.11. */
+static int client_websocket(rfbClientPtr cl)
+{
+#ifdef LIBVNCSERVER_WITH_WEBSOCKETS
+	return cl->wsctx != NULL;
+#else
+	return 0;
+#endif
+}
+
+static rfbBool zc_eligible(rfbClientPtr cl)
+{
+	return cl->clientData != NULL && cl->sock >= 0 && !cl->onHold &&
+	    cl->state == RFB_NORMAL &&
+	    /* Writing to the socket directly would skip the WebSocket framing */
+	    !client_websocket(cl) &&
+	    cl->preferredEncoding == rfbEncodingRaw &&
+	    cl->translateFn == rfbTranslateNone &&
+	    (cl->screen->cursor == NULL || cl->enableCursorShapeUpdates) &&
+	    !cl->cursorWasChanged && !cl->cursorWasMoved &&
+	    !cl->newFBSizePending &&
+	    sraRgnEmpty(cl->copyRegion);
+}
+
+static void zc_send_update(rfbClientPtr cl, int zerocopy)
+{
+	rfbScreenInfoPtr scr = cl->screen;
+	struct client_data *cd = cl->clientData;
+	sraRegionPtr region;
+	sraRectangleIterator *it;
+	sraRect rect;
+	struct iovec *iov;
+	unsigned char *hdr, *h;
+	int nrects, niov, rows, bpp, y;
+	size_t bytes, hdr_size;
+
+	region = sraRgnCreateRgn(cl->modifiedRegion);
+	sraRgnAnd(region, cl->requestedRegion);
+
+	bpp = scr->serverFormat.bitsPerPixel / 8;
+	nrects = 0;
+	rows = 0;
+	bytes = 0;
+
+	it = sraRgnGetIterator(region);
+	while (sraRgnIteratorNext(it, &rect)) {
+		nrects++;
+		rows += rect.y2 - rect.y1;
+		bytes += (size_t)(rect.x2 - rect.x1) * (rect.y2 - rect.y1) * bpp;
+	}
+	sraRgnReleaseIterator(it);
+
+	if (nrects == 0 || nrects > 0xffff || bytes < (size_t)zc_threshold) {
+		sraRgnDestroy(region);
+		return;
+	}
+
+	/* One send pinned at a time, the next one is copied */
+	zc_reap(cl, cd);
+	if (cd->zc_done != cd->zc_issued)
+		zerocopy = 0;
+
+	/* The headers go out zero-copy too, see above */
+	hdr_size = 4 + 12 * (size_t)nrects;
+	iov = calloc(1 + nrects + rows, sizeof(struct iovec));
+	hdr = mmap(NULL, hdr_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (iov == NULL || hdr == MAP_FAILED) {
+		free(iov);
+		if (hdr != MAP_FAILED)
+			munmap(hdr, hdr_size);
+		sraRgnDestroy(region);
+		return;
+	}
+
+	/* FramebufferUpdate header */
+	hdr[0] = rfbFramebufferUpdate;
+	hdr[1] = 0;
+	hdr[2] = nrects >> 8;
+	hdr[3] = nrects & 0xff;
+	iov[0].iov_base = hdr;
+	iov[0].iov_len = 4;
+	niov = 1;
+
+	h = hdr + 4;
+	it = sraRgnGetIterator(region);
+	while (sraRgnIteratorNext(it, &rect)) {
+		uint16_t v[4] = { htons(rect.x1), htons(rect.y1),
+			htons(rect.x2 - rect.x1), htons(rect.y2 - rect.y1) };
+		uint32_t enc = htonl(rfbEncodingRaw);
+
+		memcpy(h, v, 8);
+		memcpy(h + 8, &enc, 4);
+		iov[niov].iov_base = h;
+		iov[niov].iov_len = 12;
+		niov++;
+		h += 12;
+
+		/* Full width rects are contiguous in vncbuf */
+		if (rect.x1 == 0 && rect.x2 == scr->width) {
+			iov[niov].iov_base = scr->frameBuffer + rect.y1 * scr->paddedWidthInBytes;
+			iov[niov].iov_len = (size_t)(rect.y2 - rect.y1) * scr->paddedWidthInBytes;
+			niov++;
+			continue;
+		}
+		for (y = rect.y1; y < rect.y2; y++) {
+			iov[niov].iov_base = scr->frameBuffer + y * scr->paddedWidthInBytes + rect.x1 * bpp;
+			iov[niov].iov_len = (size_t)(rect.x2 - rect.x1) * bpp;
+			niov++;
+		}
+	}
+	sraRgnReleaseIterator(it);
+
+	budget_update_start(cl);
+	metrics_update_start(cl);
+	zerocopy = zerocopy && cd->zc_enabled;
+	if (!zc_sendmsg(cl, cd, iov, niov, zerocopy)) {
+		fprintf(stderr, "write to %s failed, %s\n", cl->host, strerror(errno));
+		rfbCloseClient(cl);
+	}
+	else {
+		rfbStatRecordMessageSent(cl, rfbFramebufferUpdate, 4, 4);
+		rfbStatRecordEncodingSent(cl, rfbEncodingRaw, 12 * nrects + bytes, 12 * nrects + bytes);
+	}
+
+	sraRgnSubtract(cl->modifiedRegion, region);
+	sraRgnMakeEmpty(cl->requestedRegion);
+	sraRgnDestroy(region);
+	free(iov);
+	munmap(hdr, hdr_size);
+
+	display_finished(cl, cl->sock >= 0);
+}
+
+static void zc_send_updates(rfbScreenInfoPtr scr)
+{
+	rfbClientIteratorPtr it;
+	rfbClientPtr cl;
+	int zerocopy = 1;
+
+	if (zc_threshold <= 0)
+		return;
+
+	/* libvncserver paints its soft cursor into the framebuffer for
+	 * clients without cursor shape updates, which would alter pages
+	 * still pinned by a zero-copy send */
+	it = rfbGetClientIterator(scr);
+	while ((cl = rfbClientIteratorNext(it)) != NULL)
+		if (scr->cursor != NULL && !cl->enableCursorShapeUpdates)
+			zerocopy = 0;
+	rfbReleaseClientIterator(it);
+
+	it = rfbGetClientIterator(scr);
+	while ((cl = rfbClientIteratorNext(it)) != NULL)
+		if (zc_eligible(cl))
+			zc_send_update(cl, zerocopy);
+	rfbReleaseClientIterator(it);
+}
+
+/*****************************************************************************/
+
+static void client_gone(rfbClientPtr cl)
+{
+	DTRACE_PROBE3(fbvncserver, client_disconnect, cl->screen->port, cl->sock, cl->host);
+	metrics_client_gone(cl);
+	latency_client_gone(cl);
+	if (cl->clientData != NULL)
+		sraRgnDestroy(((struct client_data *)cl->clientData)->held);
+	free(cl->clientData);
+	cl->clientData = NULL;
+}
+
+static enum rfbNewClientAction client_new(rfbClientPtr cl)
+{
+	struct client_data *cd;
+	int one = 1;
+
+	if ((cd = calloc(1, sizeof(struct client_data))) == NULL)
+		return RFB_CLIENT_REFUSE;
+	cd->held = sraRgnCreate();
+
+	if (zc_threshold > 0 &&
+	    setsockopt(cl->sock, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0)
+		cd->zc_enabled = 1;
+
+	cl->clientData = cd;
+	cl->clientGoneHook = client_gone;
+
+	DTRACE_PROBE3(fbvncserver, client_connect, cl->screen->port, cl->sock, cl->host);
+	return RFB_CLIENT_ACCEPT;
+}
+/*****************************************************************************/
+
+/* Metrics. Counters and histograms are kept per head all the time, they
+ * cost a few clock reads per frame. With -M they are served in Prometheus
+ * text format on a local TCP port or unix socket. */
+
+static char *metrics_addr = NULL;
+static int metrics_listenfd = -1;
+static int metrics_unix = 0;
+
+/* Connections to the local request sockets. They are non-blocking and
+ * served from the select loop as their bytes come in, so a slow or stuck
+ * client never holds up the capture. */
+
+#define CONN_MAX 8
+#define CONN_TIMEOUT 10.0	/* seconds a connection may stay open */
+
+struct conn
+{
+	int fd;
+	double start;
+	size_t len;		/* of the request read so far */
+	char req[4096];
+	char *out;		/* reply not sent yet */
+	size_t out_len, out_sent;
+	int done;		/* close once the reply is out */
+};
+
+struct conn_set
+{
+	struct conn conns[CONN_MAX];
+	int n;
+};
+
+static struct conn_set metrics_conns;
+
+static const char *input_names[INPUT_TYPES] = { "key", "pointer", "wheel", "touch" };
+
+static double now_seconds(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void hist_init(struct histogram *hist, double base)
+{
+	memset(hist, 0, sizeof(*hist));
+	hist->base = base;
+}
+
+static void hist_observe(struct histogram *hist, double v)
+{
+	double le = hist->base;
+	int i;
+
+	for (i = 0; i < HIST_BUCKETS - 1 && v > le; i++)
+		le *= 2;
+	if (v <= le)
+		hist->buckets[i]++;
+	hist->count++;
+	hist->sum += v;
+}
+
+static void metrics_init_head(struct head *h)
+{
+	hist_init(&h->metrics.scan_seconds, 1e-6);
+	hist_init(&h->metrics.damage_rects, 1);
+	hist_init(&h->metrics.update_seconds, 1e-6);
+	hist_init(&h->metrics.latency_seconds, 1e-6);
+	hist_init(&h->metrics.lat_inject_draw, 1e-6);
+	hist_init(&h->metrics.lat_draw_capture, 1e-6);
+	hist_init(&h->metrics.lat_capture_encode, 1e-6);
+	hist_init(&h->metrics.lat_encode_send, 1e-6);
+	hist_init(&h->metrics.lat_total, 1e-6);
+}
+
+/* A scan found damage, start the latency clock of every client that has
+ * nothing older pending */
+static void metrics_damage(struct head *h, double t)
+{
+	rfbClientIteratorPtr it;
+	rfbClientPtr cl;
+	struct client_data *cd;
+
+	it = rfbGetClientIterator(h->vncscr);
+	while ((cl = rfbClientIteratorNext(it)) != NULL) {
+		cd = cl->clientData;
+		if (cd != NULL && cd->damage_time == 0)
+			cd->damage_time = t;
+	}
+	rfbReleaseClientIterator(it);
+}
+
+static void metrics_update_start(rfbClientPtr cl)
+{
+	struct client_data *cd = cl->clientData;
+	double t = now_seconds();
+
+	if (cd != NULL)
+		cd->update_start = t;
+	latency_update_start(cl, t);
+}
+
+static void metrics_update_sent(rfbClientPtr cl)
+{
+	struct head *h = cl->screen->screenData;
+	struct client_data *cd = cl->clientData;
+	double t = now_seconds();
+
+	if (cd == NULL)
+		return;
+	if (cd->update_start != 0)
+		hist_observe(&h->metrics.update_seconds, t - cd->update_start);
+	if (cd->damage_time != 0)
+		hist_observe(&h->metrics.latency_seconds, t - cd->damage_time);
+	cd->update_start = 0;
+	cd->damage_time = 0;
+
+	latency_update_sent(cl, t);
+}
+
+static void metrics_add_encoding(struct head_metrics *m, uint32_t type, uint64_t bytes)
+{
+	int i;
+
+	for (i = 0; i < m->nencodings; i++)
+		if (m->encoding[i] == type)
+			break;
+	if (i == m->nencodings) {
+		if (i == METRICS_MAX_ENCODINGS)
+			return;
+		m->encoding[i] = type;
+		m->encoding_bytes[i] = 0;
+		m->nencodings++;
+	}
+	m->encoding_bytes[i] += bytes;
+}
+
+/* Keep the bytes of a leaving client in the per encoding totals */
+static void metrics_client_gone(rfbClientPtr cl)
+{
+	struct head *h = cl->screen->screenData;
+	rfbStatList *s;
+
+	if (h == NULL)
+		return;
+	for (s = cl->statEncList; s != NULL; s = s->Next)
+		metrics_add_encoding(&h->metrics, s->type, s->bytesSent);
+}
+
+static void metrics_print_hist(FILE *f, const char *name, const char *help, size_t off)
+{
+	struct head *h;
+	struct histogram *hist;
+	uint64_t n;
+	double le;
+	int i;
+
+	fprintf(f, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+	for (h = heads; h != NULL; h = h->next) {
+		hist = (struct histogram *)((char *)&h->metrics + off);
+		n = 0;
+		le = hist->base;
+		for (i = 0; i < HIST_BUCKETS; i++, le *= 2) {
+			n += hist->buckets[i];
+			fprintf(f, "%s_bucket{port=\"%d\",le=\"%g\"} %llu\n",
+			  name, h->port, le, (unsigned long long)n);
+		}
+		fprintf(f, "%s_bucket{port=\"%d\",le=\"+Inf\"} %llu\n",
+		  name, h->port, (unsigned long long)hist->count);
+		fprintf(f, "%s_sum{port=\"%d\"} %g\n", name, h->port, hist->sum);
+		fprintf(f, "%s_count{port=\"%d\"} %llu\n",
+		  name, h->port, (unsigned long long)hist->count);
+	}
+}
+
+static void metrics_print_counter(FILE *f, const char *name, const char *help, size_t off)
+{
+	struct head *h;
+
+	fprintf(f, "# HELP %s %s\n# TYPE %s counter\n", name, help, name);
+	for (h = heads; h != NULL; h = h->next)
+		fprintf(f, "%s{port=\"%d\"} %llu\n", name, h->port,
+		  (unsigned long long)*(uint64_t *)((char *)&h->metrics + off));
+}
+
+static void metrics_print(FILE *f)
+{
+	struct head_metrics enc;
+	rfbClientIteratorPtr it;
+	rfbClientPtr cl;
+	rfbStatList *s;
+	struct head *h;
+	char name[64];
+	int i;
+
+	metrics_print_hist(f, "fbvnc_scan_seconds",
+	  "Time to compare and convert one frame.",
+	  offsetof(struct head_metrics, scan_seconds));
+	metrics_print_hist(f, "fbvnc_damage_rects",
+	  "Damage rects found per frame.",
+	  offsetof(struct head_metrics, damage_rects));
+	metrics_print_hist(f, "fbvnc_update_seconds",
+	  "Time to translate, encode and write one client update.",
+	  offsetof(struct head_metrics, update_seconds));
+	metrics_print_hist(f, "fbvnc_update_latency_seconds",
+	  "Time from detecting damage to having sent it to a client.",
+	  offsetof(struct head_metrics, latency_seconds));
+	metrics_print_hist(f, "fbvnc_input_inject_draw_seconds",
+	  "Input injected to drawn, a lower bound.",
+	  offsetof(struct head_metrics, lat_inject_draw));
+	metrics_print_hist(f, "fbvnc_input_draw_capture_seconds",
+	  "Input drawn to captured, up to one scan period.",
+	  offsetof(struct head_metrics, lat_draw_capture));
+	metrics_print_hist(f, "fbvnc_input_capture_encode_seconds",
+	  "Input captured to encoding started.",
+	  offsetof(struct head_metrics, lat_capture_encode));
+	metrics_print_hist(f, "fbvnc_input_encode_send_seconds",
+	  "Input encoding started to written to the socket.",
+	  offsetof(struct head_metrics, lat_encode_send));
+	metrics_print_hist(f, "fbvnc_input_latency_seconds",
+	  "Input injected to its update written to the socket.",
+	  offsetof(struct head_metrics, lat_total));
+
+	metrics_print_counter(f, "fbvnc_frames_total",
+	  "Frames scanned.", offsetof(struct head_metrics, frames));
+	metrics_print_counter(f, "fbvnc_pixels_compared_total",
+	  "Pixels compared against the previous frame.",
+	  offsetof(struct head_metrics, pixels_compared));
+	metrics_print_counter(f, "fbvnc_pixels_changed_total",
+	  "Pixels found changed, counted by 32 bit word.",
+	  offsetof(struct head_metrics, pixels_changed));
+	metrics_print_counter(f, "fbvnc_damage_pixels_total",
+	  "Area of the damage rects handed to the encoders.",
+	  offsetof(struct head_metrics, damage_area));
+	metrics_print_counter(f, "fbvnc_resolution_changes_total",
+	  "Framebuffer mode changes followed.",
+	  offsetof(struct head_metrics, resolution_changes));
+	metrics_print_counter(f, "fbvnc_recording_dropped_total",
+	  "Records dropped because the recording buffer was full.",
+	  offsetof(struct head_metrics, rec_dropped));
+
+	fprintf(f, "# HELP fbvnc_input_events_total Input events injected.\n"
+	  "# TYPE fbvnc_input_events_total counter\n");
+	for (h = heads; h != NULL; h = h->next)
+		for (i = 0; i < INPUT_TYPES; i++)
+			fprintf(f, "fbvnc_input_events_total{port=\"%d\",type=\"%s\"} %llu\n",
+			  h->port, input_names[i],
+			  (unsigned long long)h->metrics.input_events[i]);
+
+	fprintf(f, "# HELP fbvnc_clients Connected VNC clients.\n"
+	  "# TYPE fbvnc_clients gauge\n");
+	for (h = heads; h != NULL; h = h->next) {
+		int n = 0;
+
+		it = rfbGetClientIterator(h->vncscr);
+		while (rfbClientIteratorNext(it) != NULL)
+			n++;
+		rfbReleaseClientIterator(it);
+		fprintf(f, "fbvnc_clients{port=\"%d\"} %d\n", h->port, n);
+	}
+
+	fprintf(f, "# HELP fbvnc_client_bytes_sent_total Bytes sent to a connected client.\n"
+	  "# TYPE fbvnc_client_bytes_sent_total counter\n");
+	for (h = heads; h != NULL; h = h->next) {
+		it = rfbGetClientIterator(h->vncscr);
+		while ((cl = rfbClientIteratorNext(it)) != NULL) {
+			for (s = cl->statEncList; s != NULL; s = s->Next) {
+				if (s->bytesSent == 0)
+					continue;
+				fprintf(f, "fbvnc_client_bytes_sent_total{port=\"%d\",client=\"%s/%d\",encoding=\"%s\"} %u\n",
+				  h->port, cl->host, cl->sock,
+				  encodingName(s->type, name, sizeof(name)), s->bytesSent);
+			}
+		}
+		rfbReleaseClientIterator(it);
+	}
+
+	fprintf(f, "# HELP fbvnc_encoding_bytes_sent_total Bytes sent by encoding, all clients.\n"
+	  "# TYPE fbvnc_encoding_bytes_sent_total counter\n");
+	for (h = heads; h != NULL; h = h->next) {
+		enc = h->metrics;
+		it = rfbGetClientIterator(h->vncscr);
+		while ((cl = rfbClientIteratorNext(it)) != NULL)
+			for (s = cl->statEncList; s != NULL; s = s->Next)
+				metrics_add_encoding(&enc, s->type, s->bytesSent);
+		rfbReleaseClientIterator(it);
+
+		for (i = 0; i < enc.nencodings; i++)
+			fprintf(f, "fbvnc_encoding_bytes_sent_total{port=\"%d\",encoding=\"%s\"} %llu\n",
+			  h->port, encodingName(enc.encoding[i], name, sizeof(name)),
+			  (unsigned long long)enc.encoding_bytes[i]);
+	}
+}
+
+static int metrics_init(void)
+{
+	struct sockaddr_un un;
+	struct sockaddr_in in;
+	char *end;
+	long port;
+	int one = 1, ret;
+	mode_t mask;
+
+	if (metrics_addr == NULL)
+		return 0;
+
+	port = strtol(metrics_addr, &end, 10);
+	if (*end == '\0') {
+		/* Only local scrapers, the counters name client addresses */
+		memset(&in, 0, sizeof(in));
+		in.sin_family = AF_INET;
+		in.sin_port = htons(port);
+		in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+		/* The process started by a hot upgrade binds while the
+		 * old one still listens */
+		if ((metrics_listenfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0 ||
+		    setsockopt(metrics_listenfd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0 ||
+		    bind(metrics_listenfd, (struct sockaddr *)&in, sizeof(in)) < 0 ||
+		    listen(metrics_listenfd, 4) < 0) {
+			fprintf(stderr, "cannot listen on metrics port %ld, %s\n", port, strerror(errno));
+			return -1;
+		}
+		return 0;
+	}
+
+	metrics_unix = 1;
+	memset(&un, 0, sizeof(un));
+	un.sun_family = AF_UNIX;
+	strncpy(un.sun_path, metrics_addr, sizeof(un.sun_path) - 1);
+	unlink(metrics_addr);
+
+	if ((metrics_listenfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
+		fprintf(stderr, "cannot listen on %s, %s\n", metrics_addr, strerror(errno));
+		return -1;
+	}
+
+	/* The socket is created 0600, nobody else gets to connect first */
+	mask = umask(0177);
+	ret = bind(metrics_listenfd, (struct sockaddr *)&un, sizeof(un));
+	umask(mask);
+	if (ret < 0 || listen(metrics_listenfd, 4) < 0) {
+		fprintf(stderr, "cannot listen on %s, %s\n", metrics_addr, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+static void conn_drop(struct conn_set *set, int i)
+{
+	if (set->conns[i].fd >= 0)
+		close(set->conns[i].fd);
+	free(set->conns[i].out);
+	set->conns[i] = set->conns[--set->n];
+}
+
+/* Accepts new connections while there is room for them */
+static void conn_accept(struct conn_set *set, int listenfd)
+{
+	struct conn *c;
+	int fd;
+
+	while (listenfd >= 0 && set->n < CONN_MAX &&
+	       (fd = accept4(listenfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+		c = &set->conns[set->n++];
+		memset(c, 0, sizeof(*c));
+		c->fd = fd;
+		c->start = now_seconds();
+	}
+}
+
+static void conn_select(struct conn_set *set, int listenfd, fd_set *rfds, fd_set *wfds, int *maxfd)
+{
+	int i, fd;
+
+	if (listenfd >= 0 && set->n < CONN_MAX) {
+		FD_SET(listenfd, rfds);
+		if (listenfd > *maxfd)
+			*maxfd = listenfd;
+	}
+	for (i = 0; i < set->n; i++) {
+		fd = set->conns[i].fd;
+		if (set->conns[i].out_sent < set->conns[i].out_len)
+			FD_SET(fd, wfds);
+		else if (!set->conns[i].done)
+			FD_SET(fd, rfds);
+		if (fd > *maxfd)
+			*maxfd = fd;
+	}
+}
+
+/* Reads what arrived. Returns 1 for new bytes, 0 for nothing new, -1
+ * once the client shut down its end or the request buffer is full. */
+static int conn_recv(struct conn *c)
+{
+	ssize_t n;
+
+	if (c->len >= sizeof(c->req) - 1)
+		return -1;
+	n = recv(c->fd, c->req + c->len, sizeof(c->req) - 1 - c->len, 0);
+	if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+		return 0;
+	if (n <= 0)
+		return -1;
+	c->len += n;
+	c->req[c->len] = '\0';
+	return 1;
+}
+
+/* Sends what the socket takes now. Returns -1 if the connection broke. */
+static int conn_flush(struct conn *c)
+{
+	ssize_t n;
+
+	while (c->out_sent < c->out_len) {
+		n = send(c->fd, c->out + c->out_sent, c->out_len - c->out_sent,
+		  MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return 0;
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		c->out_sent += n;
+	}
+	free(c->out);
+	c->out = NULL;
+	c->out_len = c->out_sent = 0;
+	return 0;
+}
+
+/* Queues a reply, the buffer becomes the connection's */
+static int conn_send(struct conn *c, char *buf, size_t len)
+{
+	char *p;
+
+	if (len == 0) {
+		free(buf);
+		return 0;
+	}
+	if (c->out == NULL) {
+		c->out = buf;
+		c->out_len = len;
+		c->out_sent = 0;
+	}
+	else {
+		if ((p = realloc(c->out, c->out_len + len)) == NULL) {
+			free(buf);
+			return -1;
+		}
+		memcpy(p + c->out_len, buf, len);
+		c->out = p;
+		c->out_len += len;
+		free(buf);
+	}
+	return conn_flush(c);
+}
+
+/* Sends queued replies, drops connections that are finished, broke or
+ * took too long. The caller has read and answered requests before. */
+static void conn_finish(struct conn_set *set)
+{
+	double now = now_seconds();
+	int i;
+
+	for (i = 0; i < set->n; i++) {
+		struct conn *c = &set->conns[i];
+
+		if (conn_flush(c) < 0 || now - c->start > CONN_TIMEOUT ||
+		    (c->done && c->out_sent >= c->out_len))
+			conn_drop(set, i--);
+	}
+}
+
+static void metrics_reply(int fd, const char *status, const char *type, const char *body, size_t len)
+{
+	char hdr[256];
+	int n;
+
+	n = snprintf(hdr, sizeof(hdr), "HTTP/1.0 %s\r\nContent-Type: %s\r\n"
+	  "Content-Length: %zu\r\nConnection: close\r\n\r\n", status, type, len);
+	if (send(fd, hdr, n, MSG_NOSIGNAL) == n && len > 0)
+		send(fd, body, len, MSG_NOSIGNAL);
+}
+
+/* Answers a complete request. Returns 0 once the connection has been
+ * handed to the thumbnail thread. */
+static int metrics_serve(struct conn *c)
+{
+	char path[256], *body = NULL, *reply = NULL, *query;
+	size_t size, len;
+	FILE *f;
+	int fd = c->fd;
+
+	if (sscanf(c->req, "GET %255s", path) != 1) {
+		metrics_reply(fd, "400 Bad Request", "text/plain", NULL, 0);
+		return -1;
+	}
+	if ((query = strchr(path, '?')) != NULL)
+		*query++ = '\0';
+
+	if (!strcmp(path, "/thumbnail.png") || !strcmp(path, "/snapshot.png")) {
+		/* The thread writes with a timeout of its own */
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+		return thumb_request(fd, query, path[1] == 's');
+	}
+
+	if (strcmp(path, "/metrics") && strcmp(path, "/")) {
+		metrics_reply(fd, "404 Not Found", "text/plain", NULL, 0);
+		return -1;
+	}
+
+	if ((f = open_memstream(&body, &size)) == NULL) {
+		metrics_reply(fd, "500 Internal Server Error", "text/plain", NULL, 0);
+		return -1;
+	}
+	metrics_print(f);
+	fclose(f);
+
+	/* Larger than the socket may take at once, sent as it drains */
+	if ((f = open_memstream(&reply, &len)) != NULL) {
+		fprintf(f, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+		  "Content-Length: %zu\r\nConnection: close\r\n\r\n", size);
+		fwrite(body, 1, size, f);
+		fclose(f);
+		conn_send(c, reply, len);
+	}
+	free(body);
+	return -1;
+}
+
+static void metrics_poll(void)
+{
+	struct conn_set *set = &metrics_conns;
+	struct conn *c;
+	int i, ret;
+
+	conn_accept(set, metrics_listenfd);
+	for (i = 0; i < set->n; i++) {
+		c = &set->conns[i];
+		if (c->done)
+			continue;
+
+		/* One request per connection, answered once its head is in */
+		ret = conn_recv(c);
+		if (ret == 0 || (ret > 0 && !strstr(c->req, "\r\n\r\n") && !strstr(c->req, "\n\n")))
+			continue;
+
+		c->done = 1;
+		if (metrics_serve(c) == 0) {
+			/* The thumbnail thread closes it */
+			c->fd = -1;
+			conn_drop(set, i--);
+		}
+	}
+	conn_finish(set);
+}
+
+static void metrics_cleanup(void)
+{
+	while (metrics_conns.n > 0)
+		conn_drop(&metrics_conns, 0);
+	if (metrics_listenfd < 0)
+		return;
+	close(metrics_listenfd);
+	if (metrics_unix)
+		unlink(metrics_addr);
+}
+
+/*****************************************************************************/
+
+/* Input to screen latency. A key press or button change is timestamped
+ * when it is injected, and followed until the update showing its effect
+ * has been written to the client that sent it:
+ *   inject  - the event was written to the input device
+ *   draw    - estimated as the end of the last scan that saw no change,
+ *             so inject->draw is a lower bound and draw->capture holds
+ *             up to one scan period
+ *   capture - the scan that found the damage ended
+ *   encode  - libvncserver started on the update for the client
+ *   send    - the update was written to the socket
+ * One input per head is followed at a time, those arriving meanwhile are
+ * not sampled. */
+
+enum { LAT_IDLE, LAT_INJECTED, LAT_CAPTURED, LAT_ENCODING };
+
+/* Test mode (-L): inject keys on the primary head and report */
+static int lat_test_count = 0;
+static int lat_test_done;
+static int lat_test_missed;
+static double lat_test_next;
+static rfbClientPtr lat_test_client;
+static double (*lat_test_samples)[LAT_STAGES];
+
+static void latency_input(struct head *h, rfbClientPtr cl)
+{
+	if (h->lat.state != LAT_IDLE)
+		return;
+	h->lat.state = LAT_INJECTED;
+	h->lat.cl = cl;
+	h->lat.inject = now_seconds();
+}
+
+/* Called after every scan, t1 is when it ended */
+static void latency_scanned(struct head *h, int changed, double t1)
+{
+	if (h->lat.state == LAT_INJECTED && changed) {
+		h->lat.draw = h->lat.last_scan > h->lat.inject ? h->lat.last_scan : h->lat.inject;
+		h->lat.capture = t1;
+		h->lat.state = LAT_CAPTURED;
+	}
+	h->lat.last_scan = t1;
+}
+
+static void latency_update_start(rfbClientPtr cl, double t)
+{
+	struct head *h = cl->screen->screenData;
+
+	if (h->lat.state == LAT_CAPTURED && h->lat.cl == cl) {
+		h->lat.encode = t;
+		h->lat.state = LAT_ENCODING;
+	}
+}
+
+static void latency_update_sent(rfbClientPtr cl, double t)
+{
+	struct head *h = cl->screen->screenData;
+	struct head_metrics *m = &h->metrics;
+	double stage[LAT_STAGES];
+
+	if (h->lat.state != LAT_ENCODING || h->lat.cl != cl)
+		return;
+
+	stage[0] = h->lat.draw - h->lat.inject;
+	stage[1] = h->lat.capture - h->lat.draw;
+	stage[2] = h->lat.encode - h->lat.capture;
+	stage[3] = t - h->lat.encode;
+	stage[4] = t - h->lat.inject;
+
+	hist_observe(&m->lat_inject_draw, stage[0]);
+	hist_observe(&m->lat_draw_capture, stage[1]);
+	hist_observe(&m->lat_capture_encode, stage[2]);
+	hist_observe(&m->lat_encode_send, stage[3]);
+	hist_observe(&m->lat_total, stage[4]);
+
+	if (cl == lat_test_client && lat_test_done < lat_test_count)
+		memcpy(lat_test_samples[lat_test_done++], stage, sizeof(stage));
+
+	h->lat.state = LAT_IDLE;
+}
+
+static void latency_client_gone(rfbClientPtr cl)
+{
+	struct head *h = cl->screen->screenData;
+
+	if (h != NULL && h->lat.cl == cl)
+		h->lat.state = LAT_IDLE;
+	if (cl == lat_test_client)
+		lat_test_client = NULL;
+}
+
+/* The test viewer reads everything as fast as it comes */
+static void *latency_test_drain(void *arg)
+{
+	int fd = (long)arg;
+	char buf[65536];
+
+	while (read(fd, buf, sizeof(buf)) > 0)
+		;
+	close(fd);
+	return NULL;
+}
+
+/* Attach a Raw viewer on a socketpair to the head, past the handshake */
+static int latency_test_start(struct head *h)
+{
+	pthread_t thread;
+	int sv[2];
+
+	lat_test_samples = calloc(lat_test_count, sizeof(*lat_test_samples));
+	if (lat_test_samples == NULL ||
+	    socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0)
+		return -1;
+
+	if (pthread_create(&thread, NULL, latency_test_drain, (void *)(long)sv[1]) != 0) {
+		close(sv[0]);
+		close(sv[1]);
+		return -1;
+	}
+	pthread_detach(thread);
+
+	if ((lat_test_client = rfbNewClient(h->vncscr, sv[0])) == NULL)
+		return -1;
+
+	lat_test_client->state = RFB_NORMAL;
+	lat_test_client->protocolMajorVersion = 3;
+	lat_test_client->protocolMinorVersion = 8;
+	lat_test_client->format = h->vncscr->serverFormat;
+	lat_test_client->preferredEncoding = rfbEncodingRaw;
+	rfbSetTranslateFunction(lat_test_client);
+
+	printf("Latency test: %d key presses on port %d, scanning %d times per second\n",
+	  lat_test_count, h->port, frame_rate);
+	lat_test_next = now_seconds() + 1;
+	return 0;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void latency_test_report(void)
+{
+	static const char *names[LAT_STAGES] = {
+		"inject->draw", "draw->capture", "capture->encode", "encode->send", "total"
+	};
+	double *v;
+	int i, j, n = lat_test_done;
+
+	printf("Latency test: %d samples, %d presses without a visible update\n",
+	  n, lat_test_missed);
+	if (n == 0)
+		return;
+
+	v = calloc(n, sizeof(double));
+	assert(v != NULL);
+
+	printf("%-16s %10s %10s %10s %10s  (ms)\n", "stage", "min", "median", "p90", "max");
+	for (i = 0; i < LAT_STAGES; i++) {
+		for (j = 0; j < n; j++)
+			v[j] = lat_test_samples[j][i] * 1000;
+		qsort(v, n, sizeof(double), cmp_double);
+		printf("%-16s %10.3f %10.3f %10.3f %10.3f\n", names[i],
+		  v[0], v[n / 2], v[(n * 9) / 10 < n ? (n * 9) / 10 : n - 1], v[n - 1]);
+	}
+	free(v);
+}
+
+/* One step per main loop pass: press a key when the last one is done */
+static void latency_test_step(struct head *h)
+{
+	static int toggle;
+	sraRegionPtr full;
+	double t = now_seconds();
+
+	if (lat_test_client == NULL || lat_test_done >= lat_test_count) {
+		latency_test_report();
+		shutdown_set = 1;
+		return;
+	}
+
+	/* Keep a full update request outstanding */
+	full = sraRgnCreateRect(0, 0, h->vncscr->width, h->vncscr->height);
+	sraRgnOr(lat_test_client->requestedRegion, full);
+	sraRgnDestroy(full);
+
+	if (h->lat.state != LAT_IDLE) {
+		if (t - h->lat.inject > 2) {
+			lat_test_missed++;
+			h->lat.state = LAT_IDLE;
+		}
+		return;
+	}
+	if (t < lat_test_next)
+		return;
+
+	/* Typing and erasing a character keeps the console as it was */
+	latency_input(h, lat_test_client);
+	toggle = !toggle;
+	injectKeyEvent(h, toggle ? KEY_X : KEY_BACKSPACE, 1);
+	injectKeyEvent(h, toggle ? KEY_X : KEY_BACKSPACE, 0);
+	lat_test_next = t + 0.2;
+}
+
+/*****************************************************************************/
+
+/* Encode budget (-E). Viewers are encoded one after the other on the main
+ * thread, so one that asks for an expensive encoding of a busy screen
+ * slows all the others down. The thread CPU time of every update is
+ * charged to its viewer. The budget, a percentage of one CPU, is split
+ * between the active viewers: those sent an update in the last second or
+ * waiting on a held request. A viewer that sent input in the last half
+ * second counts double. Its share refills a credit, of at most
+ * BUDGET_BURST seconds worth. A viewer in debt gets the fastest
+ * compression level. Its update requests are held back until the credit
+ * is positive again, unless it is interactive, so typing stays responsive
+ * while heavy viewers are still served at their share. */
+
+#define BUDGET_BURST		0.2
+#define BUDGET_ACTIVE		1.0
+#define BUDGET_INTERACTIVE	0.5
+
+static int encode_budget = 0;
+static int budget_on;
+static int budget_weights;
+
+static double cpu_seconds(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void budget_update_start(rfbClientPtr cl)
+{
+	struct client_data *cd = cl->clientData;
+
+	if (cd != NULL)
+		cd->cpu_start = cpu_seconds();
+}
+
+static void budget_update_done(rfbClientPtr cl)
+{
+	struct client_data *cd = cl->clientData;
+	double cpu;
+
+	if (cd == NULL || cd->cpu_start == 0)
+		return;
+	cpu = cpu_seconds() - cd->cpu_start;
+	cd->cpu_start = 0;
+	cd->cpu_total += cpu;
+	if (budget_on)
+		cd->credit -= cpu;
+	cd->sent_time = now_seconds();
+}
+
+static void budget_input(rfbClientPtr cl)
+{
+	struct client_data *cd = cl->clientData;
+
+	if (cd != NULL)
+		cd->input_time = now_seconds();
+}
+
+static int budget_over(rfbClientPtr cl)
+{
+	struct client_data *cd = cl->clientData;
+
+	return budget_on && cd != NULL && cd->credit < 0;
+}
+
+static int budget_weight(struct client_data *cd, double t)
+{
+	if (t - cd->input_time < BUDGET_INTERACTIVE)
+		return 2;
+	return t - cd->sent_time < BUDGET_ACTIVE || !sraRgnEmpty(cd->held);
+}
+
+static void budget_count(rfbClientPtr cl, struct client_data *cd, double t)
+{
+	budget_weights += budget_weight(cd, t);
+}
+
+static void budget_refill(rfbClientPtr cl, struct client_data *cd, double t)
+{
+	int w = budget_weight(cd, t);
+	double share;
+
+	if (!budget_on) {
+		cd->credit = 0;
+		cd->budget_time = 0;
+	}
+	else if (w > 0) {
+		share = encode_budget / 100.0 * w / budget_weights;
+		cd->credit += (t - cd->budget_time) * share;
+		if (cd->credit > BUDGET_BURST * share)
+			cd->credit = BUDGET_BURST * share;
+	}
+	cd->budget_time = t;
+
+	if (cd->credit < 0 && w < 2) {
+		if (!sraRgnEmpty(cl->requestedRegion)) {
+			sraRgnOr(cd->held, cl->requestedRegion);
+			sraRgnMakeEmpty(cl->requestedRegion);
+			cd->deferred++;
+		}
+	}
+	else if (!sraRgnEmpty(cd->held)) {
+		sraRgnOr(cl->requestedRegion, cd->held);
+		sraRgnMakeEmpty(cd->held);
+	}
+}
+
+static void budget_screen(rfbScreenInfoPtr scr,
+			  void (*fn)(rfbClientPtr, struct client_data *, double), double t)
+{
+	rfbClientIteratorPtr it;
+	rfbClientPtr cl;
+
+	it = rfbGetClientIterator(scr);
+	while ((cl = rfbClientIteratorNext(it)) != NULL)
+		if (cl->clientData != NULL && cl->state == RFB_NORMAL)
+			fn(cl, cl->clientData, t);
+	rfbReleaseClientIterator(it);
+}
+
+static void budget_each(void (*fn)(rfbClientPtr, struct client_data *, double), double t)
+{
+	struct head *h;
+	int i;
+
+	for (h = heads; h != NULL; h = h->next) {
+		if (h->vncscr == NULL)
+			continue;
+		budget_screen(h->vncscr, fn, t);
+		for (i = 0; i < h->nscaled; i++)
+			if (h->scaled[i].scr != NULL)
+				budget_screen(h->scaled[i].scr, fn, t);
+	}
+}
+
+/* Before libvncserver gets to send updates: refill the credits, hold the
+ * requests of viewers in debt and pass on those that paid it off. Once
+ * the budget is turned off everything held is let go. */
+static void budget_schedule(void)
+{
+	double t = now_seconds();
+
+	if (encode_budget <= 0 && !budget_on)
+		return;
+	budget_on = encode_budget > 0;
+
+	budget_weights = 0;
+	budget_each(budget_count, t);
+	budget_each(budget_refill, t);
+}
+
+/*****************************************************************************/
+
+/* Local shared-memory transport, see fbvncshm.h. With -u vncbuf lives in
+ * a memfd that local consumers map read-only, so after the hello they are
+ * only told which rects changed and no encoding is done for them. */
+
+#ifndef F_SEAL_FUTURE_WRITE
+#define F_SEAL_FUTURE_WRITE 0x0010
+#endif
+
+static void *shadow_alloc(struct head *h, size_t size)
+{
+	void *p;
+
+	if (h->shm_path == NULL) {
+		/* Pages of its own, see the direct Raw path */
+		p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (p == MAP_FAILED)
+			return NULL;
+		h->vncbuf_size = size;
+		return p;
+	}
+
+	if ((h->shm_memfd = memfd_create("fbvncserver", MFD_CLOEXEC | MFD_ALLOW_SEALING)) < 0 ||
+	    ftruncate(h->shm_memfd, size) < 0) {
+		fprintf(stderr, "cannot create shared framebuffer, %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	fcntl(h->shm_memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW);
+
+	p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, h->shm_memfd, 0);
+	if (p == MAP_FAILED) {
+		fprintf(stderr, "mmap failed\n");
+		exit(EXIT_FAILURE);
+	}
+	h->shm_size = size;
+
+	/* Only the mapping above may write, consumers reopening the memfd
+	 * through /proc cannot map it writable either */
+	if (fcntl(h->shm_memfd, F_ADD_SEALS, F_SEAL_FUTURE_WRITE | F_SEAL_SEAL) < 0)
+		fprintf(stderr, "cannot seal shared framebuffer, %s\n", strerror(errno));
+
+	return p;
+}
+
+static void shadow_free(struct head *h, void *p)
+{
+	if (h->shm_path == NULL) {
+		munmap(p, h->vncbuf_size);
+		return;
+	}
+	munmap(p, h->shm_size);
+	close(h->shm_memfd);
+	h->shm_memfd = -1;
+}
+
+static void shm_fill_header(struct head *h, struct fbvnc_shm_header *hdr, int type)
+{
+	hdr->magic = FBVNC_SHM_MAGIC;
+	hdr->version = FBVNC_SHM_VERSION;
+	hdr->type = type;
+	hdr->seq = h->shm_seq;
+}
+
+static int shm_send_hello(struct head *h, int fd)
+{
+	struct fbvnc_shm_hello hello;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cm;
+	char control[CMSG_SPACE(sizeof(int))];
+	char path[64];
+	int rofd, ret;
+
+	/* Reopening through /proc gives a descriptor that cannot be
+	 * mapped writable */
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", h->shm_memfd);
+	if ((rofd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+		return -1;
+
+	memset(&hello, 0, sizeof(hello));
+	shm_fill_header(h, &hello.hdr, FBVNC_SHM_HELLO);
+	hello.width = h->vncscr->width;
+	hello.height = h->vncscr->height;
+	hello.stride = h->vncscr->paddedWidthInBytes;
+	hello.size = h->shm_size;
+	hello.bits_per_pixel = h->vncscr->serverFormat.bitsPerPixel;
+	hello.depth = h->vncscr->serverFormat.depth;
+	hello.true_colour = h->vncscr->serverFormat.trueColour;
+	hello.red_max = h->vncscr->serverFormat.redMax;
+	hello.green_max = h->vncscr->serverFormat.greenMax;
+	hello.blue_max = h->vncscr->serverFormat.blueMax;
+	hello.red_shift = h->vncscr->serverFormat.redShift;
+	hello.green_shift = h->vncscr->serverFormat.greenShift;
+	hello.blue_shift = h->vncscr->serverFormat.blueShift;
+
+	iov.iov_base = &hello;
+	iov.iov_len = sizeof(hello);
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	cm = CMSG_FIRSTHDR(&msg);
+	cm->cmsg_level = SOL_SOCKET;
+	cm->cmsg_type = SCM_RIGHTS;
+	cm->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cm), &rofd, sizeof(int));
+
+	ret = sendmsg(fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+	close(rofd);
+
+	return ret < 0 ? -1 : 0;
+}
+
+static int shm_send_damage(int fd, struct fbvnc_shm_damage *dmg)
+{
+	size_t len;
+
+	len = offsetof(struct fbvnc_shm_damage, rects) +
+	    dmg->nrects * sizeof(struct fbvnc_shm_rect);
+
+	if (send(fd, dmg, len, MSG_NOSIGNAL | MSG_DONTWAIT) < 0)
+		return errno == EAGAIN ? 1 : -1;
+	return 0;
+}
+
+static int shm_send_full(struct head *h, int fd)
+{
+	struct fbvnc_shm_damage full;
+
+	shm_fill_header(h, &full.hdr, FBVNC_SHM_DAMAGE);
+	full.nrects = 1;
+	full.rects[0].x = 0;
+	full.rects[0].y = 0;
+	full.rects[0].w = h->vncscr->width;
+	full.rects[0].h = h->vncscr->height;
+
+	return shm_send_damage(fd, &full);
+}
+
+static void shm_drop(struct head *h, int i)
+{
+	close(h->shm_clients[i].fd);
+	h->shm_clients[i] = h->shm_clients[--h->shm_nclients];
+}
+
+static int shm_init(struct head *h)
+{
+	struct sockaddr_un addr;
+	mode_t mask;
+	int ret;
+
+	if (h->shm_path == NULL)
+		return 0;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, h->shm_path, sizeof(addr.sun_path) - 1);
+	unlink(h->shm_path);
+
+	if ((h->shm_listenfd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
+		fprintf(stderr, "cannot listen on %s, %s\n", h->shm_path, strerror(errno));
+		return -1;
+	}
+
+	/* The socket is created 0600, nobody else gets to connect first */
+	mask = umask(0177);
+	ret = bind(h->shm_listenfd, (struct sockaddr *)&addr, sizeof(addr));
+	umask(mask);
+	if (ret < 0 || listen(h->shm_listenfd, SHM_MAX_CLIENTS) < 0) {
+		fprintf(stderr, "cannot listen on %s, %s\n", h->shm_path, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+static void shm_cleanup(struct head *h)
+{
+	while (h->shm_nclients > 0)
+		shm_drop(h, 0);
+	if (h->shm_listenfd != -1) {
+		close(h->shm_listenfd);
+		unlink(h->shm_path);
+	}
+}
+
+static void shm_accept(struct head *h)
+{
+	int fd;
+
+	if (h->shm_listenfd < 0)
+		return;
+
+	while ((fd = accept4(h->shm_listenfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+		if (h->shm_nclients == SHM_MAX_CLIENTS ||
+		    shm_send_hello(h, fd) < 0 || shm_send_full(h, fd) < 0) {
+			close(fd);
+			continue;
+		}
+		h->shm_clients[h->shm_nclients].fd = fd;
+		h->shm_clients[h->shm_nclients].resync = 0;
+		h->shm_nclients++;
+	}
+}
+
+/* The shared buffer was replaced after a resolution change */
+static void shm_rehello(struct head *h)
+{
+	int i;
+
+	for (i = 0; i < h->shm_nclients; i++) {
+		if (shm_send_hello(h, h->shm_clients[i].fd) < 0)
+			shm_drop(h, i--);
+		else
+			h->shm_clients[i].resync = 1;
+	}
+}
+
+static void shm_add_rect(struct head *h, int x1, int y1, int x2, int y2)
+{
+	struct fbvnc_shm_rect *r;
+
+	if (h->shm_nclients == 0 || h->shm_damage.nrects > FBVNC_SHM_MAX_RECTS)
+		return;
+
+	/* Too many rects, the publish will tell everybody to resync */
+	if (h->shm_damage.nrects == FBVNC_SHM_MAX_RECTS) {
+		h->shm_damage.nrects++;
+		return;
+	}
+
+	r = &h->shm_damage.rects[h->shm_damage.nrects++];
+	r->x = x1;
+	r->y = y1;
+	r->w = x2 - x1;
+	r->h = y2 - y1;
+}
+
+static void shm_publish(struct head *h)
+{
+	int i, ret, overflow;
+
+	if (h->shm_nclients == 0 || h->shm_damage.nrects == 0)
+		return;
+
+	h->shm_seq++;
+	shm_fill_header(h, &h->shm_damage.hdr, FBVNC_SHM_DAMAGE);
+	overflow = h->shm_damage.nrects > FBVNC_SHM_MAX_RECTS;
+
+	for (i = 0; i < h->shm_nclients; i++) {
+		if (overflow || h->shm_clients[i].resync)
+			ret = shm_send_full(h, h->shm_clients[i].fd);
+		else
+			ret = shm_send_damage(h->shm_clients[i].fd, &h->shm_damage);
+
+		if (ret < 0)
+			shm_drop(h, i--);
+		else
+			h->shm_clients[i].resync = ret;
+	}
+	h->shm_damage.nrects = 0;
+}
+
+/*****************************************************************************/
+
+/* Hot upgrade. On SIGUSR2 a new fbvncserver is exec'd and handed, over a
+ * unix socket, the listening sockets, the established client sockets with
+ * their RFB state and the shadow buffers. Since both buffers match what
+ * the viewers last received, the new process carries on with incremental
+ * updates and nobody reconnects. Only clients using a stateless encoding
+ * are handed off, a zlib stream cannot be resumed; the others, and all
+ * shared-memory consumers, are dropped and reconnect. */
+
+#define UPGRADE_MAX_RECTS 16
+#define UPGRADE_MAGIC 0x75627666	/* "fvbu" */
+#define UPGRADE_VERSION 2
+
+/* First on the socket. The two binaries may differ, the new one only
+ * takes over if the messages that follow have the layout it expects. */
+struct upgrade_hello_msg
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t head_size;
+	uint32_t client_size;
+	uint32_t format_size;
+	uint32_t rect_size;
+};
+
+struct upgrade_head_msg
+{
+	int port;		/* 0 ends the stream */
+	int width, height, bpp;
+	int has_listen6;
+	int has_http;
+	int nclients;
+};
+
+struct upgrade_client_msg
+{
+	rfbPixelFormat format;
+	int encoding;
+	int protocol_minor;
+	int copy_rect, last_rect, cursor_shape, cursor_pos, rich_cursor;
+	int new_fb_size, view_only;
+	int cu_supported, cu_fence, cu_enabled;
+	uint32_t cu_fence_seq;
+	sraRect cu_region;
+	uint32_t zc_pending;	/* completions the new process will reap */
+	int nmodified, nrequested;
+	sraRect modified[UPGRADE_MAX_RECTS];
+	sraRect requested[UPGRADE_MAX_RECTS];
+};
+
+/* What the new process received for one head, until the head is started */
+struct upgrade_state
+{
+	struct upgrade_state *next;
+	struct upgrade_head_msg msg;
+	int listenfd, listen6fd, httpfd;
+	size_t size;
+	void *fbbuf;
+	void *vncbuf;
+	struct upgrade_client_msg *clients;
+	int *clientfds;
+};
+
+static char **upgrade_argv;
+static char upgrade_exe[PATH_MAX];
+static int upgrade_fd = -1;
+static struct upgrade_state *upgrade_states;
+static volatile sig_atomic_t upgrade_set = 0;
+
+static int upgrade_send(int fd, const void *buf, size_t len, int passfd)
+{
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cm;
+	char control[CMSG_SPACE(sizeof(int))];
+	const char *p = buf;
+	ssize_t n;
+
+	while (len > 0) {
+		iov.iov_base = (void *)p;
+		iov.iov_len = len;
+
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+
+		/* The descriptor rides on the first byte of the record */
+		if (passfd >= 0) {
+			msg.msg_control = control;
+			msg.msg_controllen = sizeof(control);
+			cm = CMSG_FIRSTHDR(&msg);
+			cm->cmsg_level = SOL_SOCKET;
+			cm->cmsg_type = SCM_RIGHTS;
+			cm->cmsg_len = CMSG_LEN(sizeof(int));
+			memcpy(CMSG_DATA(cm), &passfd, sizeof(int));
+		}
+
+		if ((n = sendmsg(fd, &msg, MSG_NOSIGNAL)) < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		passfd = -1;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int upgrade_recv(int fd, void *buf, size_t len, int *passfd)
+{
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cm;
+	char control[CMSG_SPACE(sizeof(int))];
+	char *p = buf;
+	ssize_t n;
+
+	if (passfd)
+		*passfd = -1;
+
+	while (len > 0) {
+		iov.iov_base = p;
+		iov.iov_len = len;
+
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+
+		if ((n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC)) <= 0) {
+			if (n < 0 && errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+			if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS) {
+				int rfd;
+
+				memcpy(&rfd, CMSG_DATA(cm), sizeof(int));
+				if (passfd && *passfd < 0)
+					*passfd = rfd;
+				else
+					close(rfd);
+			}
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* Regions are passed as a short rect list, or as their extent */
+static int upgrade_pack_region(sraRegionPtr rgn, sraRect *rects)
+{
+	sraRectangleIterator *it;
+	sraRect r;
+	int n = 0;
+
+	it = sraRgnGetIterator(rgn);
+	while (sraRgnIteratorNext(it, &r)) {
+		if (n < UPGRADE_MAX_RECTS) {
+			rects[n++] = r;
+			continue;
+		}
+		while (--n > 0) {
+			if (rects[n].x1 < rects[0].x1) rects[0].x1 = rects[n].x1;
+			if (rects[n].y1 < rects[0].y1) rects[0].y1 = rects[n].y1;
+			if (rects[n].x2 > rects[0].x2) rects[0].x2 = rects[n].x2;
+			if (rects[n].y2 > rects[0].y2) rects[0].y2 = rects[n].y2;
+		}
+		n = 1;
+		if (r.x1 < rects[0].x1) rects[0].x1 = r.x1;
+		if (r.y1 < rects[0].y1) rects[0].y1 = r.y1;
+		if (r.x2 > rects[0].x2) rects[0].x2 = r.x2;
+		if (r.y2 > rects[0].y2) rects[0].y2 = r.y2;
+	}
+	sraRgnReleaseIterator(it);
+
+	return n;
+}
+
+static void upgrade_unpack_region(sraRegionPtr rgn, sraRect *rects, int n)
+{
+	sraRegionPtr r;
+
+	sraRgnMakeEmpty(rgn);
+	while (n-- > 0) {
+		r = sraRgnCreateRect(rects[n].x1, rects[n].y1, rects[n].x2, rects[n].y2);
+		sraRgnOr(rgn, r);
+		sraRgnDestroy(r);
+	}
+}
+
+static int upgrade_eligible(rfbClientPtr cl)
+{
+	if (cl->state != RFB_NORMAL || cl->sock < 0 || client_websocket(cl))
+		return 0;
+
+	switch (cl->preferredEncoding) {
+	case rfbEncodingRaw:
+	case rfbEncodingRRE:
+	case rfbEncodingCoRRE:
+	case rfbEncodingHextile:
+		return 1;
+	}
+	return 0;
+}
+
+static void upgrade_fill_client(rfbClientPtr cl, struct upgrade_client_msg *m)
+{
+	struct cu_client *cu = rfbGetExtensionClientData(cl, &cu_extension);
+	struct client_data *cd = cl->clientData;
+
+	memset(m, 0, sizeof(*m));
+	m->format = cl->format;
+	m->encoding = cl->preferredEncoding;
+	m->protocol_minor = cl->protocolMinorVersion;
+	m->copy_rect = cl->useCopyRect;
+	m->last_rect = cl->enableLastRectEncoding;
+	m->cursor_shape = cl->enableCursorShapeUpdates;
+	m->cursor_pos = cl->enableCursorPosUpdates;
+	m->rich_cursor = cl->useRichCursorEncoding;
+	m->new_fb_size = cl->useNewFBSize;
+	m->view_only = cl->viewOnly;
+
+	if (cu != NULL) {
+		m->cu_supported = cu->supported;
+		m->cu_fence = cu->fence;
+		m->cu_enabled = cu->enabled;
+		m->cu_fence_seq = cu->fence_seq;
+		if (cu->region)
+			upgrade_pack_region(cu->region, &m->cu_region);
+	}
+
+	if (cd != NULL) {
+		zc_reap(cl, cd);
+		m->zc_pending = cd->zc_issued - cd->zc_done;
+	}
+
+	m->nmodified = upgrade_pack_region(cl->modifiedRegion, m->modified);
+	m->nrequested = upgrade_pack_region(cl->requestedRegion, m->requested);
+}
+
+static void upgrade_fill_hello(struct upgrade_hello_msg *m)
+{
+	memset(m, 0, sizeof(*m));
+	m->magic = UPGRADE_MAGIC;
+	m->version = UPGRADE_VERSION;
+	m->head_size = sizeof(struct upgrade_head_msg);
+	m->client_size = sizeof(struct upgrade_client_msg);
+	m->format_size = sizeof(rfbPixelFormat);
+	m->rect_size = sizeof(sraRect);
+}
+
+static int upgrade_send_state(int fd)
+{
+	struct upgrade_hello_msg hello;
+	struct upgrade_head_msg hm;
+	struct upgrade_client_msg cm;
+	rfbClientIteratorPtr it;
+	rfbClientPtr cl;
+	struct head *h;
+
+	upgrade_fill_hello(&hello);
+	if (upgrade_send(fd, &hello, sizeof(hello), -1) < 0)
+		return -1;
+
+	for (h = heads; h != NULL; h = h->next) {
+		rfbScreenInfoPtr scr = h->vncscr;
+
+		memset(&hm, 0, sizeof(hm));
+		hm.port = h->port;
+		hm.width = h->scrinfo.xres;
+		hm.height = h->scrinfo.yres;
+		hm.bpp = h->scrinfo.bits_per_pixel;
+		hm.has_listen6 = scr->listen6Sock >= 0;
+		hm.has_http = scr->httpListenSock >= 0;
+
+		it = rfbGetClientIterator(scr);
+		while ((cl = rfbClientIteratorNext(it)) != NULL)
+			hm.nclients += upgrade_eligible(cl);
+		rfbReleaseClientIterator(it);
+
+		if (upgrade_send(fd, &hm, sizeof(hm), scr->listenSock) < 0)
+			return -1;
+		if (hm.has_listen6 &&
+		    upgrade_send(fd, &hm.port, sizeof(int), scr->listen6Sock) < 0)
+			return -1;
+		if (hm.has_http &&
+		    upgrade_send(fd, &hm.port, sizeof(int), scr->httpListenSock) < 0)
+			return -1;
+
+		if (upgrade_send(fd, h->fbbuf, hm.width * hm.height * (hm.bpp / 8), -1) < 0 ||
+		    upgrade_send(fd, h->vncbuf, hm.width * hm.height * (hm.bpp / 8), -1) < 0)
+			return -1;
+
+		it = rfbGetClientIterator(scr);
+		while ((cl = rfbClientIteratorNext(it)) != NULL) {
+			if (!upgrade_eligible(cl))
+				continue;
+			upgrade_fill_client(cl, &cm);
+			if (upgrade_send(fd, &cm, sizeof(cm), cl->sock) < 0) {
+				rfbReleaseClientIterator(it);
+				return -1;
+			}
+		}
+		rfbReleaseClientIterator(it);
+	}
+
+	memset(&hm, 0, sizeof(hm));
+	return upgrade_send(fd, &hm, sizeof(hm), -1);
+}
+
+/* Same options as this process, minus those of a previous upgrade */
+static char **upgrade_new_argv(int fd)
+{
+	static char fdarg[16];
+	char **argv;
+	int i, n = 0;
+
+	for (i = 0; upgrade_argv[i] != NULL; i++)
+		;
+	if ((argv = calloc(i + 4, sizeof(char *))) == NULL)
+		return NULL;
+
+	for (i = 0; upgrade_argv[i] != NULL; i++) {
+		if (!strcmp(upgrade_argv[i], "-d"))
+			continue;
+		if (!strcmp(upgrade_argv[i], "-U") && upgrade_argv[i + 1] != NULL) {
+			i++;
+			continue;
+		}
+		argv[n++] = upgrade_argv[i];
+	}
+	snprintf(fdarg, sizeof(fdarg), "%d", fd);
+	argv[n++] = "-d";
+	argv[n++] = "-U";
+	argv[n++] = fdarg;
+	argv[n] = NULL;
+
+	return argv;
+}
+
+static void hot_upgrade(void)
+{
+	struct head *h;
+	char **argv;
+	int sv[2], i;
+	pid_t pid;
+	char ack;
+
+	printf("Upgrading to %s ...\n", upgrade_exe);
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+		fprintf(stderr, "cannot create upgrade socket, %s\n", strerror(errno));
+		return;
+	}
+	if ((argv = upgrade_new_argv(sv[1])) == NULL) {
+		close(sv[0]);
+		close(sv[1]);
+		return;
+	}
+
+	if ((pid = fork()) == 0) {
+		for (i = 3; i < getdtablesize(); i++)
+			if (i != sv[1])
+				close(i);
+		execvp(upgrade_exe, argv);
+		fprintf(stderr, "cannot exec %s, %s\n", upgrade_exe, strerror(errno));
+		_exit(1);
+	}
+	close(sv[1]);
+	free(argv);
+
+	if (pid < 0 || upgrade_send_state(sv[0]) < 0 || read(sv[0], &ack, 1) != 1) {
+		fprintf(stderr, "upgrade failed, keeping the running server\n");
+		if (pid > 0) {
+			kill(pid, SIGKILL);
+			waitpid(pid, NULL, 0);
+		}
+		close(sv[0]);
+		return;
+	}
+
+	/* The new process owns the sockets now. Leave without shutting
+	 * them down, the pid file is already the new one. The new process
+	 * starts its own recordings. */
+	for (h = heads; h != NULL; h = h->next)
+		rec_stop(h);
+	_exit(0);
+}
+
+/* New process: read everything the old one handed over */
+static void upgrade_receive(void)
+{
+	struct upgrade_hello_msg hello, ours;
+	struct upgrade_state *s;
+	int i, dummy;
+
+	/* Without an ack the old process keeps serving */
+	upgrade_fill_hello(&ours);
+	if (upgrade_recv(upgrade_fd, &hello, sizeof(hello), NULL) < 0) {
+		fprintf(stderr, "upgrade handoff broken, %s\n", strerror(errno));
+		exit(1);
+	}
+	if (memcmp(&hello, &ours, sizeof(hello))) {
+		fprintf(stderr, "upgrade handoff from an incompatible fbvncserver (version %u), refused\n",
+		  hello.magic == UPGRADE_MAGIC ? hello.version : 0);
+		exit(1);
+	}
+
+	for (;;) {
+		s = calloc(1, sizeof(struct upgrade_state));
+		assert(s != NULL);
+		s->listenfd = s->listen6fd = s->httpfd = -1;
+
+		if (upgrade_recv(upgrade_fd, &s->msg, sizeof(s->msg), &s->listenfd) < 0)
+			goto broken;
+		if (s->msg.port == 0) {
+			free(s);
+			return;
+		}
+		if (s->msg.has_listen6 &&
+		    upgrade_recv(upgrade_fd, &dummy, sizeof(int), &s->listen6fd) < 0)
+			goto broken;
+		if (s->msg.has_http &&
+		    upgrade_recv(upgrade_fd, &dummy, sizeof(int), &s->httpfd) < 0)
+			goto broken;
+
+		s->size = s->msg.width * s->msg.height * (s->msg.bpp / 8);
+		s->fbbuf = malloc(s->size);
+		s->vncbuf = malloc(s->size);
+		s->clients = calloc(s->msg.nclients + 1, sizeof(struct upgrade_client_msg));
+		s->clientfds = calloc(s->msg.nclients + 1, sizeof(int));
+		assert(s->fbbuf && s->vncbuf && s->clients && s->clientfds);
+
+		if (upgrade_recv(upgrade_fd, s->fbbuf, s->size, NULL) < 0 ||
+		    upgrade_recv(upgrade_fd, s->vncbuf, s->size, NULL) < 0)
+			goto broken;
+
+		for (i = 0; i < s->msg.nclients; i++) {
+			if (upgrade_recv(upgrade_fd, &s->clients[i], sizeof(struct upgrade_client_msg),
+			    &s->clientfds[i]) < 0)
+				goto broken;
+		}
+
+		s->next = upgrade_states;
+		upgrade_states = s;
+	}
+
+broken:
+	fprintf(stderr, "upgrade handoff broken, %s\n", strerror(errno));
+	exit(1);
+}
+
+static struct upgrade_state *upgrade_find(struct head *h)
+{
+	struct upgrade_state *s;
+
+	for (s = upgrade_states; s != NULL; s = s->next)
+		if (s->msg.port == h->port)
+			return s;
+	return NULL;
+}
+
+/* Called before rfbInitServer(), so libvncserver does not bind again */
+static void upgrade_take_sockets(struct head *h)
+{
+	struct upgrade_state *s = upgrade_find(h);
+	rfbScreenInfoPtr scr = h->vncscr;
+
+	if (s == NULL || s->listenfd < 0)
+		return;
+
+	scr->socketState = RFB_SOCKET_READY;
+	scr->listenSock = s->listenfd;
+	FD_SET(scr->listenSock, &scr->allFds);
+	scr->maxFd = scr->listenSock;
+	s->listenfd = -1;
+
+	if (s->listen6fd >= 0) {
+		scr->listen6Sock = s->listen6fd;
+		FD_SET(scr->listen6Sock, &scr->allFds);
+		if (scr->listen6Sock > scr->maxFd)
+			scr->maxFd = scr->listen6Sock;
+		s->listen6fd = -1;
+	}
+
+	if (s->httpfd >= 0) {
+		scr->httpInitDone = TRUE;
+		scr->httpListenSock = s->httpfd;
+		s->httpfd = -1;
+	}
+}
+
+static void upgrade_adopt_client(struct head *h, struct upgrade_client_msg *m, int fd)
+{
+	rfbScreenInfoPtr scr = h->vncscr;
+	struct client_data *cd;
+	struct cu_client *cu;
+	struct sockaddr_storage addr;
+	socklen_t addrlen = sizeof(addr);
+	char host[NI_MAXHOST];
+	rfbClientPtr cl;
+	int sv[2], one = 1;
+
+	/* rfbNewClient() greets the viewer with the protocol version, so
+	 * the client is created on a throwaway socket and moved over */
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+		close(fd);
+		return;
+	}
+	cl = rfbNewClient(scr, sv[0]);
+	close(sv[1]);
+	if (cl == NULL) {
+		close(fd);
+		return;
+	}
+
+	FD_CLR(cl->sock, &scr->allFds);
+	close(cl->sock);
+	cl->sock = fd;
+	FD_SET(fd, &scr->allFds);
+	if (fd > scr->maxFd)
+		scr->maxFd = fd;
+
+	if (getpeername(fd, (struct sockaddr *)&addr, &addrlen) == 0 &&
+	    getnameinfo((struct sockaddr *)&addr, addrlen, host, sizeof(host),
+			NULL, 0, NI_NUMERICHOST) == 0) {
+		free(cl->host);
+		cl->host = strdup(host);
+	}
+
+	cd = cl->clientData;
+	if (cd != NULL && zc_threshold > 0 &&
+	    setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0)
+		cd->zc_enabled = 1;
+	/* The old process's sends complete on this socket's error queue */
+	if (cd != NULL)
+		cd->zc_issued = m->zc_pending;
+
+	cl->state = RFB_NORMAL;
+	cl->protocolMajorVersion = 3;
+	cl->protocolMinorVersion = m->protocol_minor;
+	cl->readyForSetColourMapEntries = TRUE;
+	cl->format = m->format;
+	rfbSetTranslateFunction(cl);
+
+	cl->preferredEncoding = m->encoding;
+	cl->useCopyRect = m->copy_rect;
+	cl->enableLastRectEncoding = m->last_rect;
+	cl->enableCursorShapeUpdates = m->cursor_shape;
+	cl->enableCursorPosUpdates = m->cursor_pos;
+	cl->useRichCursorEncoding = m->rich_cursor;
+	cl->useNewFBSize = m->new_fb_size;
+	cl->viewOnly = m->view_only;
+
+	/* The viewer already has the screen, only what was pending */
+	upgrade_unpack_region(cl->modifiedRegion, m->modified, m->nmodified);
+	upgrade_unpack_region(cl->requestedRegion, m->requested, m->nrequested);
+
+	if (m->cu_supported && (cu = calloc(1, sizeof(struct cu_client))) != NULL) {
+		cu->supported = 1;
+		cu->fence = m->cu_fence;
+		cu->enabled = m->cu_enabled;
+		cu->fence_seq = m->cu_fence_seq;
+		if (cu->enabled)
+			cu->region = sraRgnCreateRect(m->cu_region.x1, m->cu_region.y1,
+						      m->cu_region.x2, m->cu_region.y2);
+		rfbEnableExtension(cl, &cu_extension, cu);
+	}
+
+	printf("Resumed client %s on port %d\n", cl->host, h->port);
+}
+
+/* Called once the head's server is up */
+static void upgrade_adopt(struct head *h)
+{
+	struct upgrade_state *s = upgrade_find(h);
+	int i;
+
+	if (s == NULL)
+		return;
+
+	if (s->msg.width != h->scrinfo.xres || s->msg.height != h->scrinfo.yres ||
+	    s->msg.bpp != h->scrinfo.bits_per_pixel) {
+		/* The screen changed meanwhile, the viewers reconnect */
+		for (i = 0; i < s->msg.nclients; i++)
+			close(s->clientfds[i]);
+		s->msg.nclients = 0;
+		return;
+	}
+
+	memcpy(h->fbbuf, s->fbbuf, s->size);
+	memcpy(h->vncbuf, s->vncbuf, s->size);
+
+	for (i = 0; i < s->msg.nclients; i++)
+		if (s->clientfds[i] >= 0)
+			upgrade_adopt_client(h, &s->clients[i], s->clientfds[i]);
+	s->msg.nclients = 0;
+}
+
+/* All heads are up: drop what no head claimed and let the old process go */
+static void upgrade_finish(void)
+{
+	struct upgrade_state *s;
+	int i;
+
+	while ((s = upgrade_states) != NULL) {
+		upgrade_states = s->next;
+		if (s->listenfd >= 0)
+			close(s->listenfd);
+		if (s->listen6fd >= 0)
+			close(s->listen6fd);
+		if (s->httpfd >= 0)
+			close(s->httpfd);
+		for (i = 0; i < s->msg.nclients; i++)
+			close(s->clientfds[i]);
+		free(s->fbbuf);
+		free(s->vncbuf);
+		free(s->clients);
+		free(s->clientfds);
+		free(s);
+	}
+
+	if (write(upgrade_fd, "", 1) != 1)
+		fprintf(stderr, "cannot release the old server, %s\n", strerror(errno));
+	close(upgrade_fd);
+	upgrade_fd = -1;
+}
+
+/*****************************************************************************/
+
+/* 8 bpp framebuffers are pseudocolour, each pixel indexes a palette of
+ * 256 entries. The screen is served as it is, one byte per pixel, with
+ * the palette as RFB colour map: viewers that take a colour map get it
+ * with SetColourMapEntries, for true colour viewers libvncserver expands
+ * the pixels through a lookup table it builds from the map. The palette
+ * is read with FBIOGETCMAP every frame, memory sources use a fixed 3-3-2
+ * palette. */
+
+#define CMAP_SIZE 256
+
+/* Returns 1 if the palette changed since the last call */
+static int cmap_read(struct head *h)
+{
+	uint16_t red[CMAP_SIZE], green[CMAP_SIZE], blue[CMAP_SIZE];
+	uint16_t map[CMAP_SIZE * 3];
+	struct fb_cmap cmap;
+	int i;
+
+	memset(&cmap, 0, sizeof(cmap));
+	cmap.len = CMAP_SIZE;
+	cmap.red = red;
+	cmap.green = green;
+	cmap.blue = blue;
+	if (h->fb_source == FB_SRC_DEVICE && ioctl(h->fbfd, FBIOGETCMAP, &cmap) == 0) {
+		for (i = 0; i < CMAP_SIZE; i++) {
+			map[i * 3] = red[i];
+			map[i * 3 + 1] = green[i];
+			map[i * 3 + 2] = blue[i];
+		}
+	}
+	else if (!h->cmap.loaded) {
+		for (i = 0; i < CMAP_SIZE; i++) {
+			map[i * 3] = (i >> 5) * 65535 / 7;
+			map[i * 3 + 1] = ((i >> 2) & 7) * 65535 / 7;
+			map[i * 3 + 2] = (i & 3) * 65535 / 3;
+		}
+	}
+	else
+		return 0;
+
+	if (h->cmap.loaded && memcmp(map, h->cmap.map, sizeof(map)) == 0)
+		return 0;
+	memcpy(h->cmap.map, map, sizeof(map));
+	for (i = 0; i < CMAP_SIZE * 3; i++)
+		h->cmap.rgb[i / 3][i % 3] = map[i] >> 8;
+	h->cmap.loaded = 1;
+	return 1;
+}
+
+/* Serves scr with the palette. rfbGetScreen() and rfbNewFramebuffer()
+ * leave it true colour, so this follows each of them. */
+static void cmap_attach(struct head *h, rfbScreenInfoPtr scr)
+{
+	rfbClientIteratorPtr it;
+	rfbClientPtr cl;
+
+	/* rfbScreenCleanup() frees it */
+	if (scr->colourMap.data.shorts == NULL) {
+		scr->colourMap.data.shorts = malloc(sizeof(h->cmap.map));
+		assert(scr->colourMap.data.shorts != NULL);
+	}
+	memcpy(scr->colourMap.data.shorts, h->cmap.map, sizeof(h->cmap.map));
+	scr->colourMap.count = CMAP_SIZE;
+	scr->colourMap.is16 = TRUE;
+	scr->serverFormat.trueColour = FALSE;
+
+	/* Viewers of a resized screen still translate from the old format */
+	it = rfbGetClientIterator(scr);
+	while ((cl = rfbClientIteratorNext(it)) != NULL)
+		rfbSetTranslateFunction(cl);
+	rfbReleaseClientIterator(it);
+}
+
+/* Called every frame of an 8 bpp head, passes a new palette on */
+static void cmap_poll(struct head *h)
+{
+	rfbScreenInfoPtr scr;
+	int i;
+
+	if (!cmap_read(h))
+		return;
+
+	/* Sends colour map viewers the entries and redoes the lookup table
+	 * and the whole screen for the others */
+	memcpy(h->vncscr->colourMap.data.shorts, h->cmap.map, sizeof(h->cmap.map));
+	rfbSetClientColourMaps(h->vncscr, 0, CMAP_SIZE);
+	for (i = 0; i < h->nscaled; i++) {
+		if ((scr = h->scaled[i].scr) == NULL)
+			continue;
+		memcpy(scr->colourMap.data.shorts, h->cmap.map, sizeof(h->cmap.map));
+		rfbSetClientColourMaps(scr, 0, CMAP_SIZE);
+	}
+
+	/* The same pixels look different now */
+	if (h->thumb.dirty != NULL)
+		thumb_add(h, 0, 0, h->scrinfo.xres, h->scrinfo.yres);
+	h->thumb.frame_seq++;
+	h->rec.need_keyframe = 1;
+}
+
+/*****************************************************************************/
+
+/* FB to RFB copying */
+static void setup_varblock(struct head *h)
+{
+	int bitsPerSample = h->scrinfo.bits_per_pixel == 16 ? 5 : 8;
+
+	h->varblock.r_offset = h->scrinfo.red.offset + h->scrinfo.red.length - bitsPerSample;
+	h->varblock.g_offset = h->scrinfo.green.offset + h->scrinfo.green.length - bitsPerSample;
+	h->varblock.b_offset = h->scrinfo.blue.offset + h->scrinfo.blue.length - bitsPerSample;
+	h->varblock.rfb_xres = h->scrinfo.yres;
+	h->varblock.rfb_maxy = h->scrinfo.xres - 1;
+}
+
+static int init_fb_server(struct head *h, int argc, char **argv)
+{
+#ifdef DEBUG
+	fprintf(stdout, "Initializing VNC server...\n");
+#endif
+	/* Allocate the VNC server buffer to be managed (not manipulated) by 
+	 * libvncserver. */
+	h->vncbuf = shadow_alloc(h, h->scrinfo.xres * h->scrinfo.yres * (h->scrinfo.bits_per_pixel / 8));
+	assert(h->vncbuf != NULL);
+
+	/* Allocate the comparison buffer for detecting drawing updates from frame
+	 * to frame. */
+	h->fbbuf = calloc(h->scrinfo.xres * h->scrinfo.yres, h->scrinfo.bits_per_pixel / 8);
+	assert(h->fbbuf != NULL);
+
+	if (h->scrinfo.bits_per_pixel == 8) {
+		h->vncscr = rfbGetScreen(&argc, argv, h->scrinfo.xres, h->scrinfo.yres, 8, 1, 1);
+		if (h->vncscr != NULL) {
+			cmap_read(h);
+			cmap_attach(h, h->vncscr);
+		}
+	}
+	else if (h->scrinfo.bits_per_pixel == 16) {
+        	h->vncscr = rfbGetScreen(&argc, argv, h->scrinfo.xres, h->scrinfo.yres, 5, 2, (h->scrinfo.bits_per_pixel / 8));
+	}
+	else if (h->scrinfo.bits_per_pixel == 24) { 
+		h->vncscr = rfbGetScreen(&argc, argv, h->scrinfo.xres, h->scrinfo.yres, 8, 3, 4);
+	    	h->vncscr->serverFormat.bitsPerPixel = 32;
+   		h->vncscr->serverFormat.depth = 24;
+	}
+	else if (h->scrinfo.bits_per_pixel == 32) { 
+		h->vncscr = rfbGetScreen(&argc, argv, h->scrinfo.xres, h->scrinfo.yres, 8, 3, 4);
+	    	h->vncscr->serverFormat.bitsPerPixel = 32;
+   		h->vncscr->serverFormat.depth = 32;
+	}
+	if (h->vncscr == NULL) {
+		fprintf(stderr, "unsupported depth %d\n", h->scrinfo.bits_per_pixel);
+		return -1;
+	}
+
+	h->vncscr->screenData = h;
+	h->vncscr->desktopName = "Vircon Screen";
+	h->vncscr->frameBuffer = (char *)h->vncbuf;
+	h->vncscr->alwaysShared = FALSE;
+	if (webmode == 1) 
+		h->vncscr->httpDir = "/.vnc-webclient";
+	if (h->vncscr->httpPort == 0) 
+		h->vncscr->httpPort = HTTP_PORT + h->port - VNC_PORT;
+	if (h->vncscr->port == 0)
+		h->vncscr->port = h->port;
+        if (authmode == 1)
+		h->vncscr->authPasswdData=AUTHFILE;
+
+	h->vncscr->listenInterface = vncaddr;
+
+	/* Browser viewers such as noVNC connect with a WebSocket upgrade on
+	 * the VNC port itself, libvncserver does the framing. */
+#ifdef LIBVNCSERVER_WITH_WEBSOCKETS
+	h->vncscr->sslcertfile = ws_certfile;
+	h->vncscr->sslkeyfile = ws_keyfile;
+	if (webmode == 1)
+		printf("	web:    http://<host>:%d/vnc.html?port=%d\n",
+		  h->vncscr->httpPort, h->vncscr->port);
+#else
+	if (webmode == 1 || ws_certfile)
+		fprintf(stderr, "libvncserver was built without WebSocket support, "
+		  "browser viewers need a websockify proxy\n");
+#endif
+
+#ifdef DEBUG
+	fprintf(stdout, "	red.offset: %d\n", (int)h->scrinfo.red.offset);
+	fprintf(stdout, "	red.length: %d\n", (int)h->scrinfo.red.length);
+	fprintf(stdout, "	green.offset: %d\n", (int)h->scrinfo.green.offset);
+	fprintf(stdout, "	green.length: %d\n", (int)h->scrinfo.green.length);
+	fprintf(stdout, "	blue.offset: %d\n", (int)h->scrinfo.blue.offset);
+	fprintf(stdout, "	blue.length: %d\n", (int)h->scrinfo.blue.length);
+
+	fprintf(stdout, "	vncscr->serverFormat.redMax: %d\n", (int)h->vncscr->serverFormat.redMax);
+	fprintf(stdout, "	vncscr->serverFormat.greenMax: %d\n", (int)h->vncscr->serverFormat.greenMax);
+	fprintf(stdout, "	vncscr->serverFormat.blueMax: %d\n", (int)h->vncscr->serverFormat.blueMax);
+	fprintf(stdout, "	vncscr->serverFormat.redShift: %d\n", (int)h->vncscr->serverFormat.redShift);
+	fprintf(stdout, "	vncscr->serverFormat.greenShift: %d\n", (int)h->vncscr->serverFormat.greenShift);
+	fprintf(stdout, "	vncscr->serverFormat.blueShift: %d\n", (int)h->vncscr->serverFormat.blueShift);
+#endif
+	h->vncscr->kbdAddEvent = keyevent;
+	h->vncscr->ptrAddEvent = ptrevent;
+	h->vncscr->displayHook = display_start;
+	h->vncscr->displayFinishedHook = display_finished;
+	h->vncscr->newClientHook = client_new;
+
+	upgrade_take_sockets(h);
+	rfbInitServer(h->vncscr);
+
+	if (h->vncscr->listenSock==-1) {
+        	fprintf(stderr, "cannot start server.\n");
+        	return -1;
+	}
+
+	if (shm_init(h) < 0)
+		return -1;
+
+	/* Mark as dirty since we haven't sent any updates at all yet. */
+	rfbMarkRectAsModified(h->vncscr, 0, 0, h->scrinfo.xres, h->scrinfo.yres);
+
+	setup_varblock(h);
+	scan_calibrate(h);
+	heat_setup(h);
+	thumb_setup(h);
+	scaled_setup(h);
+	rec_start(h);
+	upgrade_adopt(h);
+	return 0;
+}
+
+static void changeResolution(struct head *h)
+{
+	size_t pixels;
+	size_t bytespp;
+
+#ifdef DEBUG
+	fprintf(stdout, "Changing resolution.\n");
+#endif
+	DTRACE_PROBE1(fbvncserver, resize_start, h->port);
+	h->metrics.resolution_changes++;
+	/* Clean up the old mapping and buffers*/
+	shadow_free(h, h->vncbuf);
+	free(h->fbbuf);
+
+	/* Already gone if the fb is being re-attached */
+	if (h->fbmmap != MAP_FAILED)
+		munmap(h->fbmmap, h->fbmmap_size);
+	
+	/* Get the new screen layout information */
+	if (ioctl(h->fbfd, FBIOGET_VSCREENINFO, &h->scrinfo) != 0) {
+		printf("ioctl error\n");
+		exit(EXIT_FAILURE);
+	}
+
+	pixels = h->scrinfo.xres * h->scrinfo.yres;
+	bytespp = h->scrinfo.bits_per_pixel / 8;
+
+#ifdef DEBUG
+	printf("Mapping new fb.\n");
+	fprintf(stdout, "xres=%d, yres=%d, xresv=%d, yresv=%d, xoffs=%d, yoffs=%d, bpp=%d\n", 
+	  (int)h->scrinfo.xres, (int)h->scrinfo.yres,
+	  (int)h->scrinfo.xres_virtual, (int)h->scrinfo.yres_virtual,
+	  (int)h->scrinfo.xoffset, (int)h->scrinfo.yoffset,
+	  (int)h->scrinfo.bits_per_pixel);
+#endif
+	/* Map the new framebuffer into memory */
+	
+	h->fbmmap_size = pixels * bytespp;
+	h->fbmmap = mmap(NULL, h->fbmmap_size, PROT_READ, MAP_SHARED, h->fbfd, 0);
+
+	if (h->fbmmap == MAP_FAILED) {
+		fprintf(stderr, "mmap failed\n");
+		exit(EXIT_FAILURE);
+	}
+	dirty_setup(h);
+
+	/* Allocate the VNC server buffer to be managed (not manipulated) by 
+	 * libvncserver. */
+	h->vncbuf = shadow_alloc(h, h->scrinfo.xres * h->scrinfo.yres * (h->scrinfo.bits_per_pixel / 8));
+	assert(h->vncbuf != NULL);
+
+	/* Allocate the comparison buffer for detecting drawing updates from frame
+	 * to frame. */
+	h->fbbuf = calloc(h->scrinfo.xres * h->scrinfo.yres, h->scrinfo.bits_per_pixel / 8);
+	assert(h->fbbuf != NULL);
+
+	/* Tell libvncserver that the resolution has changed. */
+
+	//rfbNewFramebuffer (rfbScreenInfoPtr rfbScreen, char *framebuffer, int width, int height, int bitsPerSample, int samplesPerPixel, int bytesPerPixel)
+	rfbNewFramebuffer(h->vncscr, (char *)h->vncbuf, h->scrinfo.xres, h->scrinfo.yres, 5, 2, (h->scrinfo.bits_per_pixel / 8));
+	if (h->scrinfo.bits_per_pixel == 8) {
+		cmap_read(h);
+		cmap_attach(h, h->vncscr);
+	}
+
+	scan_calibrate(h);
+	heat_setup(h);
+	thumb_setup(h);
+	scaled_setup(h);
+	h->rec.need_keyframe = 1;
+	shm_rehello(h);
+	DTRACE_PROBE4(fbvncserver, resize_end, h->port, h->scrinfo.xres, h->scrinfo.yres,
+	  h->scrinfo.bits_per_pixel);
+
+#ifdef DEBUG
+	printf("Change resolution complete.\n");
+#endif
+}
+
+/*****************************************************************************/
+static void injectKeyEvent(struct head *h, uint16_t code, uint16_t value)
+{
+    	struct input_event ev;
+
+	h->metrics.input_events[INPUT_KEY]++;
+	DTRACE_PROBE3(fbvncserver, key, h->port, code, value);
+	if (h->kbdfd < 0)
+		return;
+
+    	memset(&ev, 0, sizeof(ev));
+    	gettimeofday(&ev.time,0);
+    	ev.type = EV_KEY;
+    	ev.code = code;
+    	ev.value = value;
+    	if(write(h->kbdfd, &ev, sizeof(ev)) < 0) {
+        	fprintf(stderr,"write event failed, %s\n", strerror(errno));
+    	}
+
+#ifdef DEBUG
+    	printf("injectKey (%d, %d)\n", code , value);    
+#endif
+    	gettimeofday(&ev.time,0);
+    	ev.type = EV_SYN;
+    	ev.code = 0;
+    	ev.value = 0;
+    	if(write(h->kbdfd, &ev, sizeof(ev)) < 0) {
+       	 	fprintf(stderr,"write event failed, %s\n", strerror(errno));
+    	}
+}
+
+static int keysym2scancode(rfbBool down, rfbKeySym key, rfbClientPtr cl)
+{
+    	int scancode = 0;
+    	int code = (int)key;
+
+    	if (code>='0' && code<='9') {
+        	scancode = (code & 0xF) - 1;
+        	if (scancode<0) scancode += 10;
+        	scancode += KEY_1;
+    	} else if (code>=0xFF50 && code<=0xFF58) {
+        	static const uint16_t map[] =
+             		{  KEY_HOME, KEY_LEFT, KEY_UP, KEY_RIGHT, KEY_DOWN,
+                	   KEY_PAGEUP , KEY_PAGEDOWN , KEY_END, 0 };
+        	scancode = map[code & 0xF];
+    	} else if (code>=0xFFBE && code<=0xFFC9) {
+        	static const uint16_t map[] =
+             		{  KEY_F1, KEY_F2, KEY_F3, KEY_F4,  KEY_F5,  KEY_F6,
+                	   KEY_F7, KEY_F8, KEY_F9, KEY_F10, KEY_F11, KEY_F12 };
+        	scancode = map[code - 0xFFBE];
+    	} else if (code>=0xFFE1 && code<=0xFFEE) {
+        	static const uint16_t map[] =
+             		{ 0,  KEY_LEFTSHIFT, KEY_LEFTSHIFT,
+                	  KEY_LEFTCTRL, KEY_RIGHTCTRL,
+                	  KEY_LEFTSHIFT, KEY_LEFTSHIFT,
+                	  0,0,
+                	  KEY_LEFTALT, KEY_RIGHTALT,
+                	  0, 0, 0, 0 };
+        	scancode = map[code & 0xF];
+    	} else if ((code>='A' && code<='Z') || (code>='a' && code<='z')) {
+        	static const uint16_t map[] = {
+                	KEY_A, KEY_B, KEY_C, KEY_D, KEY_E,
+                	KEY_F, KEY_G, KEY_H, KEY_I, KEY_J,
+                	KEY_K, KEY_L, KEY_M, KEY_N, KEY_O,
+                	KEY_P, KEY_Q, KEY_R, KEY_S, KEY_T,
+                	KEY_U, KEY_V, KEY_W, KEY_X, KEY_Y, KEY_Z };
+        	scancode = map[(code & 0x5F) - 'A'];
+    	} else {
+        	switch (code) 
+		{
+            		case 0xFE03:    scancode = 92;   			break;
+            		case 0xFF08:    scancode = KEY_BACKSPACE;   		break;
+//            case 0xFF63:    scancode = KEY_INSERT;   break;
+            		case 0xFF1B:    scancode = KEY_ESC;        		break;
+            		case 0xFF09:    scancode = KEY_TAB;         		break;
+            		case 0xFF0D:    scancode = KEY_ENTER;       		break;
+            		case 0xFFFF:    scancode = KEY_DELETE;      		break;
+            		case 0xFFC8:    rfbShutdownServer(cl->screen,TRUE);	break; // F11            
+        	}
+        	if (!scancode) {
+	    		int i;
+	    		unsigned short kcode;
+	    		/* Hunt them down */
+	    		for (i=0;i<nr_keys;i++) {
+	        		/* Looking in keytable for normal keys */
 				kcode = get_key_sym(i,0);
 	        		if (kcode == code) {
 		    			scancode = i;
 #ifdef DEBUG
-		    			fprintf(stdout, "Search normal\n");
+		    			fprintf(stdout, "Search normal\n");
+#endif
+		    			break;
+				}
+	        		/* Looking in keytable for keys with shift */
+				kcode = get_key_sym(i,1);
+	        		if (kcode == code) {
+		    			scancode = i;
+#ifdef DEBUG
+		    			fprintf(stdout, "Search shifted\n");
+#endif
+		    			break;
+				}
+	    		}
+		}
+    	}
+
+    	return scancode;
+}
+
+static void keyevent(rfbBool down, rfbKeySym key, rfbClientPtr cl)
+{
+	struct head *h = cl->screen->screenData;
+	int scancode;
+
+#ifdef DEBUG
+	fprintf(stdout, "Got keysym: %04x (state=%d)\n", (unsigned int)key, (int)down);
+#endif
+	rec_key(h, key, down);
+	budget_input(cl);
+
+	if ((scancode = keysym2scancode(down, key, cl))) {
+		if (down)
+			latency_input(h, cl);
+		injectKeyEvent(h, scancode, down);
+	}
+}
+
+
+static void injectMoveEvent(struct head *h, int x, int y)
+{   
+    	struct input_event ev;
+
+	h->metrics.input_events[INPUT_POINTER]++;
+	DTRACE_PROBE3(fbvncserver, move, h->port, x, y);
+	if (h->touchfd < 0)
+		return;
+
+#ifdef DEBUG    
+    	fprintf(stdout, "handleMoveEvent (x=%d, y=%d)\n", x , y);    
+#endif
+
+    	if (h->xmax != 0 && h->ymax != 0) {
+        	x = h->xmin + (x * (h->xmax - h->xmin)) / (h->scrinfo.xres);
+        	y = h->ymin + (y * (h->ymax - h->ymin)) / (h->scrinfo.yres);
+    	}
+    
+    	memset(&ev, 0, sizeof(ev));
+
+    	gettimeofday(&ev.time,0);
+    	ev.type = EV_ABS;
+    	ev.code = ABS_X;
+    	ev.value = x;
+    	if(write(h->touchfd, &ev, sizeof(ev)) < 0) {
+        	fprintf(stderr, "write event failed, %s\n", strerror(errno));
+    	}
+
+    	gettimeofday(&ev.time,0);
+    	ev.type = EV_ABS;
+    	ev.code = ABS_Y;
+    	ev.value = y;
+    	if(write(h->touchfd, &ev, sizeof(ev)) < 0) {
+        	fprintf(stderr, "write event failed, %s\n", strerror(errno));
+    	}
+
+    	gettimeofday(&ev.time,0);
+    	ev.type = EV_SYN;
+    	ev.code = 0;
+    	ev.value = 0;
+    	if(write(h->touchfd, &ev, sizeof(ev)) < 0) {
+        	fprintf(stderr, "write event failed, %s\n", strerror(errno));
+    	}
+}
+
+static void injectWheelEvent(struct head *h, int z, int x, int y)
+{
+    	struct input_event ev;
+
+	h->metrics.input_events[INPUT_WHEEL]++;
+	DTRACE_PROBE4(fbvncserver, wheel, h->port, z, x, y);
+	if (h->touchfd < 0)
+		return;
+
+#ifdef DEBUG
+    	printf("handleTouchEvent (x=%d, y=%d, inc=%d)\n", x , y, z);    
+#endif
+
+    	// Move the pointer first 
+    	injectMoveEvent(h, x,y);
+
+    	memset(&ev, 0, sizeof(ev));
+
+    	// Then send a BTN_XXXX
+    	gettimeofday(&ev.time,0);
+    	ev.type = EV_REL;
+    	ev.code = REL_WHEEL;
+    	ev.value = z;
+    	if(write(h->touchfd, &ev, sizeof(ev)) < 0) {
+        	fprintf(stderr, "write event failed, %s\n", strerror(errno));
+    	}
+
+    	gettimeofday(&ev.time,0);
+    	ev.type = EV_SYN;
+    	ev.code = 0;
+    	ev.value = 0;
+    	if(write(h->touchfd, &ev, sizeof(ev)) < 0) {
+        	fprintf(stderr, "write event failed, %s\n", strerror(errno));
+    	}
+
+#ifdef DEBUG
+    	fprintf(stdout, "injectWheelEvent (x=%d, y=%d, inc=%d)\n", x , y, z);    
+#endif
+}
+
+static void injectTouchEvent(struct head *h, int down, int button, int x, int y)
+{
+    	static const uint16_t map[] = { BTN_LEFT, BTN_MIDDLE, BTN_RIGHT, BTN_FORWARD, BTN_BACK};
+    	struct input_event ev;
+
+	h->metrics.input_events[INPUT_TOUCH]++;
+	DTRACE_PROBE5(fbvncserver, touch, h->port, button, down, x, y);
+	if (h->touchfd < 0)
+		return;
+
+#ifdef DEBUG    
+    	fprintf(stdout, "handleTouchEvent (x=%d, y=%d, button=%d, down=%d)\n", x , y, button, down);    
+#endif
+
+    	memset(&ev, 0, sizeof(ev));
+
+    	// Then send a BTN_XXXX
+    	gettimeofday(&ev.time,0);
+   	ev.type = EV_KEY;
+    	ev.code = map[button];
+    	ev.value = down;
+    	if(write(h->touchfd, &ev, sizeof(ev)) < 0) {
+       		fprintf(stderr, "write event failed, %s\n", strerror(errno));
+    	}
+
+    	/* Move event also adds the SYN */
+    	injectMoveEvent(h, x,y);
+
+#ifdef DEBUG
+    	fprintf(stdout, "injectTouchEvent (x=%d, y=%d, down=%d)\n", x , y, down);    
+#endif
+}
+
+static void ptrevent(int buttonMask, int x, int y, rfbClientPtr cl)
+{
+	struct head *h = cl->screen->screenData;
+
+	//printf("Got ptrevent: %04x (x=%d, y=%d)\n", buttonMask, x, y);
+	rec_pointer(h, x, y, buttonMask);
+	budget_input(cl);
+	if (buttonMask != h->prev_buttonMask)
+		latency_input(h, cl);
+
+	if((buttonMask & 1) != 0 && (h->prev_buttonMask & 1) == 0 ) {
+		// Simulate left mouse event as touch event
+		injectTouchEvent(h, 1, 0, x, y);
+                h->prev_buttonMask = buttonMask;
+		return;
+	}
+	else if((h->prev_buttonMask & 1) != 0 && (buttonMask & 1) == 0 ) {
+		// Simulate left mouse event as touch event
+		injectTouchEvent(h, 0, 0, x, y);
+                h->prev_buttonMask = buttonMask;
+		return;
+	}
+	if((buttonMask & 2) != 0 && (h->prev_buttonMask & 2) == 0 ) {
+		// Simulate middle mouse event as touch event
+		injectTouchEvent(h, 1, 1, x, y);
+                h->prev_buttonMask = buttonMask;
+		return;
+	}
+	else if((h->prev_buttonMask & 2) != 0 && (buttonMask & 2) == 0 ) {
+		// Simulate middle mouse event as touch event
+		injectTouchEvent(h, 0, 1, x, y);
+                h->prev_buttonMask = buttonMask;
+		return;
+	}
+	if((buttonMask & 4) != 0 && (h->prev_buttonMask & 4) == 0 ) {
+		// Simulate right mouse event as touch event
+		injectTouchEvent(h, 1, 2, x, y);
+                h->prev_buttonMask = buttonMask;
+		return;
+	}
+	else if((h->prev_buttonMask & 4) != 0 && (buttonMask & 4) == 0 ) {
+		// Simulate right mouse event as touch event
+		injectTouchEvent(h, 0, 2, x, y);
+                h->prev_buttonMask = buttonMask;
+		return;
+	}
+	if((buttonMask & 8) != 0 && (h->prev_buttonMask & 8) == 0 ) {
+		// Simulate right mouse event as touch event
+		//injectTouchEvent(h, 1, 3, x, y);
+		injectWheelEvent(h, 1, x, y);
+                h->prev_buttonMask = buttonMask;
+		return;
+	}
+	else if((h->prev_buttonMask & 8) != 0 && (buttonMask & 8) == 0 ) {
+		// Simulate right mouse event as touch event
+		//injectTouchEvent(h, 0, 3, x, y);
+                h->prev_buttonMask = buttonMask;
+		return;
+	}
+	if((buttonMask & 16) != 0 && (h->prev_buttonMask & 16) == 0 ) {
+		// Simulate right mouse event as touch event
+		//injectTouchEvent(h, 1, 4, x, y);
+		injectWheelEvent(h, -1, x, y);
+                h->prev_buttonMask = buttonMask;
+		return;
+	}
+	else if((h->prev_buttonMask & 16) != 0 && (buttonMask & 16) == 0 ) {
+		// Simulate right mouse event as touch event
+		//injectTouchEvent(h, 0, 4, x, y);
+                h->prev_buttonMask = buttonMask;
+		return;
+	}
+
+	if (mousemode) {
+		// Simulate mouse movement
+     	   	if ( x != h->prev_x || y != h->prev_y ) {
+			injectMoveEvent(h, x,y);
+			h->prev_x = x;
+			h->prev_y = y;
+		}
+	}
+}
+
+static int readScreenInfo_m(struct head *h)
+{
+	if (h->fb_source != FB_SRC_DEVICE)
+		return 0;
+
+	if (ioctl(h->fbfd, FBIOGET_VSCREENINFO, &h->scrinfo_m) != 0) {
+		fprintf(stderr, "ioctl error\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (h->scrinfo.xres != h->scrinfo_m.xres || 
+	    h->scrinfo.yres != h->scrinfo_m.yres ||
+	    h->scrinfo.bits_per_pixel != h->scrinfo_m.bits_per_pixel ) {
+		return 1;
+	}
+
+	return 0;
+}
+
+#define PIXEL_FB_TO_RFB(p,r,g,b) ((p>>r)&0x1f001f)|(((p>>g)&0x1f001f)<<5)|(((p>>b)&0x1f001f)<<10)
+
+static inline unsigned int fb_to_rfb(struct head *h, unsigned int pixel)
+{
+	/* 32 bpp fb layout already matches the server format */
+	if (h->scrinfo.bits_per_pixel == 16)
+		return PIXEL_FB_TO_RFB(pixel,
+		  h->varblock.r_offset, h->varblock.g_offset, h->varblock.b_offset);
+	return pixel;
+}
+
+/*****************************************************************************/
+
+/* Dirty pages. vircon loaded with deferred_io=1 tracks the pages written
+ * to its memory, by mmap users and by the console, see vircon.h. Each
+ * frame then only compares the rows on pages written since the last one.
+ * Other fbs, and memory sources, are compared whole. */
+
+static void dirty_setup(struct head *h)
+{
+	struct vircon_dirty d;
+
+	free(h->dirty.bitmap);
+	free(h->dirty.rows);
+	h->dirty.bitmap = NULL;
+	h->dirty.rows = NULL;
+	h->dirty.scan = NULL;
+	h->dirty.enabled = 0;
+	if (h->damage.fd != -1) {
+		close(h->damage.fd);
+		h->damage.fd = -1;
+	}
+
+	if (h->fb_source != FB_SRC_DEVICE || h->fbfd < 0)
+		return;
+
+	damage_open(h);
+
+	/* Asked with no room, vircon fails with ENOSPC and the page count */
+	memset(&d, 0, sizeof(d));
+	if (ioctl(h->fbfd, FBIO_VIRCON_DIRTY, &d) == 0 || errno != ENOSPC || d.pages == 0) {
+		if (h->damage.fd != -1) {
+			h->dirty.rows = malloc(h->scrinfo.yres);
+			assert(h->dirty.rows != NULL);
+		}
+		return;
+	}
+
+	h->dirty.size = (d.pages + 7) / 8;
+	h->dirty.bitmap = malloc(h->dirty.size);
+	h->dirty.rows = malloc(h->scrinfo.yres);
+	assert(h->dirty.bitmap != NULL && h->dirty.rows != NULL);
+	h->dirty.enabled = 1;
+	h->dirty.full = 1;
+#ifdef DEBUG
+	fprintf(stdout, "Tracking %u dirty pages of %s\n", d.pages, h->fb_device);
+#endif
+}
+
+/* Sets up the rows the next scan compares, returns how many */
+static int dirty_rows(struct head *h)
+{
+	static long pagesize;
+	struct vircon_dirty d;
+	size_t stride = h->scrinfo.xres * (h->scrinfo.bits_per_pixel / 8);
+	uint64_t y0, y1, y;
+	uint32_t p;
+	int n = 0;
+
+	h->dirty.scan = NULL;
+	if (!h->dirty.enabled)
+		return h->scrinfo.yres;
+	if (pagesize == 0)
+		pagesize = sysconf(_SC_PAGESIZE);
+
+	memset(&d, 0, sizeof(d));
+	d.bitmap = (uintptr_t)h->dirty.bitmap;
+	d.size = h->dirty.size;
+	if (ioctl(h->fbfd, FBIO_VIRCON_DIRTY, &d) < 0) {
+		fprintf(stderr, "dirty page query on %s failed, %s\n", h->fb_device, strerror(errno));
+		h->dirty.enabled = 0;
+		return h->scrinfo.yres;
+	}
+
+	/* After a resize or refresh the pages are cleared, all is compared */
+	if (h->dirty.full) {
+		h->dirty.full = 0;
+		return h->scrinfo.yres;
+	}
+
+	memset(h->dirty.rows, 0, h->scrinfo.yres);
+	for (p = 0; p < d.pages; p++) {
+		if (h->dirty.bitmap[p / 8] == 0) {
+			p |= 7;
+			continue;
+		}
+		if (!(h->dirty.bitmap[p / 8] & (1 << (p % 8))))
+			continue;
+
+		y0 = (uint64_t)p * pagesize / stride;
+		y1 = ((uint64_t)(p + 1) * pagesize - 1) / stride;
+		if (y0 >= h->scrinfo.yres)
+			break;
+		if (y1 >= h->scrinfo.yres)
+			y1 = h->scrinfo.yres - 1;
+		for (y = y0; y <= y1; y++) {
+			n += !h->dirty.rows[y];
+			h->dirty.rows[y] = 1;
+		}
+	}
+	h->dirty.scan = h->dirty.rows;
+	return n;
+}
+
+/*****************************************************************************/
+
+/* Damage ring. vircon also queues what the console drew, rect by rect, on
+ * /dev/vircon_damage, see vircon.h. Copies, a scrolling console mostly,
+ * are applied to the shadow buffers and sent on as CopyRect instead of
+ * pixels. The rows of the other records are the ones a frame compares.
+ * The scan still finds the exact changes in them, and compares every row
+ * whenever the ring cannot tell: after an overflow, a mode change, and
+ * on every frame if mmap writes are not reported. */
+
+static void damage_open(struct head *h)
+{
+	struct stat st;
+	char path[128];
+
+	if (fstat(h->fbfd, &st) < 0 || !S_ISCHR(st.st_mode))
+		return;
+
+	/* Only the fb the ring belongs to has it among its devices */
+	snprintf(path, sizeof(path), "/sys/class/graphics/fb%u/device/misc/vircon_damage",
+	  minor(st.st_rdev));
+	if (access(path, F_OK) < 0)
+		return;
+
+	h->damage.fd = open("/dev/vircon_damage", O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	if (h->damage.fd == -1) {
+		fprintf(stderr, "cannot open /dev/vircon_damage, %s\n", strerror(errno));
+		return;
+	}
+	h->damage.complete = 0;
+	printf("Reading the damage ring of %s\n", h->fb_device);
+}
+
+/* Moves a rect of the compare and remote buffers as the console did */
+static void damage_copy(struct head *h, struct vircon_damage *d, int keyframe)
+{
+	int x = d->x, y = d->y, w = d->w, hgt = d->h;
+	int sx = d->sx, sy = d->sy, bpp = h->scrinfo.bits_per_pixel / 8;
+	size_t stride = h->scrinfo.xres * bpp;
+	uint8_t *c = (uint8_t *)h->fbbuf;
+	int i;
+
+	if (x + w > (int)h->scrinfo.xres)
+		w = h->scrinfo.xres - x;
+	if (sx + w > (int)h->scrinfo.xres)
+		w = h->scrinfo.xres - sx;
+	if (y + hgt > (int)h->scrinfo.yres)
+		hgt = h->scrinfo.yres - y;
+	if (sy + hgt > (int)h->scrinfo.yres)
+		hgt = h->scrinfo.yres - sy;
+	if (w <= 0 || hgt <= 0)
+		return;
+
+	/* Rows in the order that keeps an overlapping source intact */
+	if (sy < y) {
+		for (i = hgt - 1; i >= 0; i--)
+			memmove(c + (y + i) * stride + x * bpp, c + (sy + i) * stride + sx * bpp, w * bpp);
+	}
+	else {
+		for (i = 0; i < hgt; i++)
+			memmove(c + (y + i) * stride + x * bpp, c + (sy + i) * stride + sx * bpp, w * bpp);
+	}
+
+	/* Moves the remote buffer and sends the viewers a CopyRect */
+	rfbDoCopyRect(h->vncscr, x, y, x + w, y + hgt, x - sx, y - sy);
+	damage_notify(h, x, y, x + w, y + hgt, keyframe);
+	h->damage.copies++;
+	h->damage.copy_area += (uint64_t)w * hgt;
+}
+
+/* Like dirty_rows(), with the rows of the queued records */
+static int damage_rows(struct head *h, int keyframe)
+{
+	struct vircon_damage buf[256], *d;
+	int all = 0, n = 0;
+	ssize_t len;
+	uint32_t y;
+
+	if (h->damage.fd == -1)
+		return dirty_rows(h);
+
+	memset(h->dirty.rows, 0, h->scrinfo.yres);
+	for (;;) {
+		len = read(h->damage.fd, buf, sizeof(buf));
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len < 0 && errno == EAGAIN)
+			break;
+		if (len <= 0) {
+			fprintf(stderr, "damage ring of %s failed, %s\n", h->fb_device,
+			  len < 0 ? strerror(errno) : "closed");
+			close(h->damage.fd);
+			h->damage.fd = -1;
+			/* The pages were not queried meanwhile */
+			h->dirty.full = 1;
+			return dirty_rows(h);
+		}
+
+		for (d = buf; (char *)d < (char *)buf + len; d++) {
+			switch (d->type) {
+			case VIRCON_DAMAGE_MODE:
+				h->damage.complete = d->flags & VIRCON_DAMAGE_COMPLETE;
+				all = 1;
+				break;
+			case VIRCON_DAMAGE_OVERFLOW:
+				all = 1;
+				break;
+			case VIRCON_DAMAGE_COPY:
+				if (!all)
+					damage_copy(h, d, keyframe);
+				/* fall through, the scan checks the copy */
+			case VIRCON_DAMAGE_RECT:
+				for (y = d->y; y < (uint32_t)d->y + d->h && y < h->scrinfo.yres; y++) {
+					n += !h->dirty.rows[y];
+					h->dirty.rows[y] = 1;
+				}
+				break;
+			}
+		}
+	}
+
+	/* Pages written through mmap are not in the ring */
+	if (!h->damage.complete)
+		return dirty_rows(h);
+
+	if (all || h->dirty.full) {
+		h->dirty.full = 0;
+		return h->scrinfo.yres;
+	}
+	h->dirty.scan = h->dirty.rows;
+	return n;
+}
+
+/*****************************************************************************/
+
+/* The capture scan is split into horizontal bands. On large screens the
+ * bands are compared and converted on a pool of worker threads, and the
+ * damage rects each band found are handed to libvncserver in band order
+ * afterwards, so they still go out as one FramebufferUpdate. The pool
+ * runs the ZRLE encoder's jobs the same way. */
+struct damage_rect
+{
+	int x1, y1, x2, y2;
+};
+
+struct scan_band
+{
+	int y0, y1;
+	int nrects;
+	int maxrects;
+	struct damage_rect *rects;
+	int changed;		/* words found changed */
+};
+
+static pthread_t *scan_workers;
+static int scan_nworkers;
+static int scan_active;		/* of those, taking part in scans */
+static int scan_limit;		/* of those, scanning the current frame */
+static pthread_mutex_t scan_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t scan_start = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t scan_done = PTHREAD_COND_INITIALIZER;
+static unsigned int scan_generation;
+static struct head *scan_head;
+static void (*scan_job)(int job);
+static int scan_njobs;
+static int scan_next_job;
+static int scan_jobs_left;
+
+static void scan_band(struct head *h, struct scan_band *band)
+{
+	const uint8_t *rows = h->dirty.scan;
+	unsigned int *f, *c, *r;
+	int w, y, words, ppw, first, last;
+	int lines_unchanged = 0, changes_pending = 0;
+	struct damage_rect d = { 9999, 9999, -1, -1 };
+
+	/* Compare one 32 bit word at a time, that is 2 pixels at 16 bpp */
+	words = h->scrinfo.xres * (h->scrinfo.bits_per_pixel / 8) / 4;
+	ppw = (32 + h->scrinfo.bits_per_pixel - 1) / h->scrinfo.bits_per_pixel;
+
+	f = (unsigned int *)h->fbmmap + band->y0 * words;  /* -> framebuffer         */
+	c = (unsigned int *)h->fbbuf + band->y0 * words;   /* -> compare framebuffer */
+	r = (unsigned int *)h->vncbuf + band->y0 * words;  /* -> remote framebuffer  */
+
+	band->nrects = 0;
+	band->changed = 0;
+
+	for (y = band->y0; y < band->y1; y++) {
+		first = -1;
+		last = -1;
+
+		/* Rows on pages nobody wrote to are unchanged */
+		for (w = 0; w < words && (rows == NULL || rows[y]); w++) {
+			unsigned int pixel = f[w];
+
+			if (pixel != c[w]) {
+				c[w] = pixel;
+				r[w] = fb_to_rfb(h, pixel);
+
+				if (first < 0)
+					first = w;
+				last = w;
+				band->changed++;
+			}
+		}
+
+		f += words, c += words;
+		r += words;
+
+		if (first >= 0) {
+			first = first * 32 / h->scrinfo.bits_per_pixel;
+			last = last * 32 / h->scrinfo.bits_per_pixel + ppw;
+
+			if (first < d.x1)
+				d.x1 = first;
+			if (last > d.x2)
+				d.x2 = last;
+			if (y < d.y1)
+				d.y1 = y;
+			d.y2 = y + 1;
+
+			changes_pending = 1;
+			lines_unchanged = 0;
+		}
+		else if (changes_pending && ++lines_unchanged > 5) {
+			if (band->nrects < band->maxrects)
+				band->rects[band->nrects++] = d;
+			changes_pending = 0;
+			d.x1 = d.y1 = 9999;
+			d.x2 = d.y2 = -1;
+		}
+	}
+
+	if (changes_pending && band->nrects < band->maxrects)
+		band->rects[band->nrects++] = d;
+}
+
+static void scan_band_job(int b)
+{
+	scan_band(scan_head, &scan_head->bands[b]);
+}
+
+/* Called with scan_lock held, by the main thread as well as the workers */
+static void scan_run_jobs(void)
+{
+	void (*fn)(int job);
+	int j;
+
+	while (scan_next_job < scan_njobs) {
+		j = scan_next_job++;
+		fn = scan_job;
+		pthread_mutex_unlock(&scan_lock);
+		fn(j);
+		pthread_mutex_lock(&scan_lock);
+		if (--scan_jobs_left == 0)
+			pthread_cond_signal(&scan_done);
+	}
+}
+
+/* Runs jobs 0 to njobs - 1 on the main thread and threads - 1 workers */
+static void scan_run(void (*fn)(int job), int njobs, int threads)
+{
+	pthread_mutex_lock(&scan_lock);
+	scan_job = fn;
+	scan_njobs = njobs;
+	scan_limit = threads - 1;
+	scan_next_job = 0;
+	scan_jobs_left = njobs;
+	scan_generation++;
+	pthread_cond_broadcast(&scan_start);
+
+	scan_run_jobs();
+	while (scan_jobs_left > 0)
+		pthread_cond_wait(&scan_done, &scan_lock);
+	pthread_mutex_unlock(&scan_lock);
+}
+
+static void *scan_worker(void *arg)
+{
+	int index = (intptr_t)arg;
+	unsigned int seen = 0;
+
+	pthread_mutex_lock(&scan_lock);
+	for (;;) {
+		while (scan_generation == seen)
+			pthread_cond_wait(&scan_start, &scan_lock);
+		seen = scan_generation;
+		/* Parked by a lower thread count on the control socket, or
+		 * not needed for this head */
+		if (index < scan_limit)
+			scan_run_jobs();
+	}
+	return NULL;
+}
+
+/* Starts workers up to scan_threads. Workers are never stopped, those
+ * beyond a lowered count are parked instead. */
+static void init_scan_workers(void)
+{
+	pthread_t *workers;
+	int i;
+
+	if (scan_threads <= 0)
+		scan_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (scan_threads <= 0)
+		scan_threads = 1;
+
+	/* The main thread scans too */
+	if (scan_threads - 1 > scan_nworkers) {
+		workers = realloc(scan_workers, scan_threads * sizeof(pthread_t));
+		assert(workers != NULL);
+		scan_workers = workers;
+
+		for (i = scan_nworkers; i < scan_threads - 1; i++) {
+			if (pthread_create(&scan_workers[i], NULL, scan_worker, (void *)(intptr_t)i) != 0) {
+				fprintf(stderr, "cannot start scan thread, %s\n", strerror(errno));
+				break;
+			}
+			scan_nworkers++;
+		}
+	}
+
+	pthread_mutex_lock(&scan_lock);
+	scan_active = scan_threads - 1 < scan_nworkers ? scan_threads - 1 : scan_nworkers;
+	pthread_mutex_unlock(&scan_lock);
+}
+
+static void setup_scan_bands(struct head *h)
+{
+	int i, lines, bands = h->scan_bands;
+
+	for (i = 0; i < h->nbands; i++)
+		free(h->bands[i].rects);
+	free(h->bands);
+
+	/* Calibrated or fixed with -S, else from -T and -j */
+	h->nthreads = h->scan_threads;
+	if (h->nthreads == 0) {
+		h->nthreads = h->scrinfo.xres * h->scrinfo.yres < scan_threshold ? 1 : scan_active + 1;
+		bands = scan_bands;
+	}
+	if (h->nthreads > scan_active + 1)
+		h->nthreads = scan_active + 1;
+
+	h->nbands = h->nthreads == 1 ? 1 : h->nthreads * bands;
+	if (h->nbands > h->scrinfo.yres)
+		h->nbands = h->scrinfo.yres;
+
+	h->bands = calloc(h->nbands, sizeof(struct scan_band));
+	assert(h->bands != NULL);
+
+	lines = (h->scrinfo.yres + h->nbands - 1) / h->nbands;
+	for (i = 0; i < h->nbands; i++) {
+		h->bands[i].y0 = i * lines;
+		h->bands[i].y1 = h->bands[i].y0 + lines;
+		if (h->bands[i].y0 > h->scrinfo.yres)
+			h->bands[i].y0 = h->scrinfo.yres;
+		if (h->bands[i].y1 > h->scrinfo.yres)
+			h->bands[i].y1 = h->scrinfo.yres;
+
+		/* A rect is only closed after 6 unchanged lines */
+		h->bands[i].maxrects = (h->bands[i].y1 - h->bands[i].y0) / 6 + 1;
+		h->bands[i].rects = calloc(h->bands[i].maxrects, sizeof(struct damage_rect));
+		assert(h->bands[i].rects != NULL);
+	}
+
+#ifdef DEBUG
+	fprintf(stdout, "Scanning %d bands on %d threads\n", h->nbands, h->nthreads);
+#endif
+}
+
+/* Compare the whole frame, leaving the damage rects in the bands */
+static void scan_frame(struct head *h)
+{
+	int b, i;
+
+	if (h->nbands == 1) {
+		scan_band(h, &h->bands[0]);
+	}
+	else {
+		scan_head = h;
+		scan_run(scan_band_job, h->nbands, h->nthreads);
+	}
+
+	for (b = 0; b < h->nbands; b++)
+		for (i = 0; i < h->bands[b].nrects; i++)
+			if (h->bands[b].rects[i].x2 > h->scrinfo.xres)
+				h->bands[b].rects[i].x2 = h->scrinfo.xres;
+}
+
+/* Scan layout calibration. Which layout scans fastest depends on the
+ * resolution, the depth, the CPU and its caches, so it is measured on the
+ * mapped framebuffer itself, when the server starts and after every
+ * resolution change. Thread counts double up to the pool size, each with
+ * 1 to 8 bands per thread, and a layout scans the frame a few times. The
+ * fastest is kept, if it beats the smaller ones by more than 5 %, and the
+ * times are printed. The frames scanned are
+ * still sent, the screen is marked modified whenever this runs. */
+
+#define CALIBRATE_FRAMES 4
+
+static double scan_time(struct head *h)
+{
+	double t, best = 0;
+	int f;
+
+	setup_scan_bands(h);
+	scan_frame(h);
+	for (f = 0; f < CALIBRATE_FRAMES; f++) {
+		t = now_seconds();
+		scan_frame(h);
+		t = now_seconds() - t;
+		if (f == 0 || t < best)
+			best = t;
+	}
+	return best;
+}
+
+static void scan_calibrate(struct head *h)
+{
+	int threads, bands, best_threads = 1, best_bands = 1;
+	double t, best;
+
+	if (scan_fixed_threads > 0) {
+		h->scan_threads = scan_fixed_threads;
+		h->scan_bands = scan_fixed_bands;
+		setup_scan_bands(h);
+		return;
+	}
+	h->scan_threads = h->scan_bands = 0;
+	if (!scan_calibration || scan_active == 0) {
+		setup_scan_bands(h);
+		return;
+	}
+
+	h->scan_threads = h->scan_bands = 1;
+	best = scan_time(h);
+	printf("Calibrating the scan of %dx%dx%d on port %d:\n	1x1 %.2f ms",
+	  h->scrinfo.xres, h->scrinfo.yres, h->scrinfo.bits_per_pixel, h->port, best * 1000);
+	for (threads = 2; threads <= 2 * (scan_active + 1); threads *= 2) {
+		if (threads > scan_active + 1)
+			threads = scan_active + 1;
+		for (bands = 1; bands <= 8; bands *= 2) {
+			h->scan_threads = threads;
+			h->scan_bands = bands;
+			t = scan_time(h);
+			printf(", %dx%d %.2f ms", threads, bands, t * 1000);
+			/* Within the noise, fewer threads leave more CPU to the
+			 * encoders */
+			if (t < best * 0.95) {
+				best = t;
+				best_threads = threads;
+				best_bands = bands;
+			}
+		}
+		if (threads == scan_active + 1)
+			break;
+	}
+	printf("\n	using %d threads, %d bands each\n", best_threads, best_bands);
+
+	h->scan_threads = best_threads;
+	h->scan_bands = best_bands;
+	setup_scan_bands(h);
+}
+
+/*****************************************************************************/
+
+/* Parallel ZRLE. libvncserver encodes an update on the thread that sends
+ * it, so ZRLE viewers get theirs from here instead, from the display hook.
+ * Every rect is cut into strips of one row of 64x64 tiles. The strips are
+ * translated to the viewer's format, encoded into tiles and deflated on the
+ * scan threads, and go out in order as one FramebufferUpdate. A strip is
+ * raw deflate ending in a sync flush, so the strips join into the one zlib
+ * stream ZRLE keeps per connection, and only the viewer's window spans
+ * them. libvncserver's stream would no longer match what the viewer
+ * decoded, so once a viewer got an update from here it gets all of them
+ * from here. Updates smaller than zrle_threshold pixels are encoded
+ * inline on the main thread. */
+
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+
+#define ZRLE_TILE 64
+#define ZRLE_HASH 512		/* palette lookup, at most 127 colours */
+
+struct zrle_job
+{
+	int x, y, w, h;		/* a strip of one rect */
+	unsigned char *pix;	/* the strip in the viewer's format */
+	size_t pix_size;
+	unsigned char *raw;	/* its tiles */
+	size_t raw_size;
+	unsigned char *out;	/* its tiles deflated */
+	size_t out_size, out_len;
+	int failed;
+};
+
+static struct zrle_job *zrle_jobs;
+static int zrle_njobs;
+
+/* The update the jobs belong to */
+static rfbClientPtr zrle_cl;
+static int zrle_bpp;		/* viewer bytes per pixel */
+static int zrle_cpixel;		/* of those, sent per CPIXEL */
+static int zrle_coff;		/* the first one sent */
+static int zrle_level;
+
+static int zrle_grow(unsigned char **buf, size_t *size, size_t need)
+{
+	unsigned char *p;
+
+	if (need <= *size)
+		return 0;
+	if ((p = realloc(*buf, need)) == NULL)
+		return -1;
+	*buf = p;
+	*size = need;
+	return 0;
+}
+
+static inline unsigned char *zrle_put_pixel(unsigned char *o, uint32_t p)
+{
+	memcpy(o, (unsigned char *)&p + zrle_coff, zrle_cpixel);
+	return o + zrle_cpixel;
+}
+
+static inline unsigned char *zrle_put_run(unsigned char *o, int len)
+{
+	for (len--; len >= 255; len -= 255)
+		*o++ = 255;
+	*o++ = len;
+	return o;
+}
+
+/* Index of p in the palette, added if new. -1 once there are too many. */
+static int zrle_palette(int16_t *hash, uint32_t *pal, int *npal, uint32_t p)
+{
+	unsigned int k = (p * 2654435761u) >> 23;
+
+	for (; hash[k] >= 0; k = (k + 1) & (ZRLE_HASH - 1))
+		if (pal[hash[k]] == p)
+			return hash[k];
+	if (*npal >= 127) {
+		*npal = 128;
+		return -1;
+	}
+	pal[*npal] = p;
+	hash[k] = *npal;
+	return (*npal)++;
+}
+
+/* Encodes one tile the way libvncserver picks its subencoding: solid,
+ * packed palette, palette RLE, plain RLE or raw, whichever is smallest */
+static unsigned char *zrle_tile(unsigned char *o, const unsigned char *pix, int stride, int w, int h)
+{
+	uint32_t t[ZRLE_TILE * ZRLE_TILE], pal[127], p;
+	int16_t hash[ZRLE_HASH];
+	int n = w * h, npal = 0, runs = 0, singles = 0, i, j, x, y, bits = 0, nbits, idx, mode;
+	size_t est, bytes;
+	unsigned char byte;
+
+	/* Whole pixels in memory order, a CPIXEL is some bytes of them */
+	for (y = 0; y < h; y++, pix += stride) {
+		switch (zrle_bpp) {
+		case 4:
+			memcpy(t + y * w, pix, w * 4);
+			break;
+		case 2:
+			for (x = 0; x < w; x++)
+				t[y * w + x] = ((const uint16_t *)pix)[x];
+			break;
+		default:
+			for (x = 0; x < w; x++)
+				t[y * w + x] = pix[x];
+			break;
+		}
+	}
+
+	memset(hash, 0xff, sizeof(hash));
+	for (i = 0; i < n; i = j) {
+		p = t[i];
+		for (j = i + 1; j < n && t[j] == p; j++)
+			;
+		if (j - i == 1)
+			singles++;
+		else
+			runs++;
+		if (npal < 128)
+			zrle_palette(hash, pal, &npal, p);
+	}
+
+	if (npal == 1) {
+		*o++ = 1;
+		return zrle_put_pixel(o, t[0]);
+	}
+
+	mode = 0;
+	est = (size_t)n * zrle_cpixel;
+	bytes = (size_t)(zrle_cpixel + 1) * (runs + singles);
+	if (bytes < est) {
+		mode = 128;
+		est = bytes;
+	}
+	if (npal < 128) {
+		bytes = (size_t)zrle_cpixel * npal + 2 * runs + singles;
+		if (bytes < est) {
+			mode = 128 + npal;
+			est = bytes;
+		}
+		if (npal <= 16) {
+			bits = npal <= 2 ? 1 : npal <= 4 ? 2 : 4;
+			bytes = (size_t)zrle_cpixel * npal + (size_t)(w * bits + 7) / 8 * h;
+			if (bytes < est)
+				mode = npal;
+		}
+	}
+
+	*o++ = mode;
+	if (mode > 1 && mode != 128)
+		for (i = 0; i < npal; i++)
+			o = zrle_put_pixel(o, pal[i]);
+
+	if (mode == 0) {
+		for (i = 0; i < n; i++)
+			o = zrle_put_pixel(o, t[i]);
+	}
+	else if (mode < 128) {
+		/* Rows of packed indices, the first pixel in the top bits */
+		for (y = 0; y < h; y++) {
+			byte = 0;
+			nbits = 0;
+			for (x = 0; x < w; x++) {
+				idx = zrle_palette(hash, pal, &npal, t[y * w + x]);
+				byte = (byte << bits) | idx;
+				if ((nbits += bits) == 8) {
+					*o++ = byte;
+					byte = 0;
+					nbits = 0;
+				}
+			}
+			if (nbits > 0)
+				*o++ = byte << (8 - nbits);
+		}
+	}
+	else {
+		for (i = 0; i < n; i = j) {
+			p = t[i];
+			for (j = i + 1; j < n && t[j] == p; j++)
+				;
+			if (mode == 128) {
+				o = zrle_put_pixel(o, p);
+				o = zrle_put_run(o, j - i);
+				continue;
+			}
+			idx = zrle_palette(hash, pal, &npal, p);
+			if (j - i == 1)
+				*o++ = idx;
+			else {
+				*o++ = idx | 128;
+				o = zrle_put_run(o, j - i);
+			}
+		}
+	}
+	return o;
+}
+
+/* Run on the scan threads, one strip each */
+static void zrle_job_run(int j)
+{
+	struct zrle_job *job = &zrle_jobs[j];
+	rfbClientPtr cl = zrle_cl;
+	rfbScreenInfoPtr scr = cl->scaledScreen;
+	int tx, tw, ntiles;
+	unsigned char *o;
+	z_stream zs;
+
+	job->failed = 1;
+	/* Palette RLE can take a little more than raw, never this much */
+	ntiles = (job->w + ZRLE_TILE - 1) / ZRLE_TILE;
+	if (zrle_grow(&job->pix, &job->pix_size, (size_t)job->w * job->h * zrle_bpp) < 0 ||
+	    zrle_grow(&job->raw, &job->raw_size, (size_t)ntiles * (1 + 4 * 127) +
+	      (size_t)job->w * job->h * (zrle_cpixel + 1)) < 0)
+		return;
+
+	cl->translateFn(cl->translateLookupTable, &cl->screen->serverFormat, &cl->format,
+	  scr->frameBuffer + job->y * scr->paddedWidthInBytes +
+	    job->x * (cl->screen->serverFormat.bitsPerPixel / 8),
+	  (char *)job->pix, scr->paddedWidthInBytes, job->w, job->h);
+
+	o = job->raw;
+	for (tx = 0; tx < job->w; tx += ZRLE_TILE) {
+		tw = job->w - tx < ZRLE_TILE ? job->w - tx : ZRLE_TILE;
+		o = zrle_tile(o, job->pix + (size_t)tx * zrle_bpp, job->w * zrle_bpp, tw, job->h);
+	}
+
+	memset(&zs, 0, sizeof(zs));
+	if (deflateInit2(&zs, zrle_level, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		return;
+	/* The sync flush adds an empty stored block */
+	if (zrle_grow(&job->out, &job->out_size, deflateBound(&zs, o - job->raw) + 16) == 0) {
+		zs.next_in = job->raw;
+		zs.avail_in = o - job->raw;
+		zs.next_out = job->out;
+		zs.avail_out = job->out_size;
+		if (deflate(&zs, Z_SYNC_FLUSH) == Z_OK && zs.avail_in == 0 && zs.avail_out > 0) {
+			job->out_len = zs.next_out - job->out;
+			job->failed = 0;
+		}
+	}
+	deflateEnd(&zs);
+}
+
+/* The CPIXEL of a 32 bpp viewer is 3 bytes when all colour bits fit in
+ * the top or the bottom three */
+static void zrle_format(rfbClientPtr cl)
+{
+	rfbPixelFormat *f = &cl->format;
+	uint32_t max = ((uint32_t)f->redMax << f->redShift) |
+	    ((uint32_t)f->greenMax << f->greenShift) | ((uint32_t)f->blueMax << f->blueShift);
+
+	zrle_bpp = f->bitsPerPixel / 8;
+	zrle_cpixel = zrle_bpp;
+	zrle_coff = 0;
+	if (zrle_bpp != 4 || !f->trueColour)
+		return;
+	if (f->bigEndian ? (max & 0xff) == 0 : (max & 0xff000000) == 0)
+		zrle_cpixel = 3;
+	else if (f->bigEndian ? (max & 0xff000000) == 0 : (max & 0xff) == 0) {
+		zrle_cpixel = 3;
+		zrle_coff = 1;
+	}
+}
+
+/* From the display hook, before libvncserver looks at the regions. What
+ * is sent here is taken out of them, so libvncserver has nothing left to
+ * encode but cursor updates. */
+static void zrle_send_update(rfbClientPtr cl)
+{
+	struct client_data *cd = cl->clientData;
+	sraRegionPtr region;
+	sraRectangleIterator *it;
+	sraRect rect;
+	struct zrle_job *jobs;
+	unsigned char *buf, *b, *lenp;
+	uint64_t area = 0;
+	uint32_t len, enc;
+	uint16_t v[4];
+	size_t size;
+	int nrects = 0, njobs = 0, j, y, head;
+
+	if (cd == NULL || cl->preferredEncoding != rfbEncodingZRLE || cl->newFBSizePending)
+		return;
+	/* A viewer libvncserver draws the cursor for stays with it */
+	if (!cd->zrle_owned && cl->screen->cursor != NULL && !cl->enableCursorShapeUpdates)
+		return;
+
+	/* Copies are sent as the pixels they left */
+	if (!sraRgnEmpty(cl->copyRegion)) {
+		sraRgnOr(cl->modifiedRegion, cl->copyRegion);
+		sraRgnMakeEmpty(cl->copyRegion);
+	}
+
+	region = sraRgnCreateRgn(cl->modifiedRegion);
+	sraRgnAnd(region, cl->requestedRegion);
+	if (sraRgnCountRects(region) > 0xffff) {
+		rect = sraRgnBBox(region);
+		sraRgnDestroy(region);
+		region = sraRgnCreateRect(rect.x1, rect.y1, rect.x2, rect.y2);
+	}
+
+	it = sraRgnGetIterator(region);
+	while (sraRgnIteratorNext(it, &rect)) {
+		nrects++;
+		njobs += (rect.y2 - rect.y1 + ZRLE_TILE - 1) / ZRLE_TILE;
+		area += (uint64_t)(rect.x2 - rect.x1) * (rect.y2 - rect.y1);
+	}
+	sraRgnReleaseIterator(it);
+	if (nrects == 0) {
+		sraRgnDestroy(region);
+		return;
+	}
+
+	if (njobs > zrle_njobs) {
+		if ((jobs = realloc(zrle_jobs, njobs * sizeof(*jobs))) == NULL)
+			goto fail;
+		memset(jobs + zrle_njobs, 0, (njobs - zrle_njobs) * sizeof(*jobs));
+		zrle_jobs = jobs;
+		zrle_njobs = njobs;
+	}
+
+	j = 0;
+	it = sraRgnGetIterator(region);
+	while (sraRgnIteratorNext(it, &rect)) {
+		for (y = rect.y1; y < rect.y2; y += ZRLE_TILE, j++) {
+			zrle_jobs[j].x = rect.x1;
+			zrle_jobs[j].y = y;
+			zrle_jobs[j].w = rect.x2 - rect.x1;
+			zrle_jobs[j].h = rect.y2 - y < ZRLE_TILE ? rect.y2 - y : ZRLE_TILE;
+		}
+	}
+	sraRgnReleaseIterator(it);
+
+	zrle_cl = cl;
+	zrle_format(cl);
+	zrle_level = cl->zlibCompressLevel < 0 ? Z_DEFAULT_COMPRESSION :
+	    cl->zlibCompressLevel > 9 ? 9 : cl->zlibCompressLevel;
+	if (area < (uint64_t)zrle_threshold || njobs == 1 || scan_active == 0) {
+		for (j = 0; j < njobs; j++)
+			zrle_job_run(j);
+	}
+	else
+		scan_run(zrle_job_run, njobs, scan_active + 1);
+
+	size = 4 + (size_t)nrects * 16 + 2;
+	for (j = 0; j < njobs; j++) {
+		if (zrle_jobs[j].failed)
+			goto fail;
+		size += zrle_jobs[j].out_len;
+	}
+	if ((buf = malloc(size)) == NULL)
+		goto fail;
+
+	b = buf;
+	*b++ = rfbFramebufferUpdate;
+	*b++ = 0;
+	*b++ = nrects >> 8;
+	*b++ = nrects & 0xff;
+
+	/* The zlib header opens the stream, unless libvncserver did */
+	head = !cd->zrle_owned && cl->zrleData == NULL;
+	j = 0;
+	it = sraRgnGetIterator(region);
+	while (sraRgnIteratorNext(it, &rect)) {
+		v[0] = htons(rect.x1);
+		v[1] = htons(rect.y1);
+		v[2] = htons(rect.x2 - rect.x1);
+		v[3] = htons(rect.y2 - rect.y1);
+		enc = htonl(rfbEncodingZRLE);
+		memcpy(b, v, 8);
+		memcpy(b + 8, &enc, 4);
+		lenp = b + 12;
+		b += 16;
+		if (head) {
+			*b++ = 0x78;
+			*b++ = 0x01;
+			head = 0;
+		}
+		for (y = rect.y1; y < rect.y2; y += ZRLE_TILE, j++) {
+			memcpy(b, zrle_jobs[j].out, zrle_jobs[j].out_len);
+			b += zrle_jobs[j].out_len;
+		}
+		len = htonl(b - lenp - 4);
+		memcpy(lenp, &len, 4);
+	}
+	sraRgnReleaseIterator(it);
+
+	cd->zrle_owned = 1;
+	if (rfbWriteExact(cl, (char *)buf, b - buf) < 0) {
+		fprintf(stderr, "write to %s failed, %s\n", cl->host, strerror(errno));
+		rfbCloseClient(cl);
+	}
+	else {
+		rfbStatRecordMessageSent(cl, rfbFramebufferUpdate, 4, 4);
+		rfbStatRecordEncodingSent(cl, rfbEncodingZRLE, b - buf - 4,
+		  12 * nrects + area * (cl->format.bitsPerPixel / 8));
+	}
+	free(buf);
+
+	sraRgnSubtract(cl->modifiedRegion, region);
+	sraRgnMakeEmpty(cl->requestedRegion);
+	sraRgnDestroy(region);
+	return;
+
+fail:
+	/* Out of memory. libvncserver may take over a stream not started. */
+	sraRgnDestroy(region);
+	if (cd->zrle_owned) {
+		fprintf(stderr, "cannot encode an update for %s\n", cl->host);
+		rfbCloseClient(cl);
+		sraRgnMakeEmpty(cl->requestedRegion);
+	}
+}
+
+#else
+
+static void zrle_send_update(rfbClientPtr cl)
+{
+}
+
+#endif /* LIBVNCSERVER_HAVE_LIBZ */
+
+static int update_screen(struct head *h)
+{
+	int b, i, changed = 0, nrects = 0, keyframe = 0, rows;
+	uint64_t words = 0, area = 0;
+	double t0, t1;
+
+	/* The fb went away, viewers keep the last screen until it is back */
+	if (h->fbfd < 0)
+		return 0;
+
+	DTRACE_PROBE1(fbvncserver, update_start, h->port);
+
+	/* Check if the framebuffer resolution was changed */
+	if (readScreenInfo_m(h)) {
+		DTRACE_PROBE3(fbvncserver, update_end, h->port, -1, 0);
+		return 3;  //screen changed
+	}
+
+	if (!h->vncscr->serverFormat.trueColour)
+		cmap_poll(h);
+
+	t0 = now_seconds();
+	if (h->rec.fd >= 0)
+		keyframe = rec_keyframe_due(h, t0);
+	rows = damage_rows(h, keyframe);
+	if (rows > 0) {
+		scan_frame(h);
+	}
+	else {
+		for (b = 0; b < h->nbands; b++)
+			h->bands[b].nrects = h->bands[b].changed = 0;
+	}
+	h->dirty.scan = NULL;
+
+	/* Copies are damage the scan may not find again */
+	if (h->damage.copies > 0) {
+		nrects += h->damage.copies;
+		area += h->damage.copy_area;
+		changed = 1;
+		h->damage.copies = 0;
+		h->damage.copy_area = 0;
+	}
+
+	for (b = 0; b < h->nbands; b++) {
+		for (i = 0; i < h->bands[b].nrects; i++) {
+			struct damage_rect *d = &h->bands[b].rects[i];
+
+#ifdef DEBUG
+			fprintf(stderr, "Dirty page: %dx%d+%d+%d...\n",
+			  d->x2 - d->x1, d->y2 - d->y1, d->x1, d->y1);
+#endif
+			rfbMarkRectAsModified(h->vncscr, d->x1, d->y1, d->x2, d->y2);
+			damage_notify(h, d->x1, d->y1, d->x2, d->y2, keyframe);
+			area += (uint64_t)(d->x2 - d->x1) * (d->y2 - d->y1);
+			nrects++;
+			changed = 1;
+		}
+		words += h->bands[b].changed;
+	}
+	if (keyframe)
+		rec_keyframe(h);
+	t1 = now_seconds();
+
+	h->metrics.frames++;
+	h->heat.frames++;
+	h->metrics.pixels_compared += h->scrinfo.xres * rows;
+	h->metrics.pixels_changed += words * ((32 + h->scrinfo.bits_per_pixel - 1) / h->scrinfo.bits_per_pixel);
+	h->metrics.damage_area += area;
+	hist_observe(&h->metrics.scan_seconds, t1 - t0);
+	hist_observe(&h->metrics.damage_rects, nrects);
+	if (changed) {
+		metrics_damage(h, t1);
+		h->thumb.frame_seq++;
+	}
+	latency_scanned(h, changed, t1);
+
+	shm_publish(h);
+	cu_push(h->vncscr);
+	budget_schedule();
+	zc_send_updates(h->vncscr);
+
+	if (changed)
+		rfbProcessEvents(h->vncscr, 0);
+
+	DTRACE_PROBE3(fbvncserver, update_end, h->port, nrects, area);
+	return 0;
+}
+
+/*****************************************************************************/
+
+/* Damage heatmap. With -P every damage rect the scan hands to libvncserver
+ * is also added to a per tile count of changes and damaged bytes. SIGUSR1
+ * writes the counts of each head to the directory as a PNG image, one
+ * pixel per tile, and as CSV, and starts a new window. */
+
+#define HEAT_TILE 32
+
+static char *heat_dir = NULL;
+static volatile sig_atomic_t heat_dump_set = 0;
+
+static void heat_setup(struct head *h)
+{
+	if (heat_dir == NULL)
+		return;
+
+	free(h->heat.count);
+	free(h->heat.bytes);
+
+	h->heat.tw = (h->scrinfo.xres + HEAT_TILE - 1) / HEAT_TILE;
+	h->heat.th = (h->scrinfo.yres + HEAT_TILE - 1) / HEAT_TILE;
+	h->heat.count = calloc(h->heat.tw * h->heat.th, sizeof(uint32_t));
+	h->heat.bytes = calloc(h->heat.tw * h->heat.th, sizeof(uint64_t));
+	assert(h->heat.count != NULL && h->heat.bytes != NULL);
+	h->heat.frames = 0;
+	h->heat.since = time(NULL);
+}
+
+static void heat_add(struct head *h, int x1, int y1, int x2, int y2)
+{
+	int bpp = h->scrinfo.bits_per_pixel / 8;
+	int tx, ty, cx1, cy1, cx2, cy2;
+
+	for (ty = y1 / HEAT_TILE; ty <= (y2 - 1) / HEAT_TILE; ty++) {
+		cy1 = ty * HEAT_TILE > y1 ? ty * HEAT_TILE : y1;
+		cy2 = (ty + 1) * HEAT_TILE < y2 ? (ty + 1) * HEAT_TILE : y2;
+
+		for (tx = x1 / HEAT_TILE; tx <= (x2 - 1) / HEAT_TILE; tx++) {
+			cx1 = tx * HEAT_TILE > x1 ? tx * HEAT_TILE : x1;
+			cx2 = (tx + 1) * HEAT_TILE < x2 ? (tx + 1) * HEAT_TILE : x2;
+
+			h->heat.count[ty * h->heat.tw + tx]++;
+			h->heat.bytes[ty * h->heat.tw + tx] += (uint64_t)(cx2 - cx1) * (cy2 - cy1) * bpp;
+		}
+	}
+}
+
+static void heat_dump(struct head *h)
+{
+	char path[PATH_MAX], *png;
+	time_t now = time(NULL);
+	uint32_t max = 0;
+	unsigned char *rgb;
+	size_t len;
+	double secs;
+	FILE *f;
+	int i, x, y;
+
+	if (h->heat.count == NULL)
+		return;
+
+	secs = now > h->heat.since ? now - h->heat.since : 1;
+	for (i = 0; i < h->heat.tw * h->heat.th; i++)
+		if (h->heat.count[i] > max)
+			max = h->heat.count[i];
+
+	/* Brightness is the change count relative to the busiest tile */
+	rgb = malloc((size_t)h->heat.tw * h->heat.th * 3);
+	if (rgb == NULL)
+		return;
+	for (i = 0; i < h->heat.tw * h->heat.th; i++)
+		memset(rgb + i * 3, max ? (int)((uint64_t)h->heat.count[i] * 255 / max) : 0, 3);
+	if (png_rgb(rgb, h->heat.tw, h->heat.th, &png, &len) < 0) {
+		free(rgb);
+		return;
+	}
+	free(rgb);
+
+	snprintf(path, sizeof(path), "%s/heat-%d-%ld.png", heat_dir, h->port, (long)now);
+	if ((f = fopen(path, "w")) == NULL) {
+		fprintf(stderr, "cannot write %s, %s\n", path, strerror(errno));
+		free(png);
+		return;
+	}
+	fwrite(png, 1, len, f);
+	fclose(f);
+	free(png);
+
+	snprintf(path, sizeof(path), "%s/heat-%d-%ld.csv", heat_dir, h->port, (long)now);
+	if ((f = fopen(path, "w")) == NULL) {
+		fprintf(stderr, "cannot write %s, %s\n", path, strerror(errno));
+		return;
+	}
+	fprintf(f, "x,y,w,h,changes,bytes,changes_per_frame,changes_per_second\n");
+	for (y = 0; y < h->heat.th; y++) {
+		for (x = 0; x < h->heat.tw; x++) {
+			i = y * h->heat.tw + x;
+			if (h->heat.count[i] == 0)
+				continue;
+			fprintf(f, "%d,%d,%d,%d,%u,%llu,%.4f,%.3f\n",
+			  x * HEAT_TILE, y * HEAT_TILE,
+			  x * HEAT_TILE + HEAT_TILE > (int)h->scrinfo.xres ? (int)h->scrinfo.xres - x * HEAT_TILE : HEAT_TILE,
+			  y * HEAT_TILE + HEAT_TILE > (int)h->scrinfo.yres ? (int)h->scrinfo.yres - y * HEAT_TILE : HEAT_TILE,
+			  h->heat.count[i], (unsigned long long)h->heat.bytes[i],
+			  h->heat.frames ? (double)h->heat.count[i] / h->heat.frames : 0.0,
+			  h->heat.count[i] / secs);
+		}
+	}
+	fclose(f);
+
+	printf("Wrote heatmap of port %d to %s\n", h->port, heat_dir);
+
+	memset(h->heat.count, 0, h->heat.tw * h->heat.th * sizeof(uint32_t));
+	memset(h->heat.bytes, 0, h->heat.tw * h->heat.th * sizeof(uint64_t));
+	h->heat.frames = 0;
+	h->heat.since = now;
+}
+
+/*****************************************************************************/
+
+/* Session recording. With -R every head writes what the capture finds to
+ * a file in the directory, in the format of fbvncrec.h, together with the
+ * input viewers send. The capture only copies the damaged pixels into a
+ * ring buffer. A writer thread per head compresses them and writes them
+ * out, so a slow disk never holds up the capture. When the ring is full
+ * the rects are dropped, and the next frame is recorded as a keyframe
+ * once there is room again. */
+
+#define REC_BUFFER (32 * 1024 * 1024)
+#define REC_ALIGN 32
+#define REC_KEYFRAME_INTERVAL 10
+
+static char *rec_dir = NULL;
+
+/* An entry in the ring. A keyframe is queued as a SIZE record followed by
+ * the raw screen, and written out as SIZE and a compressed keyframe RECT.
+ * Type 0 pads the end of the ring. */
+struct rec_entry
+{
+	uint32_t len;		/* bytes to the next entry */
+	uint32_t pad;
+	struct fbvnc_rec_record rec;
+};
+
+static void rec_write(struct head *h, struct iovec *iov, int n)
+{
+	ssize_t ret;
+	int i;
+
+	for (i = 0; i < n; i++)
+		h->rec.offset += iov[i].iov_len;
+
+	while (n > 0) {
+		ret = writev(h->rec.fd, iov, n);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0) {
+			if (!h->rec.failed)
+				fprintf(stderr, "cannot write recording of port %d, %s\n",
+				  h->port, strerror(errno));
+			h->rec.failed = 1;
+			return;
+		}
+		while (n > 0 && (size_t)ret >= iov->iov_len) {
+			ret -= iov->iov_len;
+			iov++;
+			n--;
+		}
+		if (n > 0) {
+			iov->iov_base = (char *)iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
+	}
+}
+
+/* Writes a RECT record with the pixels compressed */
+static void rec_write_rect(struct head *h, struct fbvnc_rec_record *rec,
+			   struct fbvnc_rec_rect *r, void *pixels, size_t len)
+{
+	struct iovec iov[3];
+	uLongf zlen = compressBound(len);
+
+	if (zlen > h->rec.zsize) {
+		free(h->rec.zbuf);
+		h->rec.zsize = zlen;
+		h->rec.zbuf = malloc(zlen);
+		assert(h->rec.zbuf != NULL);
+	}
+	if (compress2(h->rec.zbuf, &zlen, pixels, len, Z_BEST_SPEED) != Z_OK)
+		return;
+
+	rec->type = FBVNC_REC_RECT;
+	rec->len = sizeof(*r) + zlen;
+	iov[0].iov_base = rec;
+	iov[0].iov_len = sizeof(*rec);
+	iov[1].iov_base = r;
+	iov[1].iov_len = sizeof(*r);
+	iov[2].iov_base = h->rec.zbuf;
+	iov[2].iov_len = zlen;
+	rec_write(h, iov, 3);
+}
+
+static void rec_write_entry(struct head *h, struct rec_entry *e)
+{
+	struct fbvnc_rec_record rec = e->rec;
+	struct fbvnc_rec_size *s;
+	struct fbvnc_rec_colourmap *cm;
+	struct fbvnc_rec_rect r, *rp;
+	struct iovec iov[2];
+	char *pixels;
+
+	switch (rec.type) {
+	case FBVNC_REC_SIZE:
+		s = (struct fbvnc_rec_size *)(e + 1);
+		if (h->rec.nindex == h->rec.index_size) {
+			h->rec.index_size = h->rec.index_size ? h->rec.index_size * 2 : 64;
+			h->rec.index = realloc(h->rec.index,
+			  h->rec.index_size * sizeof(struct fbvnc_rec_index));
+			assert(h->rec.index != NULL);
+		}
+		h->rec.index[h->rec.nindex].usec = rec.usec;
+		h->rec.index[h->rec.nindex].offset = h->rec.offset;
+		h->rec.nindex++;
+
+		rec.flags = 0;
+		rec.len = sizeof(*s);
+		iov[0].iov_base = &rec;
+		iov[0].iov_len = sizeof(rec);
+		iov[1].iov_base = s;
+		iov[1].iov_len = sizeof(*s);
+		rec_write(h, iov, 2);
+
+		/* The palette a pseudocolour keyframe indexes */
+		pixels = (char *)(s + 1);
+		if (!s->true_colour) {
+			cm = (struct fbvnc_rec_colourmap *)pixels;
+			rec.type = FBVNC_REC_COLOURMAP;
+			rec.len = sizeof(*cm) + cm->count * 3 * sizeof(uint16_t);
+			iov[1].iov_base = cm;
+			iov[1].iov_len = rec.len;
+			rec_write(h, iov, 2);
+			pixels += rec.len;
+		}
+
+		r.x = r.y = 0;
+		r.w = s->width;
+		r.h = s->height;
+		rec.flags = FBVNC_REC_KEYFRAME;
+		rec_write_rect(h, &rec, &r, pixels, e->rec.len - (pixels - (char *)s));
+		break;
+	case FBVNC_REC_RECT:
+		rp = (struct fbvnc_rec_rect *)(e + 1);
+		rec_write_rect(h, &rec, rp, rp + 1, e->rec.len - sizeof(*rp));
+		break;
+	default:
+		iov[0].iov_base = &rec;
+		iov[0].iov_len = sizeof(rec);
+		iov[1].iov_base = e + 1;
+		iov[1].iov_len = rec.len;
+		rec_write(h, iov, 2);
+		break;
+	}
+}
+
+static void *rec_writer(void *arg)
+{
+	struct head *h = arg;
+	struct rec_entry *e;
+
+	pthread_mutex_lock(&h->rec.lock);
+	for (;;) {
+		while (h->rec.tail == h->rec.head && !h->rec.stop)
+			pthread_cond_wait(&h->rec.cond, &h->rec.lock);
+		if (h->rec.tail == h->rec.head)
+			break;
+		e = (struct rec_entry *)(h->rec.ring + h->rec.tail % h->rec.size);
+		pthread_mutex_unlock(&h->rec.lock);
+
+		if (e->rec.type != 0)
+			rec_write_entry(h, e);
+
+		pthread_mutex_lock(&h->rec.lock);
+		h->rec.tail += e->len;
+	}
+	pthread_mutex_unlock(&h->rec.lock);
+	return NULL;
+}
+
+/* Room for a record with len bytes of payload, or NULL if the ring is
+ * full. rec_commit() hands it to the writer. */
+static void *rec_reserve(struct head *h, int type, int flags, size_t len)
+{
+	size_t need = (sizeof(struct rec_entry) + len + REC_ALIGN - 1) & ~(size_t)(REC_ALIGN - 1);
+	size_t pos, skip;
+	struct rec_entry *e;
+
+	pthread_mutex_lock(&h->rec.lock);
+	pos = h->rec.head % h->rec.size;
+	skip = pos + need > h->rec.size ? h->rec.size - pos : 0;
+	if (h->rec.head + skip + need - h->rec.tail > h->rec.size) {
+		pthread_mutex_unlock(&h->rec.lock);
+		h->metrics.rec_dropped++;
+		return NULL;
+	}
+	pthread_mutex_unlock(&h->rec.lock);
+
+	/* Entries do not wrap, pad up to the end of the ring instead */
+	if (skip) {
+		e = (struct rec_entry *)(h->rec.ring + pos);
+		e->len = skip;
+		e->rec.type = 0;
+		pos = 0;
+	}
+	e = (struct rec_entry *)(h->rec.ring + pos);
+	e->len = need;
+	e->rec.type = type;
+	e->rec.flags = flags;
+	e->rec.len = len;
+	e->rec.usec = (now_seconds() - h->rec.start) * 1000000;
+	h->rec.pending = skip + need;
+	return e + 1;
+}
+
+static void rec_commit(struct head *h)
+{
+	pthread_mutex_lock(&h->rec.lock);
+	h->rec.head += h->rec.pending;
+	pthread_cond_signal(&h->rec.cond);
+	pthread_mutex_unlock(&h->rec.lock);
+}
+
+static void rec_start(struct head *h)
+{
+	struct fbvnc_rec_file hdr;
+	char path[PATH_MAX], stamp[32];
+	size_t frame;
+	time_t now = time(NULL);
+
+	if (rec_dir == NULL)
+		return;
+
+	strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", localtime(&now));
+	snprintf(path, sizeof(path), "%s/fbvnc-%d-%s.rec", rec_dir, h->port, stamp);
+	if ((h->rec.fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600)) < 0) {
+		fprintf(stderr, "cannot create recording %s, %s\n", path, strerror(errno));
+		return;
+	}
+
+	/* At least two keyframes fit */
+	frame = (size_t)h->vncscr->paddedWidthInBytes * h->vncscr->height;
+	h->rec.size = REC_BUFFER > 3 * frame ? REC_BUFFER : 3 * frame;
+	h->rec.size = (h->rec.size + REC_ALIGN - 1) & ~(size_t)(REC_ALIGN - 1);
+	h->rec.ring = malloc(h->rec.size);
+	assert(h->rec.ring != NULL);
+	h->rec.head = h->rec.tail = 0;
+	h->rec.stop = 0;
+	h->rec.failed = 0;
+	h->rec.need_keyframe = 1;
+	h->rec.start = now_seconds();
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = FBVNC_REC_MAGIC;
+	hdr.version = FBVNC_REC_VERSION;
+	hdr.port = h->port;
+	hdr.start = now;
+	h->rec.offset = 0;
+	{
+		struct iovec iov = { &hdr, sizeof(hdr) };
+		rec_write(h, &iov, 1);
+	}
+
+	pthread_mutex_init(&h->rec.lock, NULL);
+	pthread_cond_init(&h->rec.cond, NULL);
+	if (pthread_create(&h->rec.writer, NULL, rec_writer, h) != 0) {
+		fprintf(stderr, "cannot start recording of port %d\n", h->port);
+		close(h->rec.fd);
+		h->rec.fd = -1;
+		free(h->rec.ring);
+		return;
+	}
+	printf("Recording port %d to %s\n", h->port, path);
+}
+
+/* Drains the ring and finishes the file with the keyframe index */
+static void rec_stop(struct head *h)
+{
+	struct fbvnc_rec_record rec;
+	struct fbvnc_rec_trailer trailer;
+	struct iovec iov[3];
+
+	if (h->rec.fd < 0)
+		return;
+
+	pthread_mutex_lock(&h->rec.lock);
+	h->rec.stop = 1;
+	pthread_cond_signal(&h->rec.cond);
+	pthread_mutex_unlock(&h->rec.lock);
+	pthread_join(h->rec.writer, NULL);
+
+	memset(&rec, 0, sizeof(rec));
+	rec.type = FBVNC_REC_INDEX;
+	rec.len = h->rec.nindex * sizeof(struct fbvnc_rec_index);
+	rec.usec = (now_seconds() - h->rec.start) * 1000000;
+	memset(&trailer, 0, sizeof(trailer));
+	trailer.index = h->rec.offset;
+	trailer.magic = FBVNC_REC_MAGIC;
+	iov[0].iov_base = &rec;
+	iov[0].iov_len = sizeof(rec);
+	iov[1].iov_base = h->rec.index;
+	iov[1].iov_len = rec.len;
+	iov[2].iov_base = &trailer;
+	iov[2].iov_len = sizeof(trailer);
+	rec_write(h, iov, 3);
+	close(h->rec.fd);
+	h->rec.fd = -1;
+
+	pthread_mutex_destroy(&h->rec.lock);
+	pthread_cond_destroy(&h->rec.cond);
+	free(h->rec.ring);
+	free(h->rec.index);
+	free(h->rec.zbuf);
+	h->rec.ring = NULL;
+	h->rec.index = NULL;
+	h->rec.zbuf = NULL;
+	h->rec.nindex = h->rec.index_size = 0;
+	h->rec.zsize = 0;
+}
+
+static int rec_keyframe_due(struct head *h, double t)
+{
+	return h->rec.need_keyframe || t - h->rec.last_keyframe >= REC_KEYFRAME_INTERVAL;
+}
+
+static void rec_keyframe(struct head *h)
+{
+	struct fbvnc_rec_size *s;
+	struct fbvnc_rec_colourmap *cm;
+	size_t len = (size_t)h->vncscr->paddedWidthInBytes * h->vncscr->height;
+	size_t cmap_len = 0;
+	int y, bpp = h->vncscr->serverFormat.bitsPerPixel / 8;
+	char *p;
+
+	if (!h->vncscr->serverFormat.trueColour)
+		cmap_len = sizeof(*cm) + sizeof(h->cmap.map);
+
+	/* Grown past what the ring was sized for, start a new file */
+	if (2 * (sizeof(struct rec_entry) + sizeof(*s) + cmap_len + len) > h->rec.size) {
+		rec_stop(h);
+		rec_start(h);
+		if (h->rec.fd < 0)
+			return;
+	}
+
+	s = rec_reserve(h, FBVNC_REC_SIZE, FBVNC_REC_KEYFRAME,
+	  sizeof(*s) + cmap_len + (size_t)h->vncscr->width * h->vncscr->height * bpp);
+	if (s == NULL) {
+		h->rec.need_keyframe = 1;
+		return;
+	}
+	memset(s, 0, sizeof(*s));
+	s->width = h->vncscr->width;
+	s->height = h->vncscr->height;
+	s->bits_per_pixel = h->vncscr->serverFormat.bitsPerPixel;
+	s->depth = h->vncscr->serverFormat.depth;
+	s->true_colour = h->vncscr->serverFormat.trueColour;
+	s->red_max = h->vncscr->serverFormat.redMax;
+	s->green_max = h->vncscr->serverFormat.greenMax;
+	s->blue_max = h->vncscr->serverFormat.blueMax;
+	s->red_shift = h->vncscr->serverFormat.redShift;
+	s->green_shift = h->vncscr->serverFormat.greenShift;
+	s->blue_shift = h->vncscr->serverFormat.blueShift;
+
+	p = (char *)(s + 1);
+	if (cmap_len > 0) {
+		cm = (struct fbvnc_rec_colourmap *)p;
+		memset(cm, 0, sizeof(*cm));
+		cm->count = CMAP_SIZE;
+		memcpy(cm + 1, h->cmap.map, sizeof(h->cmap.map));
+		p += cmap_len;
+	}
+	for (y = 0; y < h->vncscr->height; y++, p += h->vncscr->width * bpp)
+		memcpy(p, h->vncscr->frameBuffer + y * h->vncscr->paddedWidthInBytes,
+		  h->vncscr->width * bpp);
+	rec_commit(h);
+
+	h->rec.need_keyframe = 0;
+	h->rec.last_keyframe = now_seconds();
+}
+
+static void rec_rect(struct head *h, int x1, int y1, int x2, int y2)
+{
+	struct fbvnc_rec_rect *r;
+	int y, bpp = h->vncscr->serverFormat.bitsPerPixel / 8;
+	int w = x2 - x1, ht = y2 - y1;
+	char *p;
+
+	r = rec_reserve(h, FBVNC_REC_RECT, 0, sizeof(*r) + (size_t)w * ht * bpp);
+	if (r == NULL) {
+		h->rec.need_keyframe = 1;
+		return;
+	}
+	r->x = x1;
+	r->y = y1;
+	r->w = w;
+	r->h = ht;
+
+	p = (char *)(r + 1);
+	for (y = y1; y < y2; y++, p += w * bpp)
+		memcpy(p, h->vncscr->frameBuffer + y * h->vncscr->paddedWidthInBytes + x1 * bpp,
+		  w * bpp);
+	rec_commit(h);
+}
+
+static void rec_key(struct head *h, rfbKeySym key, rfbBool down)
+{
+	struct fbvnc_rec_key *k;
+
+	if (h->rec.fd < 0)
+		return;
+	if ((k = rec_reserve(h, FBVNC_REC_KEY, 0, sizeof(*k))) == NULL)
+		return;
+	k->keysym = key;
+	k->down = down;
+	rec_commit(h);
+}
+
+static void rec_pointer(struct head *h, int x, int y, int buttonMask)
+{
+	struct fbvnc_rec_pointer *p;
+
+	if (h->rec.fd < 0)
+		return;
+	if ((p = rec_reserve(h, FBVNC_REC_POINTER, 0, sizeof(*p))) == NULL)
+		return;
+	p->x = x;
+	p->y = y;
+	p->buttons = buttonMask;
+	rec_commit(h);
+}
+
+/*****************************************************************************/
+
+/* Thumbnails and snapshots, served next to the metrics (-M) as
+ * /thumbnail.png and /snapshot.png, for the head given with ?port=.
+ * The capture only marks the tiles it found damaged. A request brings
+ * the thumbnail up to date for those tiles and hands the connection to
+ * the encoder thread, which writes the PNG. An image that has not changed
+ * since it was last encoded is sent from the cache. */
+
+#define THUMB_WIDTH 320
+#define THUMB_TILE 8		/* thumbnail pixels */
+#define THUMB_JOBS 8
+#define THUMB_LINGER 30		/* seconds a head is captured after a request */
+
+struct thumb_job
+{
+	struct head *h;
+	int fd;
+	int snapshot;
+	uint64_t seq;
+	/* To encode, NULL if the cached PNG is current */
+	unsigned char *pixels;
+	int width, height;
+	rfbPixelFormat format;	/* of the pixels, RGB888 if bitsPerPixel is 24 */
+};
+
+static pthread_t thumb_thread;
+static pthread_mutex_t thumb_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t thumb_cond = PTHREAD_COND_INITIALIZER;
+static struct thumb_job thumb_jobs[THUMB_JOBS];
+static int thumb_njobs;
+static struct head *thumb_busy;
+static int thumb_running;
+
+static void thumb_setup(struct head *h)
+{
+	if (!thumb_running)
+		return;
+
+	free(h->thumb.rgb);
+	free(h->thumb.dirty);
+
+	h->thumb.scale = (h->scrinfo.xres + THUMB_WIDTH - 1) / THUMB_WIDTH;
+	if (h->thumb.scale < 1)
+		h->thumb.scale = 1;
+	h->thumb.tw = (h->scrinfo.xres + h->thumb.scale - 1) / h->thumb.scale;
+	h->thumb.th = (h->scrinfo.yres + h->thumb.scale - 1) / h->thumb.scale;
+	h->thumb.tiles_x = (h->thumb.tw + THUMB_TILE - 1) / THUMB_TILE;
+	h->thumb.tiles_y = (h->thumb.th + THUMB_TILE - 1) / THUMB_TILE;
+	h->thumb.rgb = calloc(h->thumb.tw * h->thumb.th, 3);
+	h->thumb.dirty = malloc(h->thumb.tiles_x * h->thumb.tiles_y);
+	assert(h->thumb.rgb != NULL && h->thumb.dirty != NULL);
+	memset(h->thumb.dirty, 1, h->thumb.tiles_x * h->thumb.tiles_y);
+	h->thumb.any_dirty = 1;
+	h->thumb.frame_seq++;
+}
+
+static void thumb_add(struct head *h, int x1, int y1, int x2, int y2)
+{
+	int span = THUMB_TILE * h->thumb.scale;
+	int tx, ty;
+
+	for (ty = y1 / span; ty <= (y2 - 1) / span; ty++)
+		for (tx = x1 / span; tx <= (x2 - 1) / span; tx++)
+			h->thumb.dirty[ty * h->thumb.tiles_x + tx] = 1;
+	h->thumb.any_dirty = 1;
+}
+
+static inline uint32_t thumb_pixel(const unsigned char *p, int bpp)
+{
+	uint32_t v = 0;
+
+	switch (bpp) {
+	case 4:
+		return *(const uint32_t *)p;
+	case 2:
+		return *(const uint16_t *)p;
+	}
+	memcpy(&v, p, bpp);
+	return v;
+}
+
+static inline unsigned int thumb_component(uint32_t pixel, int shift, int max)
+{
+	return max ? ((pixel >> shift) & max) * 255 / max : 0;
+}
+
+/* Averages the screen into the thumbnail pixels of the dirty tiles */
+static void thumb_refresh(struct head *h)
+{
+	rfbPixelFormat *fmt = &h->vncscr->serverFormat;
+	int bpp = fmt->bitsPerPixel / 8, scale = h->thumb.scale;
+	int tx, ty, x, y, sx, sy, sx2, sy2;
+	unsigned int r, g, b, n;
+	const unsigned char *row;
+	unsigned char *out;
+	uint32_t pixel;
+
+	if (!h->thumb.any_dirty)
+		return;
+
+	for (ty = 0; ty < h->thumb.tiles_y; ty++) {
+		for (tx = 0; tx < h->thumb.tiles_x; tx++) {
+			if (!h->thumb.dirty[ty * h->thumb.tiles_x + tx])
+				continue;
+			h->thumb.dirty[ty * h->thumb.tiles_x + tx] = 0;
+
+			for (y = ty * THUMB_TILE; y < (ty + 1) * THUMB_TILE && y < h->thumb.th; y++) {
+				for (x = tx * THUMB_TILE; x < (tx + 1) * THUMB_TILE && x < h->thumb.tw; x++) {
+					sy2 = (y + 1) * scale < h->vncscr->height ? (y + 1) * scale : h->vncscr->height;
+					sx2 = (x + 1) * scale < h->vncscr->width ? (x + 1) * scale : h->vncscr->width;
+					r = g = b = n = 0;
+					for (sy = y * scale; sy < sy2; sy++) {
+						row = (unsigned char *)h->vncscr->frameBuffer +
+						  sy * h->vncscr->paddedWidthInBytes;
+						for (sx = x * scale; sx < sx2; sx++) {
+							pixel = thumb_pixel(row + sx * bpp, bpp);
+							n++;
+							if (!fmt->trueColour) {
+								r += h->cmap.rgb[pixel][0];
+								g += h->cmap.rgb[pixel][1];
+								b += h->cmap.rgb[pixel][2];
+								continue;
+							}
+							r += thumb_component(pixel, fmt->redShift, fmt->redMax);
+							g += thumb_component(pixel, fmt->greenShift, fmt->greenMax);
+							b += thumb_component(pixel, fmt->blueShift, fmt->blueMax);
+						}
+					}
+					out = h->thumb.rgb + (y * h->thumb.tw + x) * 3;
+					out[0] = n ? r / n : 0;
+					out[1] = n ? g / n : 0;
+					out[2] = n ? b / n : 0;
+				}
+			}
+		}
+	}
+	h->thumb.any_dirty = 0;
+	h->thumb.seq++;
+}
+
+static void png_chunk(FILE *f, const char *type, const unsigned char *data, uint32_t len)
+{
+	unsigned char be[4];
+	uLong crc;
+
+	be[0] = len >> 24;
+	be[1] = len >> 16;
+	be[2] = len >> 8;
+	be[3] = len;
+	fwrite(be, 4, 1, f);
+	fwrite(type, 4, 1, f);
+	if (len > 0)
+		fwrite(data, len, 1, f);
+	crc = crc32(crc32(0, NULL, 0), (const unsigned char *)type, 4);
+	if (len > 0)
+		crc = crc32(crc, data, len);
+	be[0] = crc >> 24;
+	be[1] = crc >> 16;
+	be[2] = crc >> 8;
+	be[3] = crc;
+	fwrite(be, 4, 1, f);
+}
+
+/* Encodes pixels of the given format as an RGB PNG. Every scanline uses
+ * the Up filter, which turns unchanged rows into runs of zeros. */
+static int png_encode(struct thumb_job *job, int level, char **png, size_t *len)
+{
+	int bpp = job->format.bitsPerPixel / 8, w = job->width, x, y;
+	size_t stride = (size_t)w * 3 + 1, rawlen = stride * job->height;
+	unsigned char *raw, *prev, *line, ihdr[13];
+	const unsigned char *in;
+	uint32_t pixel;
+	uLongf zlen;
+	char *z;
+	FILE *f;
+
+	raw = malloc(rawlen);
+	if (raw == NULL)
+		return -1;
+	prev = calloc(stride, 1);
+	line = malloc(stride);
+	if (prev == NULL || line == NULL) {
+		free(raw);
+		free(prev);
+		free(line);
+		return -1;
+	}
+
+	for (y = 0; y < job->height; y++) {
+		in = job->pixels + (size_t)y * w * bpp;
+		for (x = 0; x < w; x++, in += bpp) {
+			if (bpp == 3) {
+				memcpy(line + 1 + x * 3, in, 3);
+				continue;
+			}
+			pixel = thumb_pixel(in, bpp);
+			line[1 + x * 3] = thumb_component(pixel, job->format.redShift, job->format.redMax);
+			line[2 + x * 3] = thumb_component(pixel, job->format.greenShift, job->format.greenMax);
+			line[3 + x * 3] = thumb_component(pixel, job->format.blueShift, job->format.blueMax);
+		}
+		raw[y * stride] = 2;
+		for (x = 1; x < (int)stride; x++)
+			raw[y * stride + x] = line[x] - prev[x];
+		memcpy(prev, line, stride);
+	}
+	free(prev);
+	free(line);
+
+	zlen = compressBound(rawlen);
+	z = malloc(zlen);
+	if (z == NULL || compress2((unsigned char *)z, &zlen, raw, rawlen, level) != Z_OK) {
+		free(raw);
+		free(z);
+		return -1;
+	}
+	free(raw);
+
+	if ((f = open_memstream(png, len)) == NULL) {
+		free(z);
+		return -1;
+	}
+	fwrite("\x89PNG\r\n\x1a\n", 8, 1, f);
+	ihdr[0] = w >> 24;
+	ihdr[1] = w >> 16;
+	ihdr[2] = w >> 8;
+	ihdr[3] = w;
+	ihdr[4] = job->height >> 24;
+	ihdr[5] = job->height >> 16;
+	ihdr[6] = job->height >> 8;
+	ihdr[7] = job->height;
+	ihdr[8] = 8;		/* bit depth */
+	ihdr[9] = 2;		/* RGB */
+	ihdr[10] = ihdr[11] = ihdr[12] = 0;
+	png_chunk(f, "IHDR", ihdr, sizeof(ihdr));
+	png_chunk(f, "IDAT", (unsigned char *)z, zlen);
+	png_chunk(f, "IEND", NULL, 0);
+	fclose(f);
+	free(z);
+	return 0;
+}
+
+/* An RGB888 image, e.g. the heatmap */
+static int png_rgb(unsigned char *rgb, int width, int height, char **png, size_t *len)
+{
+	struct thumb_job job;
+
+	memset(&job, 0, sizeof(job));
+	job.pixels = rgb;
+	job.width = width;
+	job.height = height;
+	job.format.bitsPerPixel = 24;
+	return png_encode(&job, Z_BEST_COMPRESSION, png, len);
+}
+
+static void thumb_run(struct thumb_job *job)
+{
+	struct head *h = job->h;
+	struct timeval tv = { 2, 0 };
+	char *png;
+	size_t len;
+
+	if (job->pixels != NULL) {
+		if (png_encode(job, job->snapshot ? Z_BEST_SPEED : Z_DEFAULT_COMPRESSION, &png, &len) < 0) {
+			metrics_reply(job->fd, "500 Internal Server Error", "text/plain", NULL, 0);
+			return;
+		}
+		pthread_mutex_lock(&thumb_lock);
+		if (job->snapshot) {
+			free(h->thumb.snap_png);
+			h->thumb.snap_png = png;
+			h->thumb.snap_len = len;
+			h->thumb.snap_seq = job->seq;
+		}
+		else {
+			free(h->thumb.thumb_png);
+			h->thumb.thumb_png = png;
+			h->thumb.thumb_len = len;
+			h->thumb.thumb_seq = job->seq;
+		}
+		pthread_mutex_unlock(&thumb_lock);
+	}
+
+	/* Only this thread replaces the cached images */
+	setsockopt(job->fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	if (job->snapshot)
+		metrics_reply(job->fd, "200 OK", "image/png", h->thumb.snap_png, h->thumb.snap_len);
+	else
+		metrics_reply(job->fd, "200 OK", "image/png", h->thumb.thumb_png, h->thumb.thumb_len);
+}
+
+static void *thumb_worker(void *arg)
+{
+	struct thumb_job job;
+
+	pthread_mutex_lock(&thumb_lock);
+	for (;;) {
+		while (thumb_njobs == 0)
+			pthread_cond_wait(&thumb_cond, &thumb_lock);
+		job = thumb_jobs[0];
+		memmove(thumb_jobs, thumb_jobs + 1, --thumb_njobs * sizeof(struct thumb_job));
+		thumb_busy = job.h;
+		pthread_mutex_unlock(&thumb_lock);
+
+		thumb_run(&job);
+		free(job.pixels);
+		close(job.fd);
+
+		pthread_mutex_lock(&thumb_lock);
+		thumb_busy = NULL;
+		pthread_cond_broadcast(&thumb_cond);
+	}
+	return NULL;
+}
+
+static void thumb_init(void)
+{
+	if (metrics_addr == NULL)
+		return;
+	if (pthread_create(&thumb_thread, NULL, thumb_worker, NULL) != 0) {
+		fprintf(stderr, "cannot start thumbnail thread, thumbnails are off\n");
+		return;
+	}
+	thumb_running = 1;
+}
+
+/* Queues the reply for the encoder thread, which closes the connection.
+ * Returns -1 if the connection is still the caller's. */
+static int thumb_request(int fd, const char *query, int snapshot)
+{
+	struct thumb_job job;
+	struct head *h = heads;
+	unsigned char *row, *out;
+	const char *p;
+	int x, y, bpp, current;
+
+	if (query != NULL && (p = strstr(query, "port=")) != NULL)
+		for (h = heads; h != NULL && h->port != atoi(p + 5); h = h->next)
+			;
+	if (h == NULL || h->vncscr == NULL || h->thumb.rgb == NULL) {
+		metrics_reply(fd, "404 Not Found", "text/plain", NULL, 0);
+		return -1;
+	}
+
+	/* An idle head has not been captured for a while */
+	if (!head_has_clients(h)) {
+		h->thumb.requested = now_seconds();
+		if (update_screen(h) == 3) {
+			changeResolution(h);
+			update_screen(h);
+		}
+	}
+	h->thumb.requested = now_seconds();
+
+	memset(&job, 0, sizeof(job));
+	job.h = h;
+	job.fd = fd;
+	job.snapshot = snapshot;
+
+	if (!snapshot)
+		thumb_refresh(h);
+	job.seq = snapshot ? h->thumb.frame_seq : h->thumb.seq;
+
+	pthread_mutex_lock(&thumb_lock);
+	if (snapshot)
+		current = h->thumb.snap_png != NULL && h->thumb.snap_seq == job.seq;
+	else
+		current = h->thumb.thumb_png != NULL && h->thumb.thumb_seq == job.seq;
+	pthread_mutex_unlock(&thumb_lock);
+
+	if (!current && snapshot) {
+		/* The screen as it is now, the thread converts it. Palette
+		 * pixels are looked up here, the palette may change. */
+		bpp = h->vncscr->serverFormat.bitsPerPixel / 8;
+		job.width = h->vncscr->width;
+		job.height = h->vncscr->height;
+		job.format = h->vncscr->serverFormat;
+		if (!job.format.trueColour)
+			job.format.bitsPerPixel = 24;
+		job.pixels = malloc((size_t)job.width * job.height * (job.format.bitsPerPixel / 8));
+		if (job.pixels == NULL) {
+			metrics_reply(fd, "500 Internal Server Error", "text/plain", NULL, 0);
+			return -1;
+		}
+		for (y = 0; y < job.height; y++) {
+			row = (unsigned char *)h->vncscr->frameBuffer + y * h->vncscr->paddedWidthInBytes;
+			out = job.pixels + (size_t)y * job.width * (job.format.bitsPerPixel / 8);
+			if (job.format.trueColour)
+				memcpy(out, row, (size_t)job.width * bpp);
+			else
+				for (x = 0; x < job.width; x++, out += 3)
+					memcpy(out, h->cmap.rgb[row[x]], 3);
+		}
+	}
+	else if (!current) {
+		job.width = h->thumb.tw;
+		job.height = h->thumb.th;
+		job.format.bitsPerPixel = 24;
+		job.pixels = malloc((size_t)job.width * job.height * 3);
+		if (job.pixels == NULL) {
+			metrics_reply(fd, "500 Internal Server Error", "text/plain", NULL, 0);
+			return -1;
+		}
+		memcpy(job.pixels, h->thumb.rgb, (size_t)job.width * job.height * 3);
+	}
+
+	pthread_mutex_lock(&thumb_lock);
+	if (thumb_njobs == THUMB_JOBS) {
+		pthread_mutex_unlock(&thumb_lock);
+		free(job.pixels);
+		metrics_reply(fd, "503 Service Unavailable", "text/plain", NULL, 0);
+		return -1;
+	}
+	thumb_jobs[thumb_njobs++] = job;
+	pthread_cond_broadcast(&thumb_cond);
+	pthread_mutex_unlock(&thumb_lock);
+	return 0;
+}
+
+/* Drops the queued requests for a head and waits for the one running */
+static void thumb_cleanup(struct head *h)
+{
+	int i;
+
+	pthread_mutex_lock(&thumb_lock);
+	for (i = 0; i < thumb_njobs; ) {
+		if (thumb_jobs[i].h != h) {
+			i++;
+			continue;
+		}
+		close(thumb_jobs[i].fd);
+		free(thumb_jobs[i].pixels);
+		memmove(thumb_jobs + i, thumb_jobs + i + 1, (--thumb_njobs - i) * sizeof(struct thumb_job));
+	}
+	while (thumb_busy == h)
+		pthread_cond_wait(&thumb_cond, &thumb_lock);
+	pthread_mutex_unlock(&thumb_lock);
+
+	free(h->thumb.rgb);
+	free(h->thumb.dirty);
+	free(h->thumb.thumb_png);
+	free(h->thumb.snap_png);
+}
+
+/*****************************************************************************/
+
+/* Downscaled screens. With -s 2,4 every head also serves the console at
+ * half and quarter resolution, on its port plus 100 times the factor, for
+ * viewers on thin links. The scaled shadows are updated only where the
+ * capture found damage, with a box filter, and pointer positions from
+ * their viewers are scaled back up before they are injected. */
+
+#define SCALED_PORT_STEP 100
+
+static int scaled_factors[SCALED_MAX];
+static int scaled_nfactors;
+static uint32_t *scaled_rows;
+static size_t scaled_rows_size;
+
+/* Per channel average of two pixels, rounding down. mask clears the
+ * lowest bit of every channel so nothing is shifted into the next. */
+static inline uint32_t scaled_avg(uint32_t a, uint32_t b, uint32_t mask)
+{
+	return (a & b) + (((a ^ b) & mask) >> 1);
+}
+
+static uint32_t scaled_mask(rfbPixelFormat *fmt)
+{
+	uint32_t low = (1U << fmt->redShift) | (1U << fmt->greenShift) | (1U << fmt->blueShift);
+
+	if (fmt->bitsPerPixel == 32)
+		low |= 0x01010101;
+	return ~low;
+}
+
+/* Box filters screen rect x1,y1 - x2,y2 of the shadow, in scaled pixels,
+ * into the scaled buffer. Each step halves a whole row or averages two
+ * whole rows, loops the compiler can vectorize. */
+static void scaled_box(struct head *h, struct scaled_screen *s, int x1, int y1, int x2, int y2)
+{
+	int f = s->factor, bpp = h->vncscr->serverFormat.bitsPerPixel / 8;
+	int n = x2 - x1, width = n * f, x, y, r, step, len;
+	uint32_t mask = scaled_mask(&h->vncscr->serverFormat);
+	size_t need = (size_t)width * f;
+	uint32_t *row, *other;
+	char *src, *dst;
+
+	if (need > scaled_rows_size) {
+		free(scaled_rows);
+		scaled_rows_size = need;
+		scaled_rows = malloc(need * sizeof(uint32_t));
+		assert(scaled_rows != NULL);
+	}
+
+	/* Averaging palette indices means nothing, take every f-th pixel */
+	if (bpp == 1) {
+		for (y = y1; y < y2; y++) {
+			src = h->vncscr->frameBuffer + y * f * h->vncscr->paddedWidthInBytes + x1 * f;
+			dst = s->buf + y * s->scr->width + x1;
+			for (x = 0; x < n; x++)
+				dst[x] = src[x * f];
+		}
+		return;
+	}
+
+	for (y = y1; y < y2; y++) {
+		/* Each of the f screen rows, halved until it is n wide */
+		for (r = 0; r < f; r++) {
+			row = scaled_rows + r * width;
+			src = h->vncscr->frameBuffer + (y * f + r) * h->vncscr->paddedWidthInBytes +
+			  x1 * f * bpp;
+			if (bpp == 4)
+				memcpy(row, src, width * sizeof(uint32_t));
+			else
+				for (x = 0; x < width; x++)
+					row[x] = ((uint16_t *)src)[x];
+			for (len = width / 2; len >= n; len /= 2)
+				for (x = 0; x < len; x++)
+					row[x] = scaled_avg(row[2 * x], row[2 * x + 1], mask);
+		}
+
+		/* Then the rows pairwise into the first */
+		for (step = 1; step < f; step *= 2) {
+			for (r = 0; r < f; r += 2 * step) {
+				row = scaled_rows + r * width;
+				other = scaled_rows + (r + step) * width;
+				for (x = 0; x < n; x++)
+					row[x] = scaled_avg(row[x], other[x], mask);
+			}
+		}
+
+		dst = s->buf + (y * s->scr->width + x1) * bpp;
+		if (bpp == 4)
+			memcpy(dst, scaled_rows, n * sizeof(uint32_t));
+		else
+			for (x = 0; x < n; x++)
+				((uint16_t *)dst)[x] = scaled_rows[x];
+	}
+}
+
+static void scaled_update(struct head *h, int x1, int y1, int x2, int y2)
+{
+	struct scaled_screen *s;
+	int i, sx1, sy1, sx2, sy2;
+
+	for (i = 0; i < h->nscaled; i++) {
+		s = &h->scaled[i];
+		if (s->scr == NULL)
+			continue;
+		sx1 = x1 / s->factor;
+		sy1 = y1 / s->factor;
+		sx2 = (x2 + s->factor - 1) / s->factor;
+		sy2 = (y2 + s->factor - 1) / s->factor;
+		if (sx2 > s->scr->width)
+			sx2 = s->scr->width;
+		if (sy2 > s->scr->height)
+			sy2 = s->scr->height;
+		if (sx1 >= sx2 || sy1 >= sy2)
+			continue;
+		scaled_box(h, s, sx1, sy1, sx2, sy2);
+		rfbMarkRectAsModified(s->scr, sx1, sy1, sx2, sy2);
+	}
+}
+
+static void scaled_ptrevent(int buttonMask, int x, int y, rfbClientPtr cl)
+{
+	struct head *h = cl->screen->screenData;
+	int i;
+
+	for (i = 0; i < h->nscaled; i++) {
+		if (h->scaled[i].scr == cl->screen) {
+			x = x * h->scaled[i].factor + h->scaled[i].factor / 2;
+			y = y * h->scaled[i].factor + h->scaled[i].factor / 2;
+			break;
+		}
+	}
+	ptrevent(buttonMask, x, y, cl);
+}
+
+static void scaled_open(struct head *h, struct scaled_screen *s)
+{
+	char *argv[2] = { "fbvncserver", NULL };
+	int argc = 1, bpp = h->vncscr->serverFormat.bitsPerPixel / 8;
+	int width = h->scrinfo.xres / s->factor, height = h->scrinfo.yres / s->factor;
+
+	s->buf = calloc((size_t)width * height, bpp);
+	assert(s->buf != NULL);
+	s->scr = rfbGetScreen(&argc, argv, width, height, 8, 3, bpp);
+	if (s->scr == NULL) {
+		free(s->buf);
+		s->buf = NULL;
+		return;
+	}
+	s->scr->serverFormat = h->vncscr->serverFormat;
+	if (!s->scr->serverFormat.trueColour)
+		cmap_attach(h, s->scr);
+	s->scr->screenData = h;
+	s->scr->desktopName = s->factor == 2 ? "Vircon Screen 1:2" :
+	  s->factor == 4 ? "Vircon Screen 1:4" : "Vircon Screen 1:8";
+	s->scr->frameBuffer = s->buf;
+	s->scr->alwaysShared = FALSE;
+	s->scr->port = h->port + SCALED_PORT_STEP * s->factor;
+	s->scr->listenInterface = vncaddr;
+	if (authmode == 1)
+		s->scr->authPasswdData = AUTHFILE;
+	s->scr->kbdAddEvent = keyevent;
+	s->scr->ptrAddEvent = scaled_ptrevent;
+	s->scr->displayHook = display_start;
+	s->scr->displayFinishedHook = display_finished;
+	s->scr->newClientHook = client_new;
+
+	rfbInitServer(s->scr);
+	if (s->scr->listenSock == -1) {
+		/* Still held by the server being upgraded, try again later */
+		rfbScreenCleanup(s->scr);
+		s->scr = NULL;
+		free(s->buf);
+		s->buf = NULL;
+		s->retry = now_seconds() + 1;
+		return;
+	}
+	printf("	scaled: 1:%d on port %d\n", s->factor, s->scr->port);
+	scaled_update(h, 0, 0, h->scrinfo.xres, h->scrinfo.yres);
+}
+
+/* Follows the size of the head, called whenever it is (re)initialized */
+static void scaled_setup(struct head *h)
+{
+	struct scaled_screen *s;
+	int i, width, height, bpp = h->vncscr->serverFormat.bitsPerPixel / 8;
+
+	if (h->nscaled == 0) {
+		h->nscaled = scaled_nfactors;
+		for (i = 0; i < h->nscaled; i++)
+			h->scaled[i].factor = scaled_factors[i];
+	}
+
+	for (i = 0; i < h->nscaled; i++) {
+		s = &h->scaled[i];
+		if (s->scr == NULL) {
+			scaled_open(h, s);
+			continue;
+		}
+		width = h->scrinfo.xres / s->factor;
+		height = h->scrinfo.yres / s->factor;
+		free(s->buf);
+		s->buf = calloc((size_t)width * height, bpp);
+		assert(s->buf != NULL);
+		rfbNewFramebuffer(s->scr, s->buf, width, height, 8, 3, bpp);
+		s->scr->serverFormat = h->vncscr->serverFormat;
+		if (!s->scr->serverFormat.trueColour)
+			cmap_attach(h, s->scr);
+	}
+	scaled_update(h, 0, 0, h->scrinfo.xres, h->scrinfo.yres);
+}
+
+static void scaled_retry(struct head *h)
+{
+	int i;
+
+	for (i = 0; i < h->nscaled; i++)
+		if (h->scaled[i].scr == NULL && now_seconds() >= h->scaled[i].retry)
+			scaled_open(h, &h->scaled[i]);
+}
+
+static int scaled_has_clients(struct head *h)
+{
+	int i;
+
+	for (i = 0; i < h->nscaled; i++)
+		if (h->scaled[i].scr != NULL && h->scaled[i].scr->clientHead != NULL)
+			return 1;
+	return 0;
+}
+
+/* The factors given with -s, as in "2,4" */
+static void scaled_parse(char *list)
+{
+	char *p;
+	int f;
+
+	for (p = strtok(list, ","); p != NULL; p = strtok(NULL, ",")) {
+		f = atoi(p);
+		if (f != 2 && f != 4 && f != 8) {
+			fprintf(stderr, "scale factor %s is not 2, 4 or 8, ignored\n", p);
+			continue;
+		}
+		if (scaled_nfactors == SCALED_MAX) {
+			fprintf(stderr, "only %d scale factors, %s ignored\n", SCALED_MAX, p);
+			continue;
+		}
+		scaled_factors[scaled_nfactors++] = f;
+	}
+}
+
+static void scaled_cleanup(struct head *h)
+{
+	int i;
+
+	for (i = 0; i < h->nscaled; i++) {
+		if (h->scaled[i].scr != NULL) {
+			rfbShutdownServer(h->scaled[i].scr, TRUE);
+			rfbScreenCleanup(h->scaled[i].scr);
+		}
+		free(h->scaled[i].buf);
+	}
+}
+
+/*****************************************************************************/
+
+/* Control socket. With -C path the server takes commands on a local unix
+ * socket, one per line, each answered with its output and a line "ok" or
+ * "error <reason>":
+ *   get [name]               print one or all settings
+ *   set name value           change a setting, it applies to the next frame
+ *   refresh [port [x y w h]] capture and send the screen, or a rect of it, again
+ *   clients                  list the viewers with their stats
+ *   calibrate [port]         time the scan layouts again and keep the fastest
+ * Each line is run as soon as it is complete, the connection is closed
+ * once the client shuts down its end, e.g. echo get | socat - UNIX:path. */
+
+static char *ctl_path = NULL;
+static int ctl_listenfd = -1;
+static struct conn_set ctl_conns;
+
+/* Settings given here win over the calibrated layout */
+static void ctl_rebands(void)
+{
+	struct head *h;
+
+	for (h = heads; h != NULL; h = h->next) {
+		h->scan_threads = h->scan_bands = 0;
+		setup_scan_bands(h);
+	}
+}
+
+static void ctl_threads(void)
+{
+	init_scan_workers();
+	ctl_rebands();
+}
+
+struct ctl_setting
+{
+	const char *name;
+	int *value;
+	int min, max;
+	void (*apply)(void);
+	const char *help;
+};
+
+static struct ctl_setting ctl_settings[] = {
+	{ "rate", &frame_rate, 1, 1000, NULL, "capture scans per second" },
+	{ "threads", &scan_threads, 0, 256, ctl_threads, "capture scan and encode threads, 0 is one per CPU" },
+	{ "inline", &scan_threshold, 0, INT_MAX, ctl_rebands, "scan frames smaller than this many pixels inline" },
+	{ "encode", &zrle_threshold, 0, INT_MAX, NULL, "encode ZRLE updates smaller than this many pixels inline" },
+	{ "bands", &scan_bands, 1, 64, ctl_rebands, "bands per scan thread a pooled scan uses" },
+	{ "zerocopy", &zc_threshold, 0, INT_MAX, NULL, "send Raw updates from this size directly, 0 is off" },
+	{ "mouse", &mousemode, 0, 1, NULL, "1 injects pointer events as mouse, 0 as touch" },
+	{ "compress", &client_compress_max, -1, 9, NULL, "highest zlib and tight compression level, -1 is the viewer's choice" },
+	{ "quality", &client_quality_max, -1, 9, NULL, "highest tight JPEG quality level, -1 is the viewer's choice" },
+	{ "budget", &encode_budget, 0, 10000, NULL, "percent of a CPU viewer updates may take, shared fairly, 0 is off" },
+	{ "translate", &xlate_enabled, 0, 1, NULL, "1 converts common viewer pixel formats with SSE2, 0 leaves it to libvncserver" },
+};
+
+#define CTL_NSETTINGS (int)(sizeof(ctl_settings) / sizeof(ctl_settings[0]))
+
+static struct ctl_setting *ctl_find(const char *name)
+{
+	int i;
+
+	for (i = 0; i < CTL_NSETTINGS; i++)
+		if (!strcmp(ctl_settings[i].name, name))
+			return &ctl_settings[i];
+	return NULL;
+}
+
+/* Forgets what the scan last saw of the rect, so it is copied and sent
+ * again even if it looks unchanged */
+static void ctl_refresh(struct head *h, int x, int y, int w, int ht)
+{
+	int bpp = h->scrinfo.bits_per_pixel / 8;
+	unsigned char *p;
+	int i, j;
+
+	if (x < 0) w += x, x = 0;
+	if (y < 0) ht += y, y = 0;
+	if (x + w > (int)h->scrinfo.xres) w = h->scrinfo.xres - x;
+	if (y + ht > (int)h->scrinfo.yres) ht = h->scrinfo.yres - y;
+	if (w <= 0 || ht <= 0)
+		return;
+
+	for (j = y; j < y + ht; j++) {
+		p = (unsigned char *)h->fbbuf + ((size_t)j * h->scrinfo.xres + x) * bpp;
+		for (i = 0; i < w * bpp; i++)
+			p[i] = ~p[i];
+	}
+	/* No page of it may have been written */
+	h->dirty.full = 1;
+	rfbMarkRectAsModified(h->vncscr, x, y, x + w, y + ht);
+}
+
+static void ctl_client(FILE *out, rfbClientPtr cl)
+{
+	struct client_data *cd = cl->clientData;
+	char name[64];
+	int compress = -1, quality = -1;
+
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+	compress = cl->zlibCompressLevel;
+	quality = cl->tightQualityLevel;
+#ifdef LIBVNCSERVER_HAVE_LIBJPEG
+	if (cl->preferredEncoding == rfbEncodingTight)
+		compress = cl->tightCompressLevel;
 #endif
-		    			break;
-				}
-	        		/* Looking in keytable for keys with shift */
-				kcode = get_key_sym(i,1);
-	        		if (kcode == code) {
-		    			scancode = i;
-#ifdef DEBUG
-		    			fprintf(stdout, "Search shifted\n");
 #endif
-		    			break;
-				}
-	    		}
+	fprintf(out, "port=%d host=%s encoding=%s bpp=%d compress=%d quality=%d "
+	  "translate=%s updates=%d bytes=%d raw_bytes=%d zerocopy=%d "
+	  "cpu=%.3f credit=%.4f deferred=%u\n",
+	  cl->screen->port, cl->host, encodingName(cl->preferredEncoding, name, sizeof(name)),
+	  cl->format.bitsPerPixel, compress, quality, xlate_name(cl),
+	  rfbStatGetMessageCountSent(cl, rfbFramebufferUpdate),
+	  rfbStatGetSentBytes(cl), rfbStatGetSentBytesIfRaw(cl),
+	  cd != NULL && cd->zc_enabled, cd != NULL ? cd->cpu_total : 0,
+	  cd != NULL ? cd->credit : 0, cd != NULL ? cd->deferred : 0);
+}
+
+static void ctl_clients(FILE *out)
+{
+	rfbClientIteratorPtr it;
+	rfbClientPtr cl;
+	struct head *h;
+	int i;
+
+	for (h = heads; h != NULL; h = h->next) {
+		it = rfbGetClientIterator(h->vncscr);
+		while ((cl = rfbClientIteratorNext(it)) != NULL)
+			ctl_client(out, cl);
+		rfbReleaseClientIterator(it);
+
+		for (i = 0; i < h->nscaled; i++) {
+			if (h->scaled[i].scr == NULL)
+				continue;
+			it = rfbGetClientIterator(h->scaled[i].scr);
+			while ((cl = rfbClientIteratorNext(it)) != NULL)
+				ctl_client(out, cl);
+			rfbReleaseClientIterator(it);
 		}
-    	}
+	}
+}
 
-    	return scancode;
+static void ctl_command(FILE *out, char *line)
+{
+	struct ctl_setting *set = NULL;
+	struct head *h;
+	char *argv[8], *save = NULL, *end;
+	int argc = 0, i, found;
+	long v;
+
+	for (argv[0] = strtok_r(line, " \t\r", &save); argv[argc] != NULL && argc < 7;
+	     argv[++argc] = strtok_r(NULL, " \t\r", &save))
+		;
+	if (argc == 0)
+		return;
+
+	if (!strcmp(argv[0], "get")) {
+		if (argc > 1 && (set = ctl_find(argv[1])) == NULL) {
+			fprintf(out, "error unknown setting %s\n", argv[1]);
+			return;
+		}
+		for (i = 0; i < CTL_NSETTINGS; i++)
+			if (argc == 1 || &ctl_settings[i] == set)
+				fprintf(out, "%s %d\t# %s\n", ctl_settings[i].name,
+				  *ctl_settings[i].value, ctl_settings[i].help);
+	}
+	else if (!strcmp(argv[0], "set")) {
+		if (argc != 3 || (set = ctl_find(argv[1])) == NULL) {
+			fprintf(out, "error usage: set name value\n");
+			return;
+		}
+		v = strtol(argv[2], &end, 10);
+		if (*end != '\0' || v < set->min || v > set->max) {
+			fprintf(out, "error %s takes %d to %d\n", set->name, set->min, set->max);
+			return;
+		}
+		*set->value = v;
+		if (set->apply != NULL)
+			set->apply();
+		fprintf(out, "%s %d\n", set->name, *set->value);
+	}
+	else if (!strcmp(argv[0], "refresh")) {
+		if (argc != 1 && argc != 2 && argc != 6) {
+			fprintf(out, "error usage: refresh [port [x y w h]]\n");
+			return;
+		}
+		found = 0;
+		for (h = heads; h != NULL; h = h->next) {
+			if (argc > 1 && h->port != atoi(argv[1]))
+				continue;
+			if (argc == 6)
+				ctl_refresh(h, atoi(argv[2]), atoi(argv[3]), atoi(argv[4]), atoi(argv[5]));
+			else
+				ctl_refresh(h, 0, 0, h->scrinfo.xres, h->scrinfo.yres);
+			found = 1;
+		}
+		if (!found) {
+			fprintf(out, "error no console on port %s\n", argv[1]);
+			return;
+		}
+	}
+	else if (!strcmp(argv[0], "clients"))
+		ctl_clients(out);
+	else if (!strcmp(argv[0], "calibrate")) {
+		for (h = heads; h != NULL; h = h->next) {
+			if (argc > 1 && h->port != atoi(argv[1]))
+				continue;
+			/* The scans timed found damage nobody saw */
+			scan_calibrate(h);
+			ctl_refresh(h, 0, 0, h->scrinfo.xres, h->scrinfo.yres);
+			fprintf(out, "port %d: %d threads, %d bands each\n", h->port,
+			  h->nthreads, h->nthreads > 1 ? h->nbands / h->nthreads : 1);
+		}
+	}
+	else if (!strcmp(argv[0], "detach") || !strcmp(argv[0], "attach")) {
+		/* Lets the vircon module be reloaded, the uevents attach again */
+		for (h = heads; h != NULL; h = h->next) {
+			if ((argc > 1 && h->port != atoi(argv[1])) || h->fb_source != FB_SRC_DEVICE)
+				continue;
+			if (argv[0][0] == 'd' && h->fbfd >= 0)
+				fb_detach(h);
+			else if (argv[0][0] == 'a' && h->fbfd < 0 && fb_attach(h) < 0) {
+				fprintf(out, "error cannot open %s\n", h->fb_device);
+				return;
+			}
+			fprintf(out, "port %d: %s %s\n", h->port, h->fb_device,
+			  h->fbfd >= 0 ? "attached" : "detached");
+		}
+	}
+	else if (!strcmp(argv[0], "help"))
+		fprintf(out, "get [name]\nset name value\nrefresh [port [x y w h]]\nclients\n"
+		  "calibrate [port]\ndetach [port]\nattach [port]\n");
+	else {
+		fprintf(out, "error unknown command %s\n", argv[0]);
+		return;
+	}
+	fprintf(out, "ok\n");
 }
 
-static void keyevent(rfbBool down, rfbKeySym key, rfbClientPtr cl)
+static int ctl_init(void)
 {
-	int scancode;
+	struct sockaddr_un un;
+	mode_t mask;
+	int ret;
+
+	if (ctl_path == NULL)
+		return 0;
+
+	memset(&un, 0, sizeof(un));
+	un.sun_family = AF_UNIX;
+	strncpy(un.sun_path, ctl_path, sizeof(un.sun_path) - 1);
+	unlink(ctl_path);
+
+	if ((ctl_listenfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
+		fprintf(stderr, "cannot listen on %s, %s\n", ctl_path, strerror(errno));
+		return -1;
+	}
+
+	/* The socket is created 0600, nobody else gets to connect first */
+	mask = umask(0177);
+	ret = bind(ctl_listenfd, (struct sockaddr *)&un, sizeof(un));
+	umask(mask);
+	if (ret < 0 || listen(ctl_listenfd, 4) < 0) {
+		fprintf(stderr, "cannot listen on %s, %s\n", ctl_path, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/* Runs the complete lines that came in, the rest waits for more */
+static void ctl_serve(struct conn *c, int eof)
+{
+	char *line, *nl, *reply = NULL;
+	size_t size, len;
+	FILE *out;
+
+	if ((out = open_memstream(&reply, &size)) == NULL)
+		return;
+	for (line = c->req; (nl = strchr(line, '\n')) != NULL; line = nl + 1) {
+		*nl = '\0';
+		ctl_command(out, line);
+	}
+	if (eof && *line)
+		ctl_command(out, line);
+	fclose(out);
+	conn_send(c, reply, size);
+
+	/* Keep the start of a command not complete yet */
+	len = strlen(line);
+	memmove(c->req, line, len + 1);
+	c->len = len;
+}
+
+static void ctl_poll(void)
+{
+	struct conn_set *set = &ctl_conns;
+	struct conn *c;
+	int i, ret;
+
+	conn_accept(set, ctl_listenfd);
+	for (i = 0; i < set->n; i++) {
+		c = &set->conns[i];
+		if (c->done || (ret = conn_recv(c)) == 0)
+			continue;
+
+		/* Complete lines are run right away, so a full buffer holds
+		 * one line too long */
+		if (ret < 0 && c->len == sizeof(c->req) - 1)
+			conn_send(c, strdup("error command too long\n"), 23);
+		else
+			ctl_serve(c, ret < 0);
+		if (ret < 0)
+			c->done = 1;
+	}
+	conn_finish(set);
+}
+
+static void ctl_cleanup(void)
+{
+	while (ctl_conns.n > 0)
+		conn_drop(&ctl_conns, 0);
+	if (ctl_listenfd < 0)
+		return;
+	close(ctl_listenfd);
+	unlink(ctl_path);
+}
+
+/*****************************************************************************/
+
+static struct head *head_new(void)
+{
+	struct head *h;
+
+	h = calloc(1, sizeof(struct head));
+	assert(h != NULL);
+
+	strcpy(h->fb_device, "/dev/fb0");
+	strcpy(h->kbd_device, "auto");
+	strcpy(h->touch_device, "auto");
+	h->port = VNC_PORT;
+	h->fbfd = h->kbdfd = h->touchfd = -1;
+	h->fbmmap = MAP_FAILED;
+	h->shm_listenfd = h->shm_memfd = -1;
+	h->rec.fd = -1;
+	h->damage.fd = -1;
+	metrics_init_head(h);
+
+	return h;
+}
 
+/* Open the framebuffer and input devices of a head */
+static int head_open(struct head *h)
+{
+	/* Input devices auto discovery (when using vircon) */
+	if ( strncmp("auto" ,h->kbd_device, 4) == 0 ) {
+		h->kbd_auto = 1;
+		if (find_evdev("vircon keyboard", h->kbd_device, sizeof(h->kbd_device)) == 0) {
 #ifdef DEBUG
-	fprintf(stdout, "Got keysym: %04x (state=%d)\n", (unsigned int)key, (int)down);
+			fprintf(stdout, "found vircon KBD device: %s\n",h->kbd_device);
+#endif
+		}
+	}
+
+	if ( strncmp("auto" ,h->touch_device, 4) == 0 ) {
+		h->touch_auto = 1;
+		if (find_evdev("vircon mouse", h->touch_device, sizeof(h->touch_device)) == 0) {
+#ifdef DEBUG
+			fprintf(stdout, "found vircon MOUSE device: %s\n",h->touch_device);	
 #endif
+		}
+	}
 
-	if ((scancode = keysym2scancode(down, key, cl))) {
-		injectKeyEvent(scancode, down);
+	/* A memory framebuffer may do without input */
+	if (fb_is_memory(h->fb_device)) {
+		if (!strncmp("auto" ,h->kbd_device, 4)) {
+			strcpy(h->kbd_device, "none");
+			h->kbd_auto = 0;
+		}
+		if (!strncmp("auto" ,h->touch_device, 4)) {
+			strcpy(h->touch_device, "none");
+			h->touch_auto = 0;
+		}
+	}
+
+	/* Bail out if autodetect failed */
+	if (!strncmp("auto" ,h->touch_device, 4) || !strncmp("auto" ,h->kbd_device, 4)) {
+		printf("Error. Could not detect mouse or keyboard device.");
+		return -1;
+	}
+
+	printf("Initializing framebuffer device  %s ...\n", h->fb_device);
+	if (init_fb(h) < 0)
+		return -1;
+	printf("Initializing keyboard device %s ...\n", h->kbd_device);
+	if (init_kbd(h) < 0)
+		return -1;
+	printf("Initializing touch device %s ...\n", h->touch_device);
+	if (init_touch(h) < 0)
+		return -1;
+
+	printf("Initializing VNC server:\n");
+	printf("	width:  %d\n", (int)h->scrinfo.xres);
+	printf("	height: %d\n", (int)h->scrinfo.yres);
+	printf("	bpp:    %d\n", (int)h->scrinfo.bits_per_pixel);
+	printf("	port:   %d\n", h->port);
+
+	return 0;
+}
+
+/* Everything besides the viewers that follows the damage of a frame */
+static void damage_notify(struct head *h, int x1, int y1, int x2, int y2, int keyframe)
+{
+	DTRACE_PROBE5(fbvncserver, damage, h->port, x1, y1, x2, y2);
+	shm_add_rect(h, x1, y1, x2, y2);
+	if (h->heat.count != NULL)
+		heat_add(h, x1, y1, x2, y2);
+	if (h->rec.fd >= 0 && !keyframe)
+		rec_rect(h, x1, y1, x2, y2);
+	if (h->thumb.dirty != NULL)
+		thumb_add(h, x1, y1, x2, y2);
+	if (h->nscaled > 0)
+		scaled_update(h, x1, y1, x2, y2);
+}
+
+static void head_free(struct head *h)
+{
+	int i;
+
+	if (h->vncscr != NULL) {
+		rfbShutdownServer(h->vncscr, TRUE);
+		rfbScreenCleanup(h->vncscr);
+	}
+	if (h->vncbuf != NULL)
+		shadow_free(h, h->vncbuf);
+	free(h->fbbuf);
+	for (i = 0; i < h->nbands; i++)
+		free(h->bands[i].rects);
+	free(h->bands);
+	free(h->dirty.bitmap);
+	free(h->dirty.rows);
+	free(h->heat.count);
+	free(h->heat.bytes);
+	rec_stop(h);
+	thumb_cleanup(h);
+	scaled_cleanup(h);
+
+	cleanup_fb(h);
+	cleanup_kbd(h);
+	cleanup_touch(h);
+	shm_cleanup(h);
+
+	free(h->shm_path);
+	free(h);
+}
+
+/* A recording head is captured whether anyone watches or not, and so is
+ * one whose thumbnail is being polled */
+static int head_has_clients(struct head *h)
+{
+	return h->vncscr->clientHead != NULL || h->shm_nclients > 0 || h->rec.fd >= 0 ||
+	  scaled_has_clients(h) ||
+	  (h->thumb.requested != 0 && now_seconds() - h->thumb.requested < THUMB_LINGER);
+}
+
+/* Bring the extra heads in line with the heads file. Each line reads
+ *   fb-device kbd-device touch-device port [shm-path]
+ * Heads whose line is unchanged keep running and keep their clients,
+ * heads no longer listed are stopped and new lines are started. The
+ * head given on the command line is never touched. */
+static void heads_load(char *prog)
+{
+	FILE *f;
+	char line[1024];
+	struct head *h, **hp, *added = NULL;
+	char *dummy_argv[2] = { prog, NULL };
+
+	if ((f = fopen(heads_file, "r")) == NULL) {
+		fprintf(stderr, "cannot open heads file %s, %s\n", heads_file, strerror(errno));
+		return;
+	}
+
+	for (h = heads->next; h != NULL; h = h->next)
+		h->listed = 0;
+
+	while (fgets(line, sizeof(line), f) != NULL) {
+		struct head *n;
+		char shm[256] = "";
+		int fields;
+
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+
+		n = head_new();
+		fields = sscanf(line, "%255s %255s %255s %d %255s", n->fb_device,
+		  n->kbd_device, n->touch_device, &n->port, shm);
+		if (fields < 4) {
+			fprintf(stderr, "%s: bad line: %s", heads_file, line);
+			free(n);
+			continue;
+		}
+		if (fields == 5)
+			n->shm_path = strdup(shm);
+
+		for (h = heads->next; h != NULL; h = h->next) {
+			if (!strcmp(h->fb_device, n->fb_device) &&
+			    !strcmp(h->kbd_device, n->kbd_device) &&
+			    !strcmp(h->touch_device, n->touch_device) &&
+			    h->port == n->port &&
+			    !strcmp(h->shm_path ? h->shm_path : "", shm))
+				break;
+		}
+		if (h != NULL) {
+			h->listed = 1;
+			free(n->shm_path);
+			free(n);
+			continue;
+		}
+		n->next = added;
+		added = n;
+	}
+	fclose(f);
+
+	/* Stop the removed heads first, a changed line may reuse their port */
+	hp = &heads->next;
+	while ((h = *hp) != NULL) {
+		if (h->listed) {
+			hp = &h->next;
+			continue;
+		}
+		printf("Removing head on port %d\n", h->port);
+		*hp = h->next;
+		head_free(h);
+	}
+
+	while ((h = added) != NULL) {
+		added = h->next;
+		if (head_open(h) < 0 || init_fb_server(h, 1, dummy_argv) < 0) {
+			fprintf(stderr, "cannot start head on port %d\n", h->port);
+			head_free(h);
+			continue;
+		}
+		h->listed = 1;
+		h->next = heads->next;
+		heads->next = h;
+	}
+}
+
+/*****************************************************************************/
+
+/* Hot re-attach. The kernel announces devices coming and going as uevents
+ * on a netlink socket. When the vircon device is unbound from its driver
+ * and bound again, its framebuffer and input devices are removed and added
+ * again, maybe under other numbers. A removed device is closed, and viewers
+ * keep the last screen. When it comes back it is opened again: input
+ * devices found by name are matched by name again, the others and the
+ * framebuffer by their node. The open framebuffer and damage ring pin the
+ * module, so reloading it takes a "detach" on the control socket first. */
+
+static int uevent_fd = -1;
+
+static void uevent_init(void)
+{
+	struct sockaddr_nl nl;
+
+	memset(&nl, 0, sizeof(nl));
+	nl.nl_family = AF_NETLINK;
+	nl.nl_groups = 1;	/* the kernel's, not udev's */
+
+	if ((uevent_fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+	    NETLINK_KOBJECT_UEVENT)) < 0 ||
+	    bind(uevent_fd, (struct sockaddr *)&nl, sizeof(nl)) < 0) {
+		fprintf(stderr, "cannot listen for uevents, devices are not re-attached, %s\n",
+		  strerror(errno));
+		if (uevent_fd >= 0)
+			close(uevent_fd);
+		uevent_fd = -1;
+	}
+}
+
+/* The value of key in a uevent, a list of "KEY=value" strings */
+static const char *uevent_get(const char *msg, size_t len, const char *key)
+{
+	size_t klen = strlen(key);
+	const char *p;
+
+	for (p = msg; p < msg + len; p += strlen(p) + 1)
+		if (!strncmp(p, key, klen) && p[klen] == '=')
+			return p + klen + 1;
+	return NULL;
+}
+
+static void uevent_input(const char *action, const char *node, const char *devpath)
+{
+	char path[PATH_MAX], name[256] = "";
+	struct head *h;
+
+	if (!strcmp(action, "remove")) {
+		for (h = heads; h != NULL; h = h->next) {
+			if (h->kbdfd >= 0 && !strcmp(h->kbd_device, node)) {
+				printf("Keyboard %s of port %d is gone\n", node, h->port);
+				cleanup_kbd(h);
+				h->kbdfd = -1;
+			}
+			if (h->touchfd >= 0 && !strcmp(h->touch_device, node)) {
+				printf("Touch device %s of port %d is gone\n", node, h->port);
+				cleanup_touch(h);
+				h->touchfd = -1;
+			}
+		}
+		return;
 	}
-}
+	if (strcmp(action, "add"))
+		return;
 
+	snprintf(path, sizeof(path), "/sys%s/device/name", devpath);
+	sysfs_read(path, name, sizeof(name));
 
-static void injectMoveEvent(int x, int y)
-{   
-    	struct input_event ev;
+	for (h = heads; h != NULL; h = h->next) {
+		if (h->kbdfd < 0 && (h->kbd_auto ? !strcmp(name, "vircon keyboard") :
+		    !strcmp(h->kbd_device, node))) {
+			strncpy(h->kbd_device, node, sizeof(h->kbd_device) - 1);
+			if (init_kbd(h) == 0)
+				printf("Keyboard %s of port %d is back\n", node, h->port);
+		}
+		if (h->touchfd < 0 && (h->touch_auto ? !strcmp(name, "vircon mouse") :
+		    !strcmp(h->touch_device, node))) {
+			strncpy(h->touch_device, node, sizeof(h->touch_device) - 1);
+			if (init_touch(h) == 0)
+				printf("Touch device %s of port %d is back\n", node, h->port);
+			else {
+				cleanup_touch(h);
+				h->touchfd = -1;
+			}
+		}
+	}
+}
 
-#ifdef DEBUG    
-    	fprintf(stdout, "handleMoveEvent (x=%d, y=%d)\n", x , y);    
-#endif
+/* Closes the framebuffer and its damage ring, viewers keep the last screen */
+static void fb_detach(struct head *h)
+{
+	cleanup_fb(h);
+	h->fbfd = -1;
+	h->fbmmap = MAP_FAILED;
+}
 
-    	if (xmax != 0 && ymax != 0) {
-        	x = xmin + (x * (xmax - xmin)) / (scrinfo.xres);
-        	y = ymin + (y * (ymax - ymin)) / (scrinfo.yres);
-    	}
-    
-    	memset(&ev, 0, sizeof(ev));
+static int fb_attach(struct head *h)
+{
+	if ((h->fbfd = open(h->fb_device, O_RDONLY)) == -1) {
+		fprintf(stderr, "cannot open fb device %s\n", h->fb_device);
+		return -1;
+	}
+	/* Maps it and sends every viewer the whole screen */
+	changeResolution(h);
+	return 0;
+}
 
-    	gettimeofday(&ev.time,0);
-    	ev.type = EV_ABS;
-    	ev.code = ABS_X;
-    	ev.value = x;
-    	if(write(touchfd, &ev, sizeof(ev)) < 0) {
-        	fprintf(stderr, "write event failed, %s\n", strerror(errno));
-    	}
+static void uevent_fb(const char *action, const char *node)
+{
+	struct head *h;
 
-    	gettimeofday(&ev.time,0);
-    	ev.type = EV_ABS;
-    	ev.code = ABS_Y;
-    	ev.value = y;
-    	if(write(touchfd, &ev, sizeof(ev)) < 0) {
-        	fprintf(stderr, "write event failed, %s\n", strerror(errno));
-    	}
+	for (h = heads; h != NULL; h = h->next) {
+		if (h->fb_source != FB_SRC_DEVICE || strcmp(h->fb_device, node))
+			continue;
 
-    	gettimeofday(&ev.time,0);
-    	ev.type = EV_SYN;
-    	ev.code = 0;
-    	ev.value = 0;
-    	if(write(touchfd, &ev, sizeof(ev)) < 0) {
-        	fprintf(stderr, "write event failed, %s\n", strerror(errno));
-    	}
+		if (!strcmp(action, "remove") && h->fbfd >= 0) {
+			printf("Framebuffer %s of port %d is gone\n", node, h->port);
+			fb_detach(h);
+		}
+		else if (!strcmp(action, "add") && h->fbfd < 0 && fb_attach(h) == 0)
+			printf("Framebuffer %s of port %d is back\n", node, h->port);
+	}
 }
 
-static void injectWheelEvent(int z, int x, int y)
+static void uevent_process(void)
 {
-    	struct input_event ev;
+	char msg[8192], node[PATH_MAX];
+	const char *action, *subsystem, *devname, *devpath;
+	ssize_t len;
 
-#ifdef DEBUG
-    	printf("handleTouchEvent (x=%d, y=%d, inc=%d)\n", x , y, z);    
-#endif
+	if (uevent_fd < 0)
+		return;
 
-    	// Move the pointer first 
-    	injectMoveEvent(x,y);
+	while ((len = recv(uevent_fd, msg, sizeof(msg) - 1, 0)) > 0) {
+		msg[len] = '\0';
+		action = uevent_get(msg, len, "ACTION");
+		subsystem = uevent_get(msg, len, "SUBSYSTEM");
+		devname = uevent_get(msg, len, "DEVNAME");
+		devpath = uevent_get(msg, len, "DEVPATH");
+		if (action == NULL || subsystem == NULL || devname == NULL || devpath == NULL)
+			continue;
+
+		snprintf(node, sizeof(node), "/dev/%s", devname);
+		if (!strcmp(subsystem, "input") && !strncmp(devname, "input/event", 11))
+			uevent_input(action, node, devpath);
+		else if (!strcmp(subsystem, "graphics") && !strncmp(devname, "fb", 2))
+			uevent_fb(action, node);
+	}
+}
 
-    	memset(&ev, 0, sizeof(ev));
+/*****************************************************************************/
 
-    	// Then send a BTN_XXXX
-    	gettimeofday(&ev.time,0);
-    	ev.type = EV_REL;
-    	ev.code = REL_WHEEL;
-    	ev.value = z;
-    	if(write(touchfd, &ev, sizeof(ev)) < 0) {
-        	fprintf(stderr, "write event failed, %s\n", strerror(errno));
-    	}
+/* Synthetic damage patterns, drawn into a synth: framebuffer before each
+ * scan and used by the capture benchmark (-B). A recorded pattern replays
+ * lines of "frame x y w h", as printed by scripts/fbvnc-damage-record.bt. */
 
-    	gettimeofday(&ev.time,0);
-    	ev.type = EV_SYN;
-    	ev.code = 0;
-    	ev.value = 0;
-    	if(write(touchfd, &ev, sizeof(ev)) < 0) {
-        	fprintf(stderr, "write event failed, %s\n", strerror(errno));
-    	}
+enum { SYNTH_STATIC, SYNTH_SCROLL, SYNTH_BLINK, SYNTH_FLIP, SYNTH_SPARSE, SYNTH_PATTERNS };
 
-#ifdef DEBUG
-    	fprintf(stdout, "injectWheelEvent (x=%d, y=%d, inc=%d)\n", x , y, z);    
-#endif
-}
+static const char *synth_names[SYNTH_PATTERNS] = {
+	"static", "scroll", "blink", "flip", "sparse"
+};
 
-static void injectTouchEvent(int down, int button, int x, int y)
+struct replay_rect
 {
-    	static const uint16_t map[] = { BTN_LEFT, BTN_MIDDLE, BTN_RIGHT, BTN_FORWARD, BTN_BACK};
-    	struct input_event ev;
+	unsigned int frame;
+	int x, y, w, h;
+};
 
-#ifdef DEBUG    
-    	fprintf(stdout, "handleTouchEvent (x=%d, y=%d, button=%d, down=%d)\n", x , y, button, down);    
-#endif
+static struct replay_rect *replay_rects;
+static int replay_nrects;
+static unsigned int replay_frames;
 
-    	memset(&ev, 0, sizeof(ev));
+static int synth_find(const char *name)
+{
+	int i;
 
-    	// Then send a BTN_XXXX
-    	gettimeofday(&ev.time,0);
-   	ev.type = EV_KEY;
-    	ev.code = map[button];
-    	ev.value = down;
-    	if(write(touchfd, &ev, sizeof(ev)) < 0) {
-       		fprintf(stderr, "write event failed, %s\n", strerror(errno));
-    	}
+	for (i = 0; i < SYNTH_PATTERNS; i++)
+		if (!strcmp(name, synth_names[i]))
+			return i;
+	return -1;
+}
 
-    	/* Move event also adds the SYN */
-    	injectMoveEvent(x,y);
+static uint32_t synth_random(void)
+{
+	static uint32_t state = 1;
 
-#ifdef DEBUG
-    	fprintf(stdout, "injectTouchEvent (x=%d, y=%d, down=%d)\n", x , y, down);    
-#endif
+	state = state * 1103515245 + 12345;
+	return state >> 8;
 }
 
-static int prev_x = 0;
-static int prev_y = 0;
-static int prev_buttonMask = 0;
-
-static void ptrevent(int buttonMask, int x, int y, rfbClientPtr cl)
+static void synth_fill(struct head *h, int x, int y, int w, int ht, uint32_t value)
 {
-	//printf("Got ptrevent: %04x (x=%d, y=%d)\n", buttonMask, x, y);
-	if((buttonMask & 1) != 0 && (prev_buttonMask & 1) == 0 ) {
-		// Simulate left mouse event as touch event
-		injectTouchEvent(1, 0, x, y);
-                prev_buttonMask = buttonMask;
-		return;
-	}
-	else if((prev_buttonMask & 1) != 0 && (buttonMask & 1) == 0 ) {
-		// Simulate left mouse event as touch event
-		injectTouchEvent(0, 0, x, y);
-                prev_buttonMask = buttonMask;
-		return;
-	}
-	if((buttonMask & 2) != 0 && (prev_buttonMask & 2) == 0 ) {
-		// Simulate middle mouse event as touch event
-		injectTouchEvent(1, 1, x, y);
-                prev_buttonMask = buttonMask;
-		return;
-	}
-	else if((prev_buttonMask & 2) != 0 && (buttonMask & 2) == 0 ) {
-		// Simulate middle mouse event as touch event
-		injectTouchEvent(0, 1, x, y);
-                prev_buttonMask = buttonMask;
-		return;
-	}
-	if((buttonMask & 4) != 0 && (prev_buttonMask & 4) == 0 ) {
-		// Simulate right mouse event as touch event
-		injectTouchEvent(1, 2, x, y);
-                prev_buttonMask = buttonMask;
-		return;
-	}
-	else if((prev_buttonMask & 4) != 0 && (buttonMask & 4) == 0 ) {
-		// Simulate right mouse event as touch event
-		injectTouchEvent(0, 2, x, y);
-                prev_buttonMask = buttonMask;
-		return;
-	}
-	if((buttonMask & 8) != 0 && (prev_buttonMask & 8) == 0 ) {
-		// Simulate right mouse event as touch event
-		//injectTouchEvent(1, 3, x, y);
-		injectWheelEvent(1, x, y);
-                prev_buttonMask = buttonMask;
-		return;
-	}
-	else if((prev_buttonMask & 8) != 0 && (buttonMask & 8) == 0 ) {
-		// Simulate right mouse event as touch event
-		//injectTouchEvent(0, 3, x, y);
-                prev_buttonMask = buttonMask;
-		return;
-	}
-	if((buttonMask & 16) != 0 && (prev_buttonMask & 16) == 0 ) {
-		// Simulate right mouse event as touch event
-		//injectTouchEvent(1, 4, x, y);
-		injectWheelEvent(-1, x, y);
-                prev_buttonMask = buttonMask;
-		return;
-	}
-	else if((prev_buttonMask & 16) != 0 && (buttonMask & 16) == 0 ) {
-		// Simulate right mouse event as touch event
-		//injectTouchEvent(0, 4, x, y);
-                prev_buttonMask = buttonMask;
-		return;
-	}
-
-	if (mousemode) {
-		// Simulate mouse movement
-     	   	if ( x != prev_x || y != prev_y ) {
-			injectMoveEvent(x,y);
-			prev_x = x;
-			prev_y = y;
+	int bpp = h->scrinfo.bits_per_pixel / 8;
+	int stride = h->scrinfo.xres * bpp;
+	unsigned char *p;
+	int i, j;
+
+	if (x < 0) w += x, x = 0;
+	if (y < 0) ht += y, y = 0;
+	if (x + w > (int)h->scrinfo.xres) w = h->scrinfo.xres - x;
+	if (y + ht > (int)h->scrinfo.yres) ht = h->scrinfo.yres - y;
+
+	for (j = 0; j < ht; j++) {
+		p = (unsigned char *)h->fbmmap + (y + j) * stride + x * bpp;
+		for (i = 0; i < w; i++, p += bpp) {
+			if (bpp == 1)
+				*p = value;
+			else if (bpp == 2)
+				*(uint16_t *)p = value;
+			else
+				*(uint32_t *)p = value;
 		}
 	}
 }
 
-static int readScreenInfo_m()
+/* A line of 8x16 glyph cells, about half of them inked */
+static void synth_text_line(struct head *h, int y)
 {
-	if (ioctl(fbfd, FBIOGET_VSCREENINFO, &scrinfo_m) != 0) {
-		fprintf(stderr, "ioctl error\n");
-		exit(EXIT_FAILURE);
+	int x, row;
+
+	synth_fill(h, 0, y, h->scrinfo.xres, 16, 0);
+	for (x = 0; x + 8 <= (int)h->scrinfo.xres; x += 8) {
+		if (synth_random() & 1)
+			continue;
+		for (row = 2; row < 14; row++)
+			synth_fill(h, x + 1, y + row, 6, 1,
+			  (synth_random() & 1) ? 0xffffffff : 0);
 	}
+}
 
-	if (scrinfo.xres != scrinfo_m.xres || 
-	    scrinfo.yres != scrinfo_m.yres ||
-	    scrinfo.bits_per_pixel != scrinfo_m.bits_per_pixel ) {
-		return 1;
+static void synth_step(struct head *h)
+{
+	unsigned int frame = h->synth_frame++;
+	int stride = h->scrinfo.xres * (h->scrinfo.bits_per_pixel / 8);
+	int i;
+
+	switch (h->synth_pattern) {
+	case SYNTH_SCROLL:
+		/* A console scrolling by one text line per frame */
+		memmove(h->fbmmap, (char *)h->fbmmap + 16 * stride,
+		  (h->scrinfo.yres - 16) * stride);
+		synth_text_line(h, h->scrinfo.yres - 16);
+		break;
+	case SYNTH_BLINK:
+		synth_fill(h, 64, 64, 8, 16, frame & 1 ? 0xffffffff : 0);
+		break;
+	case SYNTH_FLIP:
+		synth_fill(h, 0, 0, h->scrinfo.xres, h->scrinfo.yres,
+		  frame & 1 ? 0x55555555 : 0xaaaaaaaa);
+		break;
+	case SYNTH_SPARSE:
+		for (i = 0; i < 8; i++)
+			synth_fill(h, synth_random() % h->scrinfo.xres,
+			  synth_random() % h->scrinfo.yres, 24, 24, synth_random());
+		break;
+	case SYNTH_PATTERNS:
+		/* Replay */
+		for (i = 0; i < replay_nrects; i++)
+			if (replay_rects[i].frame == frame % replay_frames)
+				synth_fill(h, replay_rects[i].x, replay_rects[i].y,
+				  replay_rects[i].w, replay_rects[i].h, synth_random());
+		break;
 	}
-
-	return 0;
 }
 
-#define PIXEL_FB_TO_RFB(p,r,g,b) ((p>>r)&0x1f001f)|(((p>>g)&0x1f001f)<<5)|(((p>>b)&0x1f001f)<<10)
-
-static int update_screen(void)
+static int replay_load(const char *path)
 {
-	unsigned int *f, *c, *r;
-	int x, y, line_changed,lines_unchanged,changes_pending;
+	struct replay_rect r;
+	char line[256];
+	FILE *f;
 
-	/* Check if the framebuffer resolution was changed */
-	if (readScreenInfo_m()) {
-		return 3;  //screen changed
+	if ((f = fopen(path, "r")) == NULL) {
+		fprintf(stderr, "cannot open %s, %s\n", path, strerror(errno));
+		return -1;
 	}
-	
-	varblock.min_i = varblock.min_j = 9999;
-	varblock.max_i = varblock.max_j = -1;
 
-	f = (unsigned int *)fbmmap;        /* -> framebuffer         */
-	c = (unsigned int *)fbbuf;         /* -> compare framebuffer */
-	r = (unsigned int *)vncbuf;        /* -> remote framebuffer  */
+	free(replay_rects);
+	replay_rects = NULL;
+	replay_nrects = 0;
+	replay_frames = 1;
+
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (sscanf(line, "%u %d %d %d %d", &r.frame, &r.x, &r.y, &r.w, &r.h) != 5)
+			continue;
+		if ((replay_nrects & 1023) == 0) {
+			replay_rects = realloc(replay_rects, (replay_nrects + 1024) * sizeof(r));
+			assert(replay_rects != NULL);
+		}
+		replay_rects[replay_nrects++] = r;
+		if (r.frame >= replay_frames)
+			replay_frames = r.frame + 1;
+	}
+	fclose(f);
+
+	return replay_nrects > 0 ? 0 : -1;
+}
 
-	line_changed = 0;
+/*****************************************************************************/
 
-	for (y = 0; y < scrinfo.yres; y++)
-	{
-		/* Compare every 2 pixels at a time, assuming that changes are likely
-		 * in pairs. */
-		for (x = 0; x < scrinfo.xres; x += 2) {
-			unsigned int pixel = *f;
-
-			if (pixel != *c) {
-				*c = pixel;
-
-				line_changed = 1;
-				changes_pending = 1;
-				lines_unchanged = 0;
-
-				*r = PIXEL_FB_TO_RFB(pixel,
-				  varblock.r_offset, varblock.g_offset, varblock.b_offset);
-
-				if (x < varblock.min_i)
-					varblock.min_i = x;
-				else {
-					if (x > varblock.max_i)
-						varblock.max_i = x;
-
-					if (y > varblock.max_j)
-						varblock.max_j = y;
-					else if (y < varblock.min_j)
-						varblock.min_j = y;
-				}
-			}
+/* Capture benchmark. Runs the scan on synthetic framebuffers without a
+ * VNC server, for every pattern, a few resolutions and both depths, once
+ * inline and once split into bands on the worker pool. Bytes touched are
+ * the fb and compare buffer reads plus the compare and shadow buffer
+ * writes of changed words. */
 
-			f++, c++;
-			r++;
-		}
+#define BENCH_FRAMES 100
 
-		if (!line_changed)
-			lines_unchanged++;
+static void bench_run(struct head *h, const char *pattern, int banded)
+{
+	struct timespec t0, t1;
+	uint64_t ns, words = 0, rects = 0;
+	size_t size = h->fbmmap_size;
+	char geometry[32];
+	int f, b;
+
+	scan_threshold = banded ? 0 : INT_MAX;
+	setup_scan_bands(h);
+	if (banded && h->nbands == 1)
+		return;
 
-		if (lines_unchanged > 5 && changes_pending) {
-			rfbMarkRectAsModified(vncscr, varblock.min_i, varblock.min_j,
-                  				varblock.max_i + 2, varblock.max_j + 1);
-			changes_pending = 0;
-			varblock.min_i = varblock.min_j = 9999;
-			varblock.max_i = varblock.max_j = -1;
+	memset(h->fbbuf, 0, size);
+	synth_step(h);
+	scan_frame(h);
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (f = 0; f < BENCH_FRAMES; f++) {
+		synth_step(h);
+		scan_frame(h);
+		for (b = 0; b < h->nbands; b++) {
+			rects += h->bands[b].nrects;
+			words += h->bands[b].changed;
 		}
 	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	/* The drawing is timed too, subtract it */
+	ns = (t1.tv_sec - t0.tv_sec) * 1000000000ULL + t1.tv_nsec - t0.tv_nsec;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (f = 0; f < BENCH_FRAMES; f++)
+		synth_step(h);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	ns -= (t1.tv_sec - t0.tv_sec) * 1000000000ULL + t1.tv_nsec - t0.tv_nsec;
+
+	snprintf(geometry, sizeof(geometry), "%dx%dx%d",
+	  h->scrinfo.xres, h->scrinfo.yres, h->scrinfo.bits_per_pixel);
+	printf("%-10s %-14s %-8s %12llu %14llu %8.1f\n", pattern, geometry,
+	  banded ? "bands" : "inline",
+	  (unsigned long long)(ns / BENCH_FRAMES),
+	  (unsigned long long)(2 * size + words * 4 * 2 / BENCH_FRAMES),
+	  (double)rects / BENCH_FRAMES);
+}
 
-	if (varblock.min_i < 9999) {
-		if (varblock.max_i < 0)
-			varblock.max_i = varblock.min_i;
-
-		if (varblock.max_j < 0)
-			varblock.max_j = varblock.min_j;
-
-#ifdef DEBUG
-		fprintf(stderr, "Dirty page: %dx%d+%d+%d...\n",
-		  (varblock.max_i+2) - varblock.min_i, (varblock.max_j+1) - varblock.min_j,
-		  varblock.min_i, varblock.min_j);
-#endif
-		rfbMarkRectAsModified(vncscr, varblock.min_i, varblock.min_j,
-		  varblock.max_i + 2, varblock.max_j + 1);
+static int bench(char *patterns)
+{
+	static const int sizes[][2] = { { 640, 480 }, { 1280, 1024 }, { 1920, 1080 }, { 3840, 2160 } };
+	static const int depths[] = { 16, 32 };
+	char *name, *save = NULL;
+	struct head *h;
+	unsigned int s, d;
+	int p, threshold = scan_threshold;
+
+	init_scan_workers();
+
+	printf("%-10s %-14s %-8s %12s %14s %8s\n", "pattern", "geometry", "strategy",
+	  "ns/frame", "bytes/frame", "rects");
+
+	for (name = strtok_r(patterns, ",", &save); name != NULL;
+	     name = strtok_r(NULL, ",", &save)) {
+		if (!strncmp(name, "replay:", 7)) {
+			if (replay_load(name + 7) < 0)
+				return -1;
+			p = SYNTH_PATTERNS;
+		}
+		else if (!strcmp(name, "all")) {
+			p = -1;
+		}
+		else if ((p = synth_find(name)) < 0) {
+			fprintf(stderr, "unknown pattern %s\n", name);
+			return -1;
+		}
 
-		rfbProcessEvents(vncscr, 10000);
+		for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+			for (d = 0; d < sizeof(depths) / sizeof(depths[0]); d++) {
+				int first = p < 0 ? SYNTH_SCROLL : p;
+				int last = p < 0 ? SYNTH_PATTERNS - 1 : p;
+				int q;
+
+				for (q = first; q <= last; q++) {
+					h = head_new();
+					snprintf(h->fb_device, sizeof(h->fb_device), "synth:%dx%dx%d",
+					  sizes[s][0], sizes[s][1], depths[d]);
+					if (init_fb(h) < 0)
+						return -1;
+					h->synth_pattern = q;
+					h->fbbuf = malloc(h->fbmmap_size);
+					h->vncbuf = shadow_alloc(h, h->fbmmap_size);
+					assert(h->fbbuf != NULL && h->vncbuf != NULL);
+					setup_varblock(h);
+
+					bench_run(h, q == SYNTH_PATTERNS ? "replay" : synth_names[q], 0);
+					bench_run(h, q == SYNTH_PATTERNS ? "replay" : synth_names[q], 1);
+
+					head_free(h);
+				}
+			}
+		}
 	}
 
+	scan_threshold = threshold;
 	return 0;
 }
 
 /*****************************************************************************/
 void sig_handler(int signo)
 {
+	struct head *h;
+
   	if (signo == SIGINT || signo == SIGTERM) {
     		printf("received SIGNAL\n");
 		shutdown_set = 1;
-		if (vncscr->clientHead == NULL) {
-			remove_pid();
-			exit(0);
+		for (h = heads; h != NULL; h = h->next)
+			if (h->vncscr != NULL && (h->vncscr->clientHead != NULL || h->rec.fd >= 0))
+				return;
+		for (h = heads; h != NULL; h = h->next)
+			shm_cleanup(h);
+		metrics_cleanup();
+		ctl_cleanup();
+		remove_pid();
+		exit(0);
+	}
+	if (signo == SIGHUP)
+		heads_reload_set = 1;
+	if (signo == SIGUSR1)
+		heat_dump_set = 1;
+	if (signo == SIGUSR2)
+		upgrade_set = 1;
+}
+
+/* Wait for the next frame, or for input on any head's sockets */
+static void wait_events(int usec)
+{
+	struct head *h;
+	struct timeval tv;
+	fd_set fds, wfds;
+	int maxfd = -1, i;
+
+	FD_ZERO(&fds);
+	FD_ZERO(&wfds);
+	for (h = heads; h != NULL; h = h->next) {
+		rfbScreenInfoPtr scr = h->vncscr;
+		int fd;
+
+		for (fd = 0; fd <= scr->maxFd; fd++)
+			if (FD_ISSET(fd, &scr->allFds))
+				FD_SET(fd, &fds);
+		if (scr->maxFd > maxfd)
+			maxfd = scr->maxFd;
+
+		if (scr->httpListenSock >= 0) {
+			FD_SET(scr->httpListenSock, &fds);
+			if (scr->httpListenSock > maxfd)
+				maxfd = scr->httpListenSock;
+		}
+		if (scr->httpSock >= 0) {
+			FD_SET(scr->httpSock, &fds);
+			if (scr->httpSock > maxfd)
+				maxfd = scr->httpSock;
+		}
+		if (h->shm_listenfd >= 0) {
+			FD_SET(h->shm_listenfd, &fds);
+			if (h->shm_listenfd > maxfd)
+				maxfd = h->shm_listenfd;
 		}
+		for (i = 0; i < h->nscaled; i++) {
+			if ((scr = h->scaled[i].scr) == NULL)
+				continue;
+			for (fd = 0; fd <= scr->maxFd; fd++)
+				if (FD_ISSET(fd, &scr->allFds))
+					FD_SET(fd, &fds);
+			if (scr->maxFd > maxfd)
+				maxfd = scr->maxFd;
+		}
+	}
+	conn_select(&metrics_conns, metrics_listenfd, &fds, &wfds, &maxfd);
+	conn_select(&ctl_conns, ctl_listenfd, &fds, &wfds, &maxfd);
+	if (uevent_fd >= 0) {
+		FD_SET(uevent_fd, &fds);
+		if (uevent_fd > maxfd)
+			maxfd = uevent_fd;
+	}
+
+	tv.tv_sec = usec / 1000000;
+	tv.tv_usec = usec % 1000000;
+	select(maxfd + 1, &fds, &wfds, NULL, &tv);
+
+	budget_schedule();
+	for (h = heads; h != NULL; h = h->next) {
+		rfbProcessEvents(h->vncscr, 0);
+		for (i = 0; i < h->nscaled; i++)
+			if (h->scaled[i].scr != NULL)
+				rfbProcessEvents(h->scaled[i].scr, 0);
+		scaled_retry(h);
+		shm_accept(h);
 	}
+	metrics_poll();
+	ctl_poll();
+	uevent_process();
 }
 
 /*****************************************************************************/
@@ -928,12 +7599,37 @@ void print_usage(char **argv)
 	fprintf(stdout, "%s [-k device] [-t device] [-h]\n"
 		"-k device: keyboard device node, default is autodetect 'vircon keyboard'\n"
 		"-t device: touch device node, default is autodetect 'vircon mouse'\n"
-		"-f device: fb device node, default is /dev/fb0\n"
+		"-f device: fb device node, default is /dev/fb0, or memfd:WxHxD,\n"
+		"           file:path:WxHxD or synth:WxHxD[:pattern] with D 8, 16 or 32\n"
 		"-m : mouse/touch mode, default is touch\n"
 		"-w : web server mode, default is off (Root is /.vnc-webclient)\n"
+		"-c file: TLS certificate for wss:// WebSocket viewers\n"
+		"-K file: TLS key for wss:// WebSocket viewers, default is the certificate\n"
 		"-l : only offer connections on localhost interface, default is all\n"
 		"-d : don't become daemon process, run in foreground\n"
-		"-H : print this help\n",argv[0]);
+		"-T threads: capture scan and encode threads, default is one per CPU\n"
+		"-j pixels: scan frames smaller than this inline, default is %d\n"
+		"-Z pixels: encode ZRLE updates smaller than this inline, default is %d\n"
+		"-S threads,bands|off: scan with this many threads and bands per thread, or with\n"
+		"                      -T and -j, instead of timing the layouts at startup\n"
+		"-r rate: capture scans per second, default is %d\n"
+		"-u path: serve the framebuffer to local consumers on this unix socket\n"
+		"-z bytes: send Raw updates from this size directly, 0 is off, default is %d\n"
+		"-E percent: CPU time, in percent of one CPU, viewer updates may take, split\n"
+		"            fairly between viewers, default is no limit\n"
+		"-U fd: take over from a running server, used by the SIGUSR2 upgrade\n"
+		"-X file: serve more consoles, one 'fb kbd touch port [shm-path]' per line,\n"
+		"         re-read on SIGHUP\n"
+		"-M port|path: serve metrics for Prometheus on this localhost port or unix socket\n"
+		"-C path: take commands to change settings and refresh on this unix socket\n"
+		"-L count: measure input latency with this many key presses on the primary console, then exit\n"
+		"-P dir: count damage per tile, SIGUSR1 writes a heatmap to dir\n"
+		"-R dir: record every console with its input to a file in dir\n"
+		"-s factors: also serve every console scaled down by these factors (2, 4, 8),\n"
+		"            on its port plus 100 times the factor\n"
+		"-B patterns: benchmark the capture scan on synthetic framebuffers and exit,\n"
+		"             patterns are all, scroll, blink, flip, sparse or replay:file\n"
+		"-H : print this help\n",argv[0], scan_threshold, zrle_threshold, frame_rate, zc_threshold);
 }
 
 int main(int argc, char **argv)
@@ -941,6 +7637,17 @@ int main(int argc, char **argv)
 	int daemonize = 1;
 	/*Per default: listen on all adresses*/
 	char vnc_ip_addr[64] = "0.0.0.0";
+	char *bench_patterns = NULL;
+	struct head *h;
+
+	heads = head_new();
+
+	/* Kept for the SIGUSR2 upgrade, rfbGetScreen() reorders argv */
+	upgrade_argv = calloc(argc + 1, sizeof(char *));
+	assert(upgrade_argv != NULL);
+	memcpy(upgrade_argv, argv, argc * sizeof(char *));
+	if (strchr(argv[0], '/') == NULL || realpath(argv[0], upgrade_exe) == NULL)
+		strncpy(upgrade_exe, argv[0], sizeof(upgrade_exe) - 1);
 
 	if(argc > 1) {
 		int i=1;
@@ -969,15 +7676,99 @@ int main(int argc, char **argv)
 						break;
 					case 'k':
 						i++;
-						strcpy(KBD_DEVICE, argv[i]);
+						strncpy(heads->kbd_device, argv[i], sizeof(heads->kbd_device) - 1);
 						break;
 					case 't':
 						i++;
-						strcpy(TOUCH_DEVICE, argv[i]);
+						strncpy(heads->touch_device, argv[i], sizeof(heads->touch_device) - 1);
 						break;
 					case 'f':
 						i++;
-						strcpy(FB_DEVICE, argv[i]);
+						strncpy(heads->fb_device, argv[i], sizeof(heads->fb_device) - 1);
+						break;
+					case 'c':
+						i++;
+						ws_certfile = argv[i];
+						break;
+					case 'K':
+						i++;
+						ws_keyfile = argv[i];
+						break;
+					case 'T':
+						i++;
+						scan_threads = atoi(argv[i]);
+						break;
+					case 'j':
+						i++;
+						scan_threshold = atoi(argv[i]);
+						break;
+					case 'Z':
+						i++;
+						zrle_threshold = atoi(argv[i]);
+						break;
+					case 'u':
+						i++;
+						heads->shm_path = strdup(argv[i]);
+						break;
+					case 'U':
+						i++;
+						upgrade_fd = atoi(argv[i]);
+						break;
+					case 'M':
+						i++;
+						metrics_addr = argv[i];
+						break;
+					case 'L':
+						i++;
+						lat_test_count = atoi(argv[i]);
+						break;
+					case 'P':
+						i++;
+						heat_dir = argv[i];
+						break;
+					case 'B':
+						i++;
+						bench_patterns = argv[i];
+						break;
+					case 'R':
+						i++;
+						rec_dir = argv[i];
+						break;
+					case 's':
+						i++;
+						scaled_parse(argv[i]);
+						break;
+					case 'X':
+						i++;
+						heads_file = argv[i];
+						break;
+					case 'C':
+						i++;
+						ctl_path = argv[i];
+						break;
+					case 'S':
+						i++;
+						if (!strcmp(argv[i], "off"))
+							scan_calibration = 0;
+						else if (sscanf(argv[i], "%d,%d", &scan_fixed_threads, &scan_fixed_bands) != 2 ||
+						    scan_fixed_threads < 1 || scan_fixed_bands < 1) {
+							fprintf(stderr, "-S wants threads,bands or off\n");
+							exit(1);
+						}
+						break;
+					case 'z':
+						i++;
+						zc_threshold = atoi(argv[i]);
+						break;
+					case 'E':
+						i++;
+						encode_budget = atoi(argv[i]);
+						break;
+					case 'r':
+						i++;
+						frame_rate = atoi(argv[i]);
+						if (frame_rate <= 0)
+							frame_rate = 10;
 						break;
 					case 'p':
 						i++;
@@ -994,54 +7785,27 @@ int main(int argc, char **argv)
 		}
 	}
 
+	if (bench_patterns != NULL)
+		exit(bench(bench_patterns) < 0 ? 1 : 0);
+
 	if (signal(SIGINT, sig_handler) == SIG_ERR)
 		printf("can't catch SIGINT\n");
 	if (signal(SIGTERM, sig_handler) == SIG_ERR)
 		printf("can't catch SIGTERM\n");
 	if (signal(SIGKILL, sig_handler) == SIG_ERR)
 		printf("can't catch SIGKILL\n");
+	if (signal(SIGHUP, sig_handler) == SIG_ERR)
+		printf("can't catch SIGHUP\n");
+	if (signal(SIGUSR1, sig_handler) == SIG_ERR)
+		printf("can't catch SIGUSR1\n");
+	if (signal(SIGUSR2, sig_handler) == SIG_ERR)
+		printf("can't catch SIGUSR2\n");
 
-	/* Input devices auto discovery (when using vircon) */
-	if ( strncmp("auto" ,KBD_DEVICE, 4) == 0 ) {
-		int devnum = 0;
-		devnum = find_evdev("vircon keyboard");
-		if ( devnum ) {
-			sprintf(KBD_DEVICE,"/dev/input/event%i", devnum);
-#ifdef DEBUG
-			fprintf(stdout, "found vircon KBD device: %s\n",KBD_DEVICE);
-#endif
-		}
-	}
-
-	if ( strncmp("auto" ,TOUCH_DEVICE, 4) == 0 ) {
-		int devnum = 0;
-		devnum = find_evdev("vircon mouse");
-		if ( devnum ) {
-			sprintf(TOUCH_DEVICE,"/dev/input/event%i", devnum);
-#ifdef DEBUG
-			fprintf(stdout, "found vircon MOUSE device: %s\n",TOUCH_DEVICE);	
-#endif
-		}
-	}
+	if (upgrade_fd >= 0)
+		upgrade_receive();
 
-	/* Bail out if autodetect failed */
-	if (!strncmp("auto" ,TOUCH_DEVICE, 4) || !strncmp("auto" ,KBD_DEVICE, 4)) {
-		printf("Error. Could not detect mouse or keyboard device.");
+	if (head_open(heads) < 0)
 		exit(1);
-	}
-
-	printf("Initializing framebuffer device  %s ...\n", FB_DEVICE);
-	init_fb();
-	printf("Initializing keyboard device %s ...\n", KBD_DEVICE);
-	init_kbd();
-	printf("Initializing touch device %s ...\n", TOUCH_DEVICE);
-	init_touch();
-
-	printf("Initializing VNC server:\n");
-	printf("	width:  %d\n", (int)scrinfo.xres);
-	printf("	height: %d\n", (int)scrinfo.yres);
-	printf("	bpp:    %d\n", (int)scrinfo.bits_per_pixel);
-	printf("	port:   %d\n", (int)VNC_PORT);
 
 	vncaddr = inet_addr(vnc_ip_addr);
 	printf("	addr:   %s\n", vnc_ip_addr);
@@ -1065,29 +7829,85 @@ int main(int argc, char **argv)
 		signal(SIGPIPE, SIG_IGN);
 	}
 
-	init_fb_server(argc, argv);
+	rfbRegisterProtocolExtension(&cu_extension);
+	init_scan_workers();
+	thumb_init();
+
+	if (init_fb_server(heads, argc, argv) < 0)
+		exit(1);
+	if (metrics_init() < 0 || ctl_init() < 0)
+		exit(1);
+	uevent_init();
+	write_pid();
+
+	if (heads_file != NULL)
+		heads_load(argv[0]);
+	if (upgrade_fd >= 0)
+		upgrade_finish();
+	if (lat_test_count > 0 && latency_test_start(heads) < 0) {
+		fprintf(stderr, "cannot start latency test, %s\n", strerror(errno));
+		exit(1);
+	}
 
 	/* Implement our own event loop to detect changes in the framebuffer. */
 	while (!shutdown_set) {
-		while (vncscr->clientHead == NULL)
-			rfbProcessEvents(vncscr, 100000);
+		int active = 0;
+
+		if (heat_dump_set) {
+			heat_dump_set = 0;
+			for (h = heads; h != NULL; h = h->next)
+				heat_dump(h);
+		}
+
+		if (upgrade_set) {
+			upgrade_set = 0;
+			hot_upgrade();
+		}
+
+		if (heads_reload_set) {
+			heads_reload_set = 0;
+			if (heads_file != NULL)
+				heads_load(argv[0]);
+		}
+
+		if (lat_test_count > 0)
+			latency_test_step(heads);
 
-		rfbProcessEvents(vncscr, 100000);
-		if (update_screen() == 3) {
-			/* Resolution or color scheme changed */
+		for (h = heads; h != NULL; h = h->next)
+			active |= head_has_clients(h);
+
+		if (!active) {
+			wait_events(100000);
+			continue;
+		}
+
+		wait_events(1000000 / frame_rate);
+
+		for (h = heads; h != NULL; h = h->next) {
+			if (!head_has_clients(h))
+				continue;
+			if (h->fb_source == FB_SRC_SYNTH)
+				synth_step(h);
+			if (update_screen(h) == 3) {
+				/* Resolution or color scheme changed */
 #ifdef DEBUG
-			fprintf(stdout, "VNC server needs re-init()\n");	
+				fprintf(stdout, "VNC server needs re-init()\n");	
 #endif
-			changeResolution();
+				changeResolution(h);
+			}
 		}
 	}
 
-	rfbShutdownServer(vncscr ,TRUE);
-
 	printf("Cleaning up...\n");
-	cleanup_fb();
-	cleanup_kbd();
-	cleanup_touch();
+	while ((h = heads) != NULL) {
+		heads = h->next;
+		head_free(h);
+	}
+	if (kfd != -1)
+		close(kfd);
+	metrics_cleanup();
+	ctl_cleanup();
+	xlate_cleanup();
 
 	remove_pid();
 }
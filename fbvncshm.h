@@ -0,0 +1,84 @@
+/*
+ * fbvncshm.h
+ * This file is part of the vircon virtual console driver and service.
+ * Copyright (C) 2015 Dirk Herrendoerfer
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * Local shared-memory transport of fbvncserver (-u path).
+ *
+ * A local consumer connects to the SOCK_SEQPACKET unix socket and first
+ * receives a hello message carrying a read-only memfd of the shadow
+ * framebuffer in an SCM_RIGHTS control message. It maps it with
+ * mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0). Every following damage
+ * message lists the rects that changed in the capture with that frame
+ * sequence number; the first one after a hello covers the whole screen.
+ * A new hello (and a new memfd) is sent whenever the resolution changes.
+ * A consumer that falls behind gets a whole-screen rect once it catches up.
+ */
+
+#ifndef FBVNCSHM_H
+#define FBVNCSHM_H
+
+#include <stdint.h>
+
+#define FBVNC_SHM_MAGIC		0x76636d73	/* "vcms" */
+#define FBVNC_SHM_VERSION	1
+#define FBVNC_SHM_MAX_RECTS	256
+
+enum {
+	FBVNC_SHM_HELLO = 1,
+	FBVNC_SHM_DAMAGE = 2,
+};
+
+struct fbvnc_shm_header {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t type;
+	uint64_t seq;
+};
+
+/* Pixel layout of the mapping, as in an RFB PixelFormat */
+struct fbvnc_shm_hello {
+	struct fbvnc_shm_header hdr;
+	uint32_t width;
+	uint32_t height;
+	uint32_t stride;
+	uint32_t size;
+	uint8_t bits_per_pixel;
+	uint8_t depth;
+	uint8_t true_colour;
+	uint8_t pad;
+	uint16_t red_max;
+	uint16_t green_max;
+	uint16_t blue_max;
+	uint8_t red_shift;
+	uint8_t green_shift;
+	uint8_t blue_shift;
+	uint8_t pad2;
+};
+
+struct fbvnc_shm_rect {
+	uint16_t x;
+	uint16_t y;
+	uint16_t w;
+	uint16_t h;
+};
+
+/* Only the first nrects entries are sent */
+struct fbvnc_shm_damage {
+	struct fbvnc_shm_header hdr;
+	uint32_t nrects;
+	uint32_t pad;
+	struct fbvnc_shm_rect rects[FBVNC_SHM_MAX_RECTS];
+};
+
+#endif /* FBVNCSHM_H */
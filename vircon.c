@@ -24,12 +24,24 @@
 #include <linux/string.h>
 #include <linux/mm.h>
 #include <linux/vmalloc.h>
+#include <linux/mutex.h>
 #include <linux/delay.h>
 #include <linux/interrupt.h>
 #include <linux/platform_device.h>
 
 #include <linux/fb.h>
 #include <linux/init.h>
+#include <linux/bitmap.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/uaccess.h>
+#include <linux/version.h>
+#include <linux/log2.h>
+#include <linux/miscdevice.h>
+#include <linux/poll.h>
+#include <linux/wait.h>
+
+#include "vircon.h"
 
 struct input_dev *virmouse_input_dev;
 static struct platform_device *virmouse_dev; /* Device structure */
@@ -38,60 +50,143 @@ struct input_dev *virkbd_input_dev;
 static struct platform_device *virkbd_dev;
 
 /*
- *  RAM we reserve for the frame buffer. This defines the maximum screen
- *  size
+ *  RAM the frame buffer may grow to. This defines the maximum screen
+ *  size, only the pages the current mode needs are allocated
  *
  *  The default can be overridden if the driver is compiled as a module
  */
 
-#define VIDEOMEMSIZE	(4*1024*1024)	/* 2 MB */
+#define VIDEOMEMSIZE	(32*1024*1024)	/* 3840x2160 at 32 bpp */
 
 static void *videomemory;
 static u_long videomemorysize = VIDEOMEMSIZE;
 module_param(videomemorysize, ulong, 0);
 
+/*
+ *  Deferred I/O: track the pages written, see vircon.h. The delay is how
+ *  long a written page stays writable before it is protected again.
+ */
+static bool deferred_io = 0;
+module_param(deferred_io, bool, 0);
+static int deferred_io_delay = 20;	/* ms */
+module_param(deferred_io_delay, int, 0);
+
+/*
+ *  Records the damage ring device holds, rounded up to a power of two
+ */
+static uint damage_ring_size = 4096;
+module_param(damage_ring_size, uint, 0);
+
 /**********************************************************************
  *
  * Memory management
  *
  **********************************************************************/
-static void *rvmalloc(unsigned long size)
+
+/*
+ *  The frame buffer is an array of pages, mapped into the kernel with
+ *  vmap() for the console, and into mmap users one page at a time as
+ *  they touch them. vircon_resize() grows or shrinks it to the mode.
+ *  Pages past the end of a smaller mode are unmapped from every program
+ *  first, the next touch faults again.
+ */
+static struct page **vircon_page;
+static unsigned long vircon_npages;	/* allocated */
+static DEFINE_MUTEX(vircon_mem_lock);
+/* The fb device node last mapped, held for vircon_resize() */
+static struct inode *vircon_inode;
+#if defined(CONFIG_FB_DEFERRED_IO) && LINUX_VERSION_CODE < KERNEL_VERSION(5, 18, 0)
+/* What fb_deferred_io_init() put in fb_mmap, it is not exported */
+static int (*vircon_defio_mmap)(struct fb_info *info,
+				struct vm_area_struct *vma);
+#endif
+
+static int vircon_resize(struct fb_info *info, unsigned long size)
 {
+	unsigned long npages = PAGE_ALIGN(size) >> PAGE_SHIFT;
+	unsigned long n = vircon_npages;
 	void *mem;
-	unsigned long adr;
-
-	size = PAGE_ALIGN(size);
-	mem = vmalloc_32(size);
-	if (!mem)
-		return NULL;
-
-	memset(mem, 0, size); /* Clear the ram out, no junk to the user */
-	adr = (unsigned long) mem;
-	while (size > 0) {
-		SetPageReserved(vmalloc_to_page((void *)adr));
-		adr += PAGE_SIZE;
-		size -= PAGE_SIZE;
+
+	if (npages == vircon_npages)
+		return 0;
+
+	mutex_lock(&vircon_mem_lock);
+	for (; n < npages; n++) {
+		/* Cleared, no junk to the user */
+		vircon_page[n] = alloc_page(GFP_HIGHUSER | __GFP_ZERO);
+		if (!vircon_page[n])
+			goto fail;
 	}
 
-	return mem;
+	mem = NULL;
+	if (npages) {
+		mem = vmap(vircon_page, npages, VM_MAP, PAGE_KERNEL);
+		if (!mem)
+			goto fail;
+	}
+
+	/* The deferred I/O fault handler checks smem_len, not our lock */
+	if (npages < vircon_npages)
+		info->fix.smem_len = npages << PAGE_SHIFT;
+	info->screen_base = (char __iomem *)mem;
+	info->fix.smem_start = (unsigned long)mem;
+	if (videomemory)
+		vunmap(videomemory);
+	videomemory = mem;
+
+	if (npages < vircon_npages) {
+		/* Nobody keeps writing to pages that are no longer the screen */
+		if (vircon_inode)
+			unmap_mapping_range(vircon_inode->i_mapping,
+					    (loff_t)npages << PAGE_SHIFT, 0, 1);
+#ifdef CONFIG_FB_DEFERRED_IO
+		/* Written pages about to go must not stay on the deferred list */
+		if (info->fbdefio)
+			flush_delayed_work(&info->deferred_work);
+#endif
+	}
+	for (; n > npages; n--) {
+#ifdef CONFIG_FB_DEFERRED_IO
+		/*
+		 * The deferred I/O fault handler points page->mapping at the
+		 * fb file, and only fb_deferred_io_cleanup() resets it. A
+		 * page freed with it set is reported as a bad page.
+		 */
+		if (info->fbdefio)
+			vircon_page[n - 1]->mapping = NULL;
+#endif
+		put_page(vircon_page[n - 1]);
+	}
+	vircon_npages = npages;
+	info->fix.smem_len = npages << PAGE_SHIFT;
+	mutex_unlock(&vircon_mem_lock);
+	return 0;
+
+fail:
+	while (n > vircon_npages)
+		put_page(vircon_page[--n]);
+	mutex_unlock(&vircon_mem_lock);
+	return -ENOMEM;
 }
 
-static void rvfree(void *mem, unsigned long size)
+static vm_fault_t vircon_vm_fault(struct vm_fault *vmf)
 {
-	unsigned long adr;
+	vm_fault_t ret = VM_FAULT_SIGBUS;
 
-	if (!mem)
-		return;
-
-	adr = (unsigned long) mem;
-	while ((long) size > 0) {
-		ClearPageReserved(vmalloc_to_page((void *)adr));
-		adr += PAGE_SIZE;
-		size -= PAGE_SIZE;
+	mutex_lock(&vircon_mem_lock);
+	if (vmf->pgoff < vircon_npages) {
+		vmf->page = vircon_page[vmf->pgoff];
+		get_page(vmf->page);
+		ret = 0;
 	}
-	vfree(mem);
+	mutex_unlock(&vircon_mem_lock);
+	return ret;
 }
 
+static const struct vm_operations_struct vircon_vm_ops = {
+	.fault		= vircon_vm_fault,
+};
+
 static struct fb_var_screeninfo vircon_default = {
 	.xres =		640,
 	.yres =		480,
@@ -136,20 +231,396 @@ static int vircon_pan_display(struct fb_var_screeninfo *var,
 			   struct fb_info *info);
 static int vircon_mmap(struct fb_info *info,
 		    struct vm_area_struct *vma);
+static ssize_t vircon_write(struct fb_info *info, const char __user *buf,
+			    size_t count, loff_t *ppos);
+static void vircon_fillrect(struct fb_info *info,
+			    const struct fb_fillrect *rect);
+static void vircon_copyarea(struct fb_info *info,
+			    const struct fb_copyarea *area);
+static void vircon_imageblit(struct fb_info *info,
+			     const struct fb_image *image);
+static int vircon_ioctl(struct fb_info *info, unsigned int cmd,
+			unsigned long arg);
 
 static struct fb_ops vircon_ops = {
 	.fb_read        = fb_sys_read,
-	.fb_write       = fb_sys_write,
+	.fb_write       = vircon_write,
 	.fb_check_var	= vircon_check_var,
 	.fb_set_par	= vircon_set_par,
 	.fb_setcolreg	= vircon_setcolreg,
 	.fb_pan_display	= vircon_pan_display,
-	.fb_fillrect	= sys_fillrect,
-	.fb_copyarea	= sys_copyarea,
-	.fb_imageblit	= sys_imageblit,
+	.fb_fillrect	= vircon_fillrect,
+	.fb_copyarea	= vircon_copyarea,
+	.fb_imageblit	= vircon_imageblit,
 	.fb_mmap	= vircon_mmap,
+	.fb_ioctl	= vircon_ioctl,
 };
 
+    /*
+     *  Dirty page tracking
+     *
+     *  Pages written through mmap are collected by the fb_deferred_io
+     *  write faults, the console drawing and write() mark theirs here.
+     *  The bitmap only exists with deferred_io.
+     */
+
+static unsigned long *vircon_dirty;
+static unsigned long vircon_pages;
+static DEFINE_SPINLOCK(vircon_dirty_lock);
+
+static void vircon_mark(unsigned long start, unsigned long len)
+{
+	unsigned long first, last, flags;
+
+	if (!vircon_dirty || !len)
+		return;
+
+	first = start >> PAGE_SHIFT;
+	last = (start + len - 1) >> PAGE_SHIFT;
+	if (first >= vircon_pages)
+		return;
+	if (last >= vircon_pages)
+		last = vircon_pages - 1;
+
+	spin_lock_irqsave(&vircon_dirty_lock, flags);
+	bitmap_set(vircon_dirty, first, last - first + 1);
+	spin_unlock_irqrestore(&vircon_dirty_lock, flags);
+}
+
+static void vircon_mark_lines(struct fb_info *info, u32 y, u32 height)
+{
+	vircon_mark(y * info->fix.line_length, height * info->fix.line_length);
+}
+
+static void vircon_mark_all(void)
+{
+	unsigned long flags;
+
+	if (!vircon_dirty)
+		return;
+
+	spin_lock_irqsave(&vircon_dirty_lock, flags);
+	bitmap_fill(vircon_dirty, vircon_pages);
+	spin_unlock_irqrestore(&vircon_dirty_lock, flags);
+}
+
+    /*
+     *  Damage ring
+     *
+     *  The drawing ops push what they changed, copies with their source,
+     *  into a ring the capture process reads from /dev/vircon_damage, see
+     *  vircon.h. Records are only kept while the device is open. A full
+     *  ring drops new records and the reader gets an overflow record.
+     */
+
+static struct fb_info *vircon_info;
+static struct vircon_damage *damage_ring;
+static u32 damage_mask;
+static u32 damage_head, damage_tail;	/* free running */
+static bool damage_lost;
+static atomic_t damage_open = ATOMIC_INIT(0);
+static DEFINE_SPINLOCK(damage_lock);
+static DECLARE_WAIT_QUEUE_HEAD(damage_wait);
+
+static void damage_push(u16 type, u32 x, u32 y, u32 w, u32 h, u32 sx, u32 sy)
+{
+	struct vircon_damage *last, *d;
+	unsigned long flags;
+
+	if (!atomic_read(&damage_open) || !w || !h)
+		return;
+
+	spin_lock_irqsave(&damage_lock, flags);
+	last = &damage_ring[(damage_head - 1) & damage_mask];
+	if (type == VIRCON_DAMAGE_RECT && damage_head != damage_tail &&
+	    last->type == VIRCON_DAMAGE_RECT && last->y == y && last->h == h &&
+	    last->x + last->w == x) {
+		/* Glyphs of a line of text come one after the other */
+		last->w += w;
+	}
+	else if (damage_head - damage_tail > damage_mask) {
+		damage_lost = true;
+	}
+	else {
+		d = &damage_ring[damage_head & damage_mask];
+		d->type = type;
+		d->flags = type == VIRCON_DAMAGE_MODE && vircon_dirty ?
+			   VIRCON_DAMAGE_COMPLETE : 0;
+		d->x = x;
+		d->y = y;
+		d->w = w;
+		d->h = h;
+		d->sx = sx;
+		d->sy = sy;
+		damage_head++;
+	}
+	spin_unlock_irqrestore(&damage_lock, flags);
+
+	wake_up_interruptible(&damage_wait);
+}
+
+static void damage_push_lines(struct fb_info *info, unsigned long start,
+			      unsigned long len)
+{
+	u32 first, last;
+
+	if (!len || !info->fix.line_length)
+		return;
+	first = start / info->fix.line_length;
+	last = (start + len - 1) / info->fix.line_length;
+	damage_push(VIRCON_DAMAGE_RECT, 0, first, info->var.xres_virtual,
+		    last - first + 1, 0, 0);
+}
+
+static int damage_open_dev(struct inode *inode, struct file *file)
+{
+	struct vircon_damage *d;
+	unsigned long flags;
+
+	if (atomic_cmpxchg(&damage_open, 0, 1))
+		return -EBUSY;
+
+	/* The reader starts from the mode, the whole screen */
+	spin_lock_irqsave(&damage_lock, flags);
+	damage_head = damage_tail = 0;
+	damage_lost = false;
+	d = &damage_ring[damage_head++];
+	memset(d, 0, sizeof(*d));
+	d->type = VIRCON_DAMAGE_MODE;
+	d->flags = vircon_dirty ? VIRCON_DAMAGE_COMPLETE : 0;
+	d->w = vircon_info->var.xres_virtual;
+	d->h = vircon_info->var.yres_virtual;
+	spin_unlock_irqrestore(&damage_lock, flags);
+
+	return nonseekable_open(inode, file);
+}
+
+static int damage_release(struct inode *inode, struct file *file)
+{
+	atomic_set(&damage_open, 0);
+	return 0;
+}
+
+static ssize_t damage_read(struct file *file, char __user *buf, size_t count,
+			   loff_t *ppos)
+{
+	struct vircon_damage *out;
+	unsigned long flags;
+	size_t n, i = 0;
+	int ret;
+
+	n = min_t(size_t, count / sizeof(*out), 256);
+	if (!n)
+		return -EINVAL;
+
+	while (damage_head == damage_tail && !damage_lost) {
+		if (file->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		ret = wait_event_interruptible(damage_wait,
+			damage_head != damage_tail || damage_lost);
+		if (ret)
+			return ret;
+	}
+
+	out = kmalloc_array(n, sizeof(*out), GFP_KERNEL);
+	if (!out)
+		return -ENOMEM;
+
+	spin_lock_irqsave(&damage_lock, flags);
+	if (damage_lost) {
+		/* The reader compares everything, the rest is of no use */
+		memset(&out[i], 0, sizeof(*out));
+		out[i++].type = VIRCON_DAMAGE_OVERFLOW;
+		damage_tail = damage_head;
+		damage_lost = false;
+	}
+	while (i < n && damage_tail != damage_head)
+		out[i++] = damage_ring[damage_tail++ & damage_mask];
+	spin_unlock_irqrestore(&damage_lock, flags);
+
+	ret = copy_to_user(buf, out, i * sizeof(*out)) ? -EFAULT : i * sizeof(*out);
+	kfree(out);
+	return ret;
+}
+
+static unsigned int damage_poll(struct file *file, poll_table *wait)
+{
+	poll_wait(file, &damage_wait, wait);
+	if (damage_head != damage_tail || damage_lost)
+		return POLLIN | POLLRDNORM;
+	return 0;
+}
+
+static const struct file_operations damage_fops = {
+	.owner		= THIS_MODULE,
+	.open		= damage_open_dev,
+	.release	= damage_release,
+	.read		= damage_read,
+	.poll		= damage_poll,
+	.llseek		= no_llseek,
+};
+
+static struct miscdevice damage_dev = {
+	.minor		= MISC_DYNAMIC_MINOR,
+	.name		= "vircon_damage",
+	.fops		= &damage_fops,
+};
+
+#ifdef CONFIG_FB_DEFERRED_IO
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 19, 0)
+static void vircon_deferred_io(struct fb_info *info,
+			       struct list_head *pagereflist)
+{
+	struct fb_deferred_io_pageref *pageref;
+	unsigned long flags, start = 0, len = 0;
+
+	spin_lock_irqsave(&vircon_dirty_lock, flags);
+	list_for_each_entry(pageref, pagereflist, list)
+		if ((pageref->offset >> PAGE_SHIFT) < vircon_pages)
+			__set_bit(pageref->offset >> PAGE_SHIFT, vircon_dirty);
+	spin_unlock_irqrestore(&vircon_dirty_lock, flags);
+
+	/* The list is sorted, runs of pages go into the ring as one rect */
+	list_for_each_entry(pageref, pagereflist, list) {
+		if (len && pageref->offset == start + len) {
+			len += PAGE_SIZE;
+			continue;
+		}
+		damage_push_lines(info, start, len);
+		start = pageref->offset;
+		len = PAGE_SIZE;
+	}
+	damage_push_lines(info, start, len);
+}
+#else
+static void vircon_deferred_io(struct fb_info *info,
+			       struct list_head *pagelist)
+{
+	struct page *page;
+	unsigned long flags, start = 0, len = 0;
+
+	spin_lock_irqsave(&vircon_dirty_lock, flags);
+	list_for_each_entry(page, pagelist, lru)
+		if (page->index < vircon_pages)
+			__set_bit(page->index, vircon_dirty);
+	spin_unlock_irqrestore(&vircon_dirty_lock, flags);
+
+	/* The list is sorted, runs of pages go into the ring as one rect */
+	list_for_each_entry(page, pagelist, lru) {
+		if (len && (page->index << PAGE_SHIFT) == start + len) {
+			len += PAGE_SIZE;
+			continue;
+		}
+		damage_push_lines(info, start, len);
+		start = page->index << PAGE_SHIFT;
+		len = PAGE_SIZE;
+	}
+	damage_push_lines(info, start, len);
+}
+#endif
+
+static struct fb_deferred_io vircon_defio = {
+	.deferred_io	= vircon_deferred_io,
+};
+#endif /* CONFIG_FB_DEFERRED_IO */
+
+static ssize_t vircon_write(struct fb_info *info, const char __user *buf,
+			    size_t count, loff_t *ppos)
+{
+	loff_t pos = *ppos;
+	ssize_t ret;
+
+	ret = fb_sys_write(info, buf, count, ppos);
+	if (ret > 0) {
+		vircon_mark(pos, ret);
+		damage_push_lines(info, pos, ret);
+	}
+	return ret;
+}
+
+static void vircon_fillrect(struct fb_info *info,
+			    const struct fb_fillrect *rect)
+{
+	sys_fillrect(info, rect);
+	vircon_mark_lines(info, rect->dy, rect->height);
+	damage_push(VIRCON_DAMAGE_RECT, rect->dx, rect->dy, rect->width,
+		    rect->height, 0, 0);
+}
+
+static void vircon_copyarea(struct fb_info *info,
+			    const struct fb_copyarea *area)
+{
+	sys_copyarea(info, area);
+	vircon_mark_lines(info, area->dy, area->height);
+	damage_push(VIRCON_DAMAGE_COPY, area->dx, area->dy, area->width,
+		    area->height, area->sx, area->sy);
+}
+
+static void vircon_imageblit(struct fb_info *info,
+			     const struct fb_image *image)
+{
+	sys_imageblit(info, image);
+	vircon_mark_lines(info, image->dy, image->height);
+	damage_push(VIRCON_DAMAGE_RECT, image->dx, image->dy, image->width,
+		    image->height, 0, 0);
+}
+
+/* Hands the pages written since the last call to fbvncserver and forgets
+ * them */
+static int vircon_ioctl(struct fb_info *info, unsigned int cmd,
+			unsigned long arg)
+{
+	struct vircon_dirty d;
+	unsigned long *snap, flags, n;
+	u8 *bytes;
+	u32 size = DIV_ROUND_UP(vircon_pages, 8);
+	int ret = 0;
+
+	if (cmd != FBIO_VIRCON_DIRTY || !vircon_dirty)
+		return -ENOTTY;
+	if (copy_from_user(&d, (void __user *)arg, sizeof(d)))
+		return -EFAULT;
+
+	d.pages = vircon_pages;
+	if (d.size < size) {
+		/* Tell the caller how big it has to be */
+		if (copy_to_user((void __user *)arg, &d, sizeof(d)))
+			return -EFAULT;
+		return -ENOSPC;
+	}
+
+	snap = kcalloc(BITS_TO_LONGS(vircon_pages), sizeof(long), GFP_KERNEL);
+	bytes = kzalloc(size, GFP_KERNEL);
+	if (!snap || !bytes) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+#ifdef CONFIG_FB_DEFERRED_IO
+	/* Pages written within the delay are still waiting for the work */
+	flush_delayed_work(&info->deferred_work);
+#endif
+
+	spin_lock_irqsave(&vircon_dirty_lock, flags);
+	bitmap_copy(snap, vircon_dirty, vircon_pages);
+	bitmap_zero(vircon_dirty, vircon_pages);
+	spin_unlock_irqrestore(&vircon_dirty_lock, flags);
+
+	d.count = 0;
+	for_each_set_bit(n, snap, vircon_pages) {
+		bytes[n / 8] |= 1 << (n % 8);
+		d.count++;
+	}
+
+	if (copy_to_user((void __user *)(uintptr_t)d.bitmap, bytes, size) ||
+	    copy_to_user((void __user *)arg, &d, sizeof(d)))
+		ret = -EFAULT;
+out:
+	kfree(bytes);
+	kfree(snap);
+	return ret;
+}
+
     /*
      *  Internal routines
      */
@@ -298,9 +769,33 @@ static int vircon_check_var(struct fb_var_screeninfo *var,
  */
 static int vircon_set_par(struct fb_info *info)
 {
-	info->fix.line_length = get_line_length(info->var.xres_virtual,
-						info->var.bits_per_pixel);
-	return 0;
+	u_long line_length = get_line_length(info->var.xres_virtual,
+					     info->var.bits_per_pixel);
+	int retval;
+
+	/*
+	 * The mode is already in var. Without the memory for it, shrink it
+	 * to the memory there is, so nobody draws past the end
+	 */
+	retval = vircon_resize(info, line_length * info->var.yres_virtual);
+	if (retval < 0) {
+		info->var.yres_virtual = info->fix.smem_len / line_length;
+		if (info->var.yres > info->var.yres_virtual)
+			info->var.yres = info->var.yres_virtual;
+		info->var.yoffset = 0;
+		printk("vircon: no memory for the mode, down to %u lines\n",
+		       info->var.yres_virtual);
+	}
+
+	info->fix.line_length = line_length;
+	/* 8 bpp pixels index the cmap, fbvncserver reads it with FBIOGETCMAP */
+	info->fix.visual = info->var.bits_per_pixel == 8 ?
+	    FB_VISUAL_PSEUDOCOLOR : FB_VISUAL_TRUECOLOR;
+	/* The whole screen reads differently now */
+	vircon_mark_all();
+	damage_push(VIRCON_DAMAGE_MODE, 0, 0, info->var.xres_virtual,
+		    info->var.yres_virtual, 0, 0);
+	return retval;
 }
 
     /*
@@ -428,10 +923,8 @@ static int vircon_pan_display(struct fb_var_screeninfo *var,
 static int vircon_mmap(struct fb_info *info,
 		    struct vm_area_struct *vma)
 {
-	unsigned long start = vma->vm_start;
 	unsigned long size = vma->vm_end - vma->vm_start;
 	unsigned long offset = vma->vm_pgoff << PAGE_SHIFT;
-	unsigned long page, pos;
 
 	if (vma->vm_pgoff > (~0UL >> PAGE_SHIFT))
 		return -EINVAL;
@@ -440,23 +933,29 @@ static int vircon_mmap(struct fb_info *info,
 	if (offset > info->fix.smem_len - size)
 		return -EINVAL;
 
-	pos = (unsigned long)info->fix.smem_start + offset;
-
-	while (size > 0) {
-		page = vmalloc_to_pfn((void *)pos);
-		if (remap_pfn_range(vma, start, page, PAGE_SIZE, PAGE_SHARED)) {
-			return -EAGAIN;
-		}
-		start += PAGE_SIZE;
-		pos += PAGE_SIZE;
-		if (size > PAGE_SIZE)
-			size -= PAGE_SIZE;
-		else
-			size = 0;
+	/* Usually all of them map the one node, vircon_resize() unmaps it */
+	mutex_lock(&vircon_mem_lock);
+	if (file_inode(vma->vm_file) != vircon_inode) {
+		if (vircon_inode)
+			iput(vircon_inode);
+		vircon_inode = file_inode(vma->vm_file);
+		ihold(vircon_inode);
 	}
+	mutex_unlock(&vircon_mem_lock);
+
+#ifdef CONFIG_FB_DEFERRED_IO
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 18, 0)
+	if (info->fbdefio)
+		return fb_deferred_io_mmap(info, vma);
+#else
+	if (vircon_defio_mmap)
+		return vircon_defio_mmap(info, vma);
+#endif
+#endif
 
+	/* Pages are mapped as they are touched, see vircon_vm_fault() */
+	vma->vm_ops = &vircon_vm_ops;
 	return 0;
-
 }
 
 #ifndef MODULE
@@ -499,24 +998,18 @@ static int vircon_probe(struct platform_device *dev)
 	int retval = -ENOMEM;
 
 	/*
-	 * For real video cards we use ioremap.
+	 * For real video cards we use ioremap. Here the pages come with
+	 * the mode, in vircon_set_par()
 	 */
-	if (!(videomemory = rvmalloc(videomemorysize)))
+	vircon_page = kvcalloc(PAGE_ALIGN(videomemorysize) >> PAGE_SHIFT,
+			       sizeof(*vircon_page), GFP_KERNEL);
+	if (!vircon_page)
 		return retval;
 
-	/*
-	 * VFB must clear memory to prevent kernel info
-	 * leakage into userspace
-	 * VGA-based drivers MUST NOT clear memory if
-	 * they want to be able to take over vgacon
-	 */
-	memset(videomemory, 0, videomemorysize);
-
 	info = framebuffer_alloc(sizeof(u32) * 256, &dev->dev);
 	if (!info)
 		goto err;
 
-	info->screen_base = (char __iomem *)videomemory;
 	info->fbops = &vircon_ops;
 
 	retval = fb_find_mode(&info->var, info, NULL,
@@ -524,12 +1017,53 @@ static int vircon_probe(struct platform_device *dev)
 
 	if (!retval || (retval == 4))
 		info->var = vircon_default;
-	vircon_fix.smem_start = (unsigned long) videomemory;
-	vircon_fix.smem_len = videomemorysize;
+	/* Deferred I/O sizes its page tracking by the largest mode */
+	vircon_fix.smem_len = PAGE_ALIGN(videomemorysize);
 	info->fix = vircon_fix;
 	info->pseudo_palette = info->par;
 	info->par = NULL;
-	info->flags = FBINFO_DEFAULT;
+	/* System memory, fbcon scrolls by copying and the ring gets copies */
+	info->flags = FBINFO_DEFAULT | FBINFO_READS_FAST;
+
+	if (deferred_io) {
+#ifdef CONFIG_FB_DEFERRED_IO
+		vircon_pages = PAGE_ALIGN(videomemorysize) >> PAGE_SHIFT;
+		vircon_dirty = kcalloc(BITS_TO_LONGS(vircon_pages),
+				       sizeof(long), GFP_KERNEL);
+		retval = -ENOMEM;
+		if (!vircon_dirty)
+			goto err1;
+
+		vircon_defio.delay = msecs_to_jiffies(deferred_io_delay);
+		info->fbdefio = &vircon_defio;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 19, 0)
+		retval = fb_deferred_io_init(info);
+		if (retval < 0) {
+			info->fbdefio = NULL;
+			goto err1;
+		}
+#else
+		/* It replaces fb_mmap, vircon_mmap() has to see mmap first */
+		fb_deferred_io_init(info);
+		vircon_defio_mmap = vircon_ops.fb_mmap;
+		vircon_ops.fb_mmap = vircon_mmap;
+#endif
+#else
+		printk("vircon: deferred_io needs CONFIG_FB_DEFERRED_IO\n");
+#endif
+	}
+	/* Nothing allocated yet */
+	info->fix.smem_len = 0;
+
+	damage_mask = roundup_pow_of_two(max(damage_ring_size, 16U)) - 1;
+	damage_ring = kcalloc(damage_mask + 1, sizeof(*damage_ring), GFP_KERNEL);
+	retval = -ENOMEM;
+	if (!damage_ring)
+		goto err1;
+	vircon_info = info;
+	retval = vircon_set_par(info);
+	if (retval < 0)
+		goto err1;
 
 	retval = fb_alloc_cmap(&info->cmap, 256, 0);
 	if (retval < 0)
@@ -540,15 +1074,33 @@ static int vircon_probe(struct platform_device *dev)
 		goto err2;
 	platform_set_drvdata(dev, info);
 
-	printk("Virtual frame buffer device, using %ldK of video memory\n",
-		videomemorysize >> 10);
+	/* Found by fbvncserver under the fb's device in sysfs */
+	damage_dev.parent = &dev->dev;
+	if (misc_register(&damage_dev) < 0) {
+		printk("vircon: cannot register the damage device\n");
+		damage_dev.parent = NULL;
+	}
+
+	printk("Virtual frame buffer device, using %uK of up to %ldK of video memory%s\n",
+		info->fix.smem_len >> 10, videomemorysize >> 10,
+		vircon_dirty ? ", deferred I/O" : "");
 	return 0;
 err2:
 	fb_dealloc_cmap(&info->cmap);
 err1:
+#ifdef CONFIG_FB_DEFERRED_IO
+	if (info->fbdefio)
+		fb_deferred_io_cleanup(info);
+#endif
+	kfree(vircon_dirty);
+	vircon_dirty = NULL;
+	kfree(damage_ring);
+	damage_ring = NULL;
+	vircon_resize(info, 0);
 	framebuffer_release(info);
 err:
-	rvfree(videomemory, videomemorysize);
+	kvfree(vircon_page);
+	vircon_page = NULL;
 	return retval;
 }
 
@@ -557,8 +1109,26 @@ static int vircon_remove(struct platform_device *dev)
 	struct fb_info *info = platform_get_drvdata(dev);
 
 	if (info) {
+		if (damage_dev.parent) {
+			misc_deregister(&damage_dev);
+			damage_dev.parent = NULL;
+		}
 		unregister_framebuffer(info);
-		rvfree(videomemory, videomemorysize);
+#ifdef CONFIG_FB_DEFERRED_IO
+		if (info->fbdefio)
+			fb_deferred_io_cleanup(info);
+#endif
+		kfree(vircon_dirty);
+		vircon_dirty = NULL;
+		kfree(damage_ring);
+		damage_ring = NULL;
+		vircon_resize(info, 0);
+		kvfree(vircon_page);
+		vircon_page = NULL;
+		if (vircon_inode) {
+			iput(vircon_inode);
+			vircon_inode = NULL;
+		}
 		fb_dealloc_cmap(&info->cmap);
 		framebuffer_release(info);
 	}
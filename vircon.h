@@ -0,0 +1,73 @@
+/*
+ * vircon.h
+ * This file is part of the vircon virtual console driver and service.
+ * Copyright (C) 2015 Dirk Herrendoerfer
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * Dirty page tracking of the vircon framebuffer, shared by the driver and
+ * fbvncserver.
+ *
+ * Loaded with deferred_io=1, vircon write-protects the pages of mmap users
+ * and notes every page written, through a write fault, or drawn by the
+ * kernel console. FBIO_VIRCON_DIRTY copies the set of pages written since
+ * the last call into the caller's bitmap and clears it. Bit n of byte n / 8
+ * stands for the page at offset n * page size of the framebuffer memory.
+ * After a mode change every page is reported. Without deferred_io the
+ * ioctl fails with ENOTTY.
+ *
+ * Damage ring of the console drawing, /dev/vircon_damage.
+ *
+ * While a process holds it open, vircon queues a vircon_damage record for
+ * every rect the console fills or draws, every copy with its source, and
+ * the lines written by write() or, with deferred_io, through mmap. Reads
+ * return whole records, a nonblocking read with nothing queued fails with
+ * EAGAIN. The first record after open and every mode change is a MODE
+ * record with the virtual size. VIRCON_DAMAGE_COMPLETE on it means writes
+ * through mmap are reported too, so the records cover every change. When
+ * the ring fills up the records are dropped and the reader gets an
+ * OVERFLOW record instead; everything may have changed. Only one process
+ * can hold the device open.
+ */
+
+#ifndef VIRCON_H
+#define VIRCON_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+struct vircon_dirty {
+	__u64 bitmap;		/* user pointer to size bytes */
+	__u32 size;
+	__u32 pages;		/* out: pages of framebuffer memory */
+	__u32 count;		/* out: of those, dirty */
+	__u32 pad;
+};
+
+#define FBIO_VIRCON_DIRTY	_IOWR('F', 0x60, struct vircon_dirty)
+
+enum {
+	VIRCON_DAMAGE_RECT = 1,
+	VIRCON_DAMAGE_COPY = 2,		/* from sx, sy to x, y */
+	VIRCON_DAMAGE_MODE = 3,
+	VIRCON_DAMAGE_OVERFLOW = 4,
+};
+
+#define VIRCON_DAMAGE_COMPLETE	(1 << 0)
+
+struct vircon_damage {
+	__u16 type;
+	__u16 flags;
+	__u16 x, y, w, h;
+	__u16 sx, sy;
+};
+
+#endif /* VIRCON_H */